@@ -29,11 +29,15 @@
 #include <yocto/yocto_cli.h>
 #include <yocto/yocto_gui.h>
 #include <yocto/yocto_math.h>
+#include <yocto/yocto_parallel.h>
 #include <yocto/yocto_scene.h>
 #include <yocto/yocto_sceneio.h>
 #include <yocto/yocto_shape.h>
 #include <yocto/yocto_trace.h>
 
+#include <filesystem>
+#include <future>
+
 using namespace yocto;
 using namespace std::string_literals;
 
@@ -48,6 +52,9 @@ void run(const vector<string>& args) {
   bool addsky      = false;
   auto envname     = ""s;
   auto savebatch   = false;
+  auto checkpoint  = 0;
+  auto resume      = false;
+  auto nthreads    = 0;
   auto params      = trace_params{};
 
   // parse command line
@@ -59,25 +66,50 @@ void run(const vector<string>& args) {
   add_option(cli, "addsky", addsky, "add sky");
   add_option(cli, "envname", envname, "add environment");
   add_option(cli, "savebatch", savebatch, "save batch");
+  add_option(cli, "checkpoint", checkpoint,
+      "save a checkpoint every N batches (0 to disable)");
+  add_option(cli, "resume", resume, "resume from the last checkpoint");
   add_option(cli, "resolution", params.resolution, "image resolution");
   add_option(
       cli, "sampler", params.sampler, "sampler type", trace_sampler_labels);
   add_option(cli, "falsecolor", params.falsecolor, "false color type",
       trace_falsecolor_labels);
   add_option(cli, "samples", params.samples, "number of samples");
+  add_option(cli, "adaptive", params.adaptive,
+      "adaptive sampling error (0 to disable)");
+  add_option(
+      cli, "adaptivemin", params.adaptivemin, "adaptive sampling min samples");
   add_option(cli, "bounces", params.bounces, "number of bounces");
   add_option(cli, "denoise", params.denoise, "enable denoiser");
   add_option(cli, "batch", params.batch, "sample batch");
+  add_option(cli, "timebudget", params.timebudget,
+      "time budget in seconds (0 to disable)");
+  add_option(cli, "tilesize", params.tilesize, "tile size (0 for scanlines)");
   add_option(cli, "clamp", params.clamp, "clamp params");
   add_option(cli, "nocaustics", params.nocaustics, "disable caustics");
   add_option(cli, "envhidden", params.envhidden, "hide environment");
   add_option(cli, "tentfilter", params.tentfilter, "filter image");
   add_option(cli, "embreebvh", params.embreebvh, "use Embree bvh");
   add_option(cli, "highqualitybvh", params.highqualitybvh, "high quality bvh");
+  add_option(cli, "widebvh", params.widebvh, "wide bvh");
+  add_option(cli, "spatialbvh", params.spatialbvh,
+      "spatial split bvh budget (0 to disable)");
+  add_option(cli, "compressedbvh", params.compressedbvh, "compressed wide bvh");
+  add_option(cli, "precomputedbvh", params.precomputedbvh,
+      "precomputed triangles in bvh");
+  add_option(cli, "lighttree", params.lighttree, "light tree sampling");
+  add_option(cli, "bvhcache", params.bvhcache, "bvh cache directory");
   add_option(cli, "noparallel", params.noparallel, "disable threading");
+  add_option(cli, "threads", nthreads, "number of threads (0 for all)");
   add_option(cli, "edit", edit, "edit interactively");
   parse_cli(cli, args);
 
+  // time budget, counting from startup
+  auto budget_timer = simple_timer{};
+
+  // threads
+  set_parallel_threads(nthreads);
+
   // start rendering
   print_info("rendering {}", scenename);
   auto timer = simple_timer{};
@@ -120,22 +152,67 @@ void run(const vector<string>& args) {
   // state
   auto state = make_trace_state(scene, params);
 
-  if (!interactive) {
-    // render
+  // resume from checkpoint, with the same scene and options used to save it
+  auto checkpointname = outname + ".ystate";
+  if (resume && path_exists(checkpointname)) {
     timer = simple_timer{};
-    for (auto sample : range(0, params.samples, params.batch)) {
-      auto sample_timer = simple_timer{};
-      trace_samples(state, scene, bvh, lights, params);
-      print_info("render sample {}/{}: {}", state.samples, params.samples,
-          elapsed_formatted(sample_timer));
-      if (savebatch && state.samples % params.batch == 0) {
-        auto render    = get_image(state);
-        auto batchname = replace_extension(outname,
-            "-" + std::to_string(state.samples) + path_extension(outname));
-        save_image(batchname, render);
-      }
-    }
+    state = load_trace_state(checkpointname, scene, params);
+    print_info("resume sample {}: {}", state.samples, elapsed_formatted(timer));
+  }
+
+  // checkpoints are written in the background to a temporary file that is
+  // renamed, so that a kill leaves a valid file. The state is copied on the
+  // render thread, which pauses for the copy; snapshots are double-buffered
+  // so that their images are reused instead of reallocated.
+  auto checkpoint_worker = std::future<trace_state>{};
+  auto save_checkpoint   = [&]() {
+    auto snapshot     = checkpoint_worker.valid() ? checkpoint_worker.get()
+                                                  : trace_state{};
+    snapshot.render   = state.render;
+    snapshot.albedo   = state.albedo;
+    snapshot.normal   = state.normal;
+    snapshot.hits     = state.hits;
+    snapshot.rngs     = state.rngs;
+    snapshot.moments  = state.moments;
+    snapshot.errors   = state.errors;
+    snapshot.samples  = state.samples;
+    checkpoint_worker = std::async(std::launch::async,
+        [snapshot = std::move(snapshot), checkpointname, &scene,
+            &params]() mutable {
+          auto tempname = checkpointname + ".tmp";
+          try {
+            save_trace_state(tempname, snapshot, scene, params);
+            std::filesystem::rename(std::filesystem::u8path(tempname),
+                std::filesystem::u8path(checkpointname));
+          } catch (const std::exception& error) {
+            print_info("cannot save checkpoint: {}", error.what());
+          }
+          return std::move(snapshot);
+        });
+  };
+
+  if (!interactive) {
+    // render, with the time budget counted from startup
+    timer             = simple_timer{};
+    auto sample_timer = simple_timer{};
+    trace_budgeted(state, scene, bvh, lights, params,
+        elapsed_seconds(budget_timer), [&](const trace_state&, int batch) {
+          print_info("render sample {}/{}: {}", state.samples, params.samples,
+              elapsed_formatted(sample_timer));
+          if (savebatch) {
+            auto render    = get_image(state);
+            auto batchname = replace_extension(outname, "") + "-" +
+                             std::to_string(state.samples) +
+                             path_extension(outname);
+            save_image(batchname, render);
+          }
+          if (checkpoint > 0 && (batch + 1) % checkpoint == 0)
+            save_checkpoint();
+          sample_timer = simple_timer{};
+        });
     print_info("render image: {}", elapsed_formatted(timer));
+    print_info("render samples: {}", state.samples);
+    if (checkpoint_worker.valid()) checkpoint_worker.get();
 
     // save image
     timer       = simple_timer{};
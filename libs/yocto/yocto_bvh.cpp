@@ -34,15 +34,26 @@
 
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <climits>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
-#include <future>
+#include <filesystem>
 #include <memory>
+#include <random>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <utility>
 
 #include "yocto_geometry.h"
+#include "yocto_parallel.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define YOCTO_BVH_SSE
+#include <emmintrin.h>
+#endif
 
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
@@ -59,93 +70,155 @@ inline const auto uint_max = std::numeric_limits<unsigned int>::max();
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
-// PARALLEL HELPERS
+// COMMON BVH FUCTIONS
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
-template <typename T, typename Func>
-inline void parallel_for(T num, Func&& func) {
-  auto              futures  = vector<std::future<void>>{};
-  auto              nthreads = std::thread::hardware_concurrency();
-  std::atomic<T>    next_idx(0);
-  std::atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, &has_error, num]() {
-          try {
-            while (true) {
-              auto idx = next_idx.fetch_add(1);
-              if (idx >= num) break;
-              if (has_error) break;
-              func(idx);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
+// Maximum number of primitives per BVH node.
+const int bvh_max_prims = 4;
+
+// Number of bins for the SAH heuristic.
+const int bvh_sah_bins = 16;
+
+// Number of primitives processed by each task when computing bounds and bins
+// of large nodes in parallel.
+const int bvh_chunk_size = 1 << 14;
+
+// Nodes with more primitives than this are built as parallel tasks.
+const int bvh_task_size = 1 << 12;
+
+// Runs `func(start, end)` on a range of primitives, splitting it in chunks
+// processed in parallel for large ranges.
+template <typename Func>
+static void for_primitives(int start, int end, bool noparallel, Func&& func) {
+  if (noparallel || end - start < 2 * bvh_chunk_size) {
+    func(start, end);
+    return;
   }
-  for (auto& f : futures) f.get();
+  auto nchunks = (end - start + bvh_chunk_size - 1) / bvh_chunk_size;
+  parallel_for(nchunks, [&](int chunk) {
+    auto cstart = start + chunk * bvh_chunk_size;
+    func(cstart, min(cstart + bvh_chunk_size, end));
+  });
 }
 
-}  // namespace yocto
-
-// -----------------------------------------------------------------------------
-// COMMON BVH FUCTIONS
-// -----------------------------------------------------------------------------
-namespace yocto {
+// Reduces a range of primitives, splitting it in chunks processed in
+// parallel for large ranges. `func(value, start, end)` accumulates a chunk
+// into a value, and `merge_values(value1, value2)` combines two values.
+template <typename T, typename Func, typename Merge>
+static T reduce_primitives(int start, int end, bool noparallel,
+    const T& init, Func&& func, Merge&& merge_values) {
+  if (noparallel || end - start < 2 * bvh_chunk_size) {
+    auto value = init;
+    func(value, start, end);
+    return value;
+  }
+  auto nchunks = (end - start + bvh_chunk_size - 1) / bvh_chunk_size;
+  auto values  = vector<T>(nchunks, init);
+  parallel_for(nchunks, [&](int chunk) {
+    auto cstart = start + chunk * bvh_chunk_size;
+    func(values[chunk], cstart, min(cstart + bvh_chunk_size, end));
+  });
+  auto value = init;
+  for (auto& cvalue : values) value = merge_values(value, cvalue);
+  return value;
+}
 
-// Splits a BVH node using the SAH heuristic. Returns split position and axis.
+// Bins of the SAH heuristic, storing primitive bounds and counts for each
+// axis.
+struct bvh_sah_bins_ {
+  array<array<bbox3f, bvh_sah_bins>, 3> bboxes = {};
+  array<array<int, bvh_sah_bins>, 3>    counts = {};
+};
+
+// Splits a BVH node using the binned SAH heuristic. Primitives are binned
+// once along each axis, in parallel for large nodes, and the cost of each
+// split between bins is computed by sweeping the bins. Returns split position
+// and axis.
 static pair<int, int> split_sah(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers,
+    const bbox3f& cbbox, int start, int end, bool noparallel) {
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
   auto csize = cbbox.max - cbbox.min;
   if (csize == vec3f{0, 0, 0}) return {(start + end) / 2, 0};
 
-  // consider N bins, compute their cost and keep the minimum
-  auto      axis      = 0;
-  const int nbins     = 16;
-  auto      split     = 0.0f;
-  auto      min_cost  = flt_max;
-  auto      bbox_area = [](const bbox3f& b) {
+  // bin index
+  auto get_bin = [&cbbox, &csize](vec3f center, int axis) {
+    if (csize[axis] == 0) return 0;
+    auto bin = (int)(bvh_sah_bins * (center[axis] - cbbox.min[axis]) /
+                     csize[axis]);
+    return clamp(bin, 0, bvh_sah_bins - 1);
+  };
+
+  // bin primitives
+  auto empty_bins = bvh_sah_bins_{};
+  for (auto axis : range(3)) empty_bins.bboxes[axis].fill(invalidb3f);
+  auto bins = reduce_primitives(
+      start, end, noparallel, empty_bins,
+      [&](bvh_sah_bins_& bins, int start, int end) {
+        for (auto i = start; i < end; i++) {
+          auto primitive = primitives[i];
+          for (auto axis : range(3)) {
+            auto bin = get_bin(centers[primitive], axis);
+            bins.bboxes[axis][bin] = merge(
+                bins.bboxes[axis][bin], bboxes[primitive]);
+            bins.counts[axis][bin] += 1;
+          }
+        }
+      },
+      [](const bvh_sah_bins_& bins1, const bvh_sah_bins_& bins2) {
+        auto bins = bins1;
+        for (auto axis : range(3)) {
+          for (auto bin : range(bvh_sah_bins)) {
+            bins.bboxes[axis][bin] = merge(
+                bins.bboxes[axis][bin], bins2.bboxes[axis][bin]);
+            bins.counts[axis][bin] += bins2.counts[axis][bin];
+          }
+        }
+        return bins;
+      });
+
+  // consider splits between bins, compute their cost and keep the minimum
+  auto axis      = 0;
+  auto split_bin = 0;
+  auto min_cost  = flt_max;
+  auto bbox_area = [](const bbox3f& b) {
     auto size = b.max - b.min;
     return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
            2 * size.y * size.z;
   };
   for (auto saxis : range(3)) {
-    for (auto b = 1; b < nbins; b++) {
-      auto bsplit    = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < bsplit) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
-        }
-      }
-      auto cost = 1 + left_nprims * bbox_area(left_bbox) / bbox_area(cbbox) +
-                  right_nprims * bbox_area(right_bbox) / bbox_area(cbbox);
+    if (csize[saxis] == 0) continue;
+    // sweep from the right to compute the right costs
+    auto right_costs = array<float, bvh_sah_bins>{};
+    auto right_bbox  = invalidb3f;
+    auto right_count = 0;
+    for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+      right_bbox = merge(right_bbox, bins.bboxes[saxis][bin]);
+      right_count += bins.counts[saxis][bin];
+      right_costs[bin] = right_count ? right_count * bbox_area(right_bbox) : 0;
+    }
+    // sweep from the left, splitting before each bin
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+      left_bbox = merge(left_bbox, bins.bboxes[saxis][bin - 1]);
+      left_count += bins.counts[saxis][bin - 1];
+      auto left_cost = left_count ? left_count * bbox_area(left_bbox) : 0;
+      auto cost      = 1 + (left_cost + right_costs[bin]) / bbox_area(cbbox);
       if (cost < min_cost) {
-        min_cost = cost;
-        split    = bsplit;
-        axis     = saxis;
+        min_cost  = cost;
+        split_bin = bin;
+        axis      = saxis;
       }
     }
   }
+
   // split
   auto middle =
       (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                [axis, split, &centers](auto primitive) {
-                  return centers[primitive][axis] < split;
+                [&](auto primitive) {
+                  return get_bin(centers[primitive], axis) < split_bin;
                 }) -
             primitives.data());
 
@@ -159,12 +232,8 @@ static pair<int, int> split_sah(vector<int>& primitives,
 // Splits a BVH node using the balance heuristic. Returns split position and
 // axis.
 [[maybe_unused]] static pair<int, int> split_balanced(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
+    const vector<vec3f>& centers, const bbox3f& cbbox, int start, int end) {
   // compute primitives bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
   auto csize = cbbox.max - cbbox.min;
   if (csize == vec3f{0, 0, 0}) return {(start + end) / 2, 0};
 
@@ -193,12 +262,8 @@ static pair<int, int> split_sah(vector<int>& primitives,
 // Splits a BVH node using the middle heuristic. Returns split position and
 // axis.
 static pair<int, int> split_middle(vector<int>& primitives,
-    const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
-    int end) {
+    const vector<vec3f>& centers, const bbox3f& cbbox, int start, int end) {
   // compute primintive bounds and size
-  auto cbbox = invalidb3f;
-  for (auto i = start; i < end; i++)
-    cbbox = merge(cbbox, centers[primitives[i]]);
   auto csize = cbbox.max - cbbox.min;
   if (csize == vec3f{0, 0, 0}) return {(start + end) / 2, 0};
 
@@ -224,29 +289,82 @@ static pair<int, int> split_middle(vector<int>& primitives,
   return {middle, axis};
 }
 
-// Maximum number of primitives per BVH node.
-const int bvh_max_prims = 4;
-
-// Build BVH nodes
-static bvh_tree make_bvh(const vector<bbox3f>& bboxes, bool highquality) {
-  // bvh
-  auto bvh = bvh_tree{};
-
-  // prepare to build nodes
-  bvh.nodes.clear();
-  bvh.nodes.reserve(bboxes.size() * 2);
+// Shared data for building BVH nodes. Nodes are preallocated, and children
+// are allocated in pairs with an atomic counter, so that subtrees can be
+// built in parallel.
+struct bvh_builder {
+  bvh_tree&             bvh;
+  const vector<bbox3f>& bboxes;
+  vector<vec3f>         centers     = {};
+  std::atomic<int>      num_nodes   = 0;
+  bool                  highquality = false;
+  bool                  noparallel  = false;
+};
+
+// Build a BVH node, splitting it if needed. Returns the children to build.
+static array<vec3i, 2> make_bvh_node(
+    bvh_builder& builder, int nodeid, int start, int end) {
+  // grab node
+  auto& bvh  = builder.bvh;
+  auto& node = bvh.nodes[nodeid];
+
+  // compute bounds and centroid bounds
+  auto [bbox, cbbox] = reduce_primitives(
+      start, end, builder.noparallel, pair{invalidb3f, invalidb3f},
+      [&](pair<bbox3f, bbox3f>& bounds, int start, int end) {
+        for (auto i = start; i < end; i++) {
+          auto primitive = bvh.primitives[i];
+          bounds.first   = merge(bounds.first, builder.bboxes[primitive]);
+          bounds.second  = merge(bounds.second, builder.centers[primitive]);
+        }
+      },
+      [](const pair<bbox3f, bbox3f>& bounds1,
+          const pair<bbox3f, bbox3f>& bounds2) {
+        return pair{merge(bounds1.first, bounds2.first),
+            merge(bounds1.second, bounds2.second)};
+      });
+  node.bbox = bbox;
+
+  // make a leaf node
+  if (end - start <= bvh_max_prims) {
+    node.internal = false;
+    node.num      = (int16_t)(end - start);
+    node.start    = start;
+    return {vec3i{-1, 0, 0}, vec3i{-1, 0, 0}};
+  }
 
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx : range(bboxes.size())) bvh.primitives[idx] = (int)idx;
+  // get split
+  auto [mid, axis] =
+      builder.highquality
+          ? split_sah(bvh.primitives, builder.bboxes, builder.centers, cbbox,
+                start, end, builder.noparallel)
+          : split_middle(bvh.primitives, builder.centers, cbbox, start, end);
+
+  // make an internal node
+  node.internal = true;
+  node.axis     = (uint8_t)axis;
+  node.num      = 2;
+  node.start    = builder.num_nodes.fetch_add(2);
+  return {vec3i{node.start + 0, start, mid}, vec3i{node.start + 1, mid, end}};
+}
 
-  // prepare centers
-  auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx : range(bboxes.size())) centers[idx] = center(bboxes[idx]);
+// Build a BVH subtree. Large subtrees are split in parallel tasks, while
+// small ones are built serially with a stack.
+static void make_bvh_nodes(bvh_builder& builder, int nodeid, int start,
+    int end) {
+  // build large nodes in parallel
+  if (!builder.noparallel && end - start > bvh_task_size) {
+    auto children = make_bvh_node(builder, nodeid, start, end);
+    if (children[0].x < 0) return;
+    parallel_tasks(2, [&](int idx) {
+      auto [child, cstart, cend] = children[idx];
+      make_bvh_nodes(builder, child, cstart, cend);
+    });
+    return;
+  }
 
   // push first node onto the stack
-  auto stack = vector<vec3i>{{0, 0, (int)bboxes.size()}};
-  bvh.nodes.emplace_back();
+  auto stack = vector<vec3i>{{nodeid, start, end}};
 
   // create nodes until the stack is empty
   while (!stack.empty()) {
@@ -254,192 +372,1292 @@ static bvh_tree make_bvh(const vector<bbox3f>& bboxes, bool highquality) {
     auto [nodeid, start, end] = stack.back();
     stack.pop_back();
 
-    // grab node
-    auto& node = bvh.nodes[nodeid];
+    // build node and push children
+    auto children = make_bvh_node(builder, nodeid, start, end);
+    if (children[0].x < 0) continue;
+    stack.push_back(children[0]);
+    stack.push_back(children[1]);
+  }
+}
 
-    // compute bounds
-    node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[bvh.primitives[i]]);
+// Reorder BVH nodes depth first, so that children pairs are after their
+// parents, as required by refit, and nodes are numbered the same way
+// regardless of the order in which they were created.
+static void reorder_bvh(bvh_tree& bvh) {
+  // check empty
+  if (bvh.nodes.empty()) return;
 
-    // split into two children
-    if (end - start > bvh_max_prims) {
-      // get split
-      auto [mid, axis] =
-          highquality
-              ? split_sah(bvh.primitives, bboxes, centers, start, end)
-              : split_middle(bvh.primitives, bboxes, centers, start, end);
-
-      // make an internal node
-      node.internal = true;
-      node.axis     = (uint8_t)axis;
-      node.num      = 2;
-      node.start    = (int)bvh.nodes.size();
-      bvh.nodes.emplace_back();
-      bvh.nodes.emplace_back();
-      stack.push_back({node.start + 0, start, mid});
-      stack.push_back({node.start + 1, mid, end});
-    } else {
-      // Make a leaf node
-      node.internal = false;
-      node.num      = (int16_t)(end - start);
-      node.start    = start;
-    }
+  // new nodes, with the root first
+  auto nodes = vector<bvh_node>{};
+  nodes.reserve(bvh.nodes.size());
+  nodes.push_back(bvh.nodes[0]);
+
+  // copy children pairs, as pairs of old and new node indices
+  auto stack = vector<vec2i>{{0, 0}};
+  while (!stack.empty()) {
+    auto [old_id, new_id] = stack.back();
+    stack.pop_back();
+    if (!nodes[new_id].internal) continue;
+    auto old_start      = nodes[new_id].start;
+    auto new_start      = (int)nodes.size();
+    nodes[new_id].start = new_start;
+    nodes.push_back(bvh.nodes[old_start + 0]);
+    nodes.push_back(bvh.nodes[old_start + 1]);
+    stack.push_back({old_start + 1, new_start + 1});
+    stack.push_back({old_start + 0, new_start + 0});
   }
 
+  // update nodes
+  bvh.nodes = std::move(nodes);
+}
+
+// Build BVH nodes
+static bvh_tree make_bvh(
+    const vector<bbox3f>& bboxes, bool highquality, bool noparallel) {
+  // bvh
+  auto bvh = bvh_tree{};
+
+  // prepare to build nodes, with enough nodes for any binary tree
+  bvh.nodes.resize(max((int)bboxes.size() * 2, 1));
+
+  // prepare primitives
+  bvh.primitives.resize(bboxes.size());
+  for (auto idx : range(bboxes.size())) bvh.primitives[idx] = (int)idx;
+
+  // prepare builder
+  auto builder        = bvh_builder{bvh, bboxes};
+  builder.highquality = highquality;
+  builder.noparallel  = noparallel;
+  builder.num_nodes   = 1;
+
+  // prepare centers
+  builder.centers = vector<vec3f>(bboxes.size());
+  for (auto idx : range(bboxes.size()))
+    builder.centers[idx] = center(bboxes[idx]);
+
+  // build nodes starting from the root
+  make_bvh_nodes(builder, 0, 0, (int)bboxes.size());
+
   // cleanup
+  bvh.nodes.resize(builder.num_nodes);
   bvh.nodes.shrink_to_fit();
 
+  // number nodes depth first, since parallel builds create them in any order
+  if (!noparallel) reorder_bvh(bvh);
+
   // done
   return bvh;
 }
 
-// Update bvh
-static void refit_bvh(bvh_tree& bvh, const vector<bbox3f>& bboxes) {
-  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
-    auto& node = bvh.nodes[nodeid];
-    node.bbox  = invalidb3f;
-    if (node.internal) {
-      for (auto idx : range(2)) {
-        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
-      }
-    } else {
-      for (auto idx : range(node.num)) {
-        node.bbox = merge(node.bbox, bboxes[bvh.primitives[node.start + idx]]);
+// Primitive reference for spatial split BVHs. References to the same
+// primitive are duplicated when the primitive is split, each with its
+// clipped bounds.
+struct bvh_reference {
+  bbox3f bbox      = invalidb3f;
+  int    primitive = -1;
+};
+
+// Bounds of a polygon clipped to a box, using Sutherland-Hodgman clipping
+// against the box planes.
+static bbox3f clip_polygon_bounds(
+    const array<vec3f, 4>& polygon, int num, const bbox3f& bbox) {
+  auto vertices  = array<vec3f, 16>{};
+  auto clipped   = array<vec3f, 16>{};
+  auto nvertices = num;
+  for (auto idx : range(num)) vertices[idx] = polygon[idx];
+  for (auto axis : range(3)) {
+    for (auto side : range(2)) {
+      auto plane    = side == 0 ? bbox.min[axis] : bbox.max[axis];
+      auto inside   = [&](vec3f p) {
+        return side == 0 ? p[axis] >= plane : p[axis] <= plane;
+      };
+      auto nclipped = 0;
+      for (auto idx : range(nvertices)) {
+        auto p0 = vertices[idx], p1 = vertices[(idx + 1) % nvertices];
+        if (inside(p0)) clipped[nclipped++] = p0;
+        if (inside(p0) != inside(p1)) {
+          auto t               = (plane - p0[axis]) / (p1[axis] - p0[axis]);
+          auto p               = p0 + (p1 - p0) * t;
+          p[axis]              = plane;
+          clipped[nclipped++] = p;
+        }
       }
+      vertices  = clipped;
+      nvertices = nclipped;
+      if (nvertices == 0) return invalidb3f;
     }
   }
+  auto result = invalidb3f;
+  for (auto idx : range(nvertices)) result = merge(result, vertices[idx]);
+  // clamp to the box for robustness
+  result.min = max(result.min, bbox.min);
+  result.max = min(result.max, bbox.max);
+  return result;
 }
 
-// Intersect ray with a bvh.
-template <typename Intersect>
-static shape_intersection intersect_elements_bvh(const bvh_tree& bvh,
-    Intersect&& intersect_element, const ray3f& ray_, bool find_any) {
-  // check empty
-  if (bvh.nodes.empty()) return {};
-
-  // node stack
-  auto node_stack        = array<int, 128>{};
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
-
-  // shared variables
-  auto intersection = shape_intersection{};
+// Bounds of a line with radius clipped to a box. The segment is clipped to
+// the box enlarged by the largest radius, and the bounds of the remaining
+// sub-segment are clamped to the box.
+static bbox3f clip_line_bounds(
+    vec3f p0, vec3f p1, float r0, float r1, const bbox3f& bbox) {
+  auto radius = max(r0, r1);
+  auto tmin = 0.0f, tmax = 1.0f;
+  for (auto axis : range(3)) {
+    auto lower = bbox.min[axis] - radius, upper = bbox.max[axis] + radius;
+    auto d     = p1[axis] - p0[axis];
+    if (d == 0) {
+      if (p0[axis] < lower || p0[axis] > upper) return invalidb3f;
+      continue;
+    }
+    auto t0 = (lower - p0[axis]) / d, t1 = (upper - p0[axis]) / d;
+    if (t0 > t1) std::swap(t0, t1);
+    tmin = max(tmin, t0);
+    tmax = min(tmax, t1);
+    if (tmin > tmax) return invalidb3f;
+  }
+  auto result = line_bounds(p0 + (p1 - p0) * tmin, p0 + (p1 - p0) * tmax,
+      r0 + (r1 - r0) * tmin, r0 + (r1 - r0) * tmax);
+  // clamp to the box for robustness
+  result.min = max(result.min, bbox.min);
+  result.max = min(result.max, bbox.max);
+  if (result.min.x > result.max.x || result.min.y > result.max.y ||
+      result.min.z > result.max.z)
+    return invalidb3f;
+  return result;
+}
 
-  // copy ray to modify it
-  auto ray = ray_;
+// Splits a BVH node using the SAH heuristic, considering both object and
+// spatial splits. Spatial splits clip references at bin boundaries and are
+// used when they are cheaper than object splits, as long as the number of
+// duplicated references stays within the budget.
+// Returns the references of the two children and the split axis.
+template <typename Clip>
+static pair<vector<bvh_reference>, vector<bvh_reference>> split_spatial_sah(
+    vector<bvh_reference>& references, const bbox3f& node_bbox,
+    float root_area, int& budget, int& axis, Clip&& clip_primitive) {
+  // bbox area
+  auto bbox_area = [](const bbox3f& b) {
+    auto size = b.max - b.min;
+    return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
+           2 * size.y * size.z;
+  };
+  auto num = (int)references.size();
 
-  // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
+  // centroid bounds
+  auto cbbox = invalidb3f;
+  for (auto& reference : references)
+    cbbox = merge(cbbox, center(reference.bbox));
+  auto csize = cbbox.max - cbbox.min;
 
-  // walking stack
-  while (node_cur) {
-    // grab node
-    auto& node = bvh.nodes[node_stack[--node_cur]];
+  // object split: binned SAH on reference centroids
+  auto object_cost  = flt_max;
+  auto object_axis  = -1;
+  auto object_bin   = 0;
+  auto object_bbox1 = invalidb3f, object_bbox2 = invalidb3f;
+  auto get_bin      = [&cbbox, &csize](vec3f center, int axis) {
+    auto bin = (int)(bvh_sah_bins * (center[axis] - cbbox.min[axis]) /
+                     csize[axis]);
+    return clamp(bin, 0, bvh_sah_bins - 1);
+  };
+  for (auto axis : range(3)) {
+    if (csize[axis] == 0) continue;
+    auto bboxes = array<bbox3f, bvh_sah_bins>{};
+    auto counts = array<int, bvh_sah_bins>{};
+    bboxes.fill(invalidb3f);
+    for (auto& reference : references) {
+      auto bin    = get_bin(center(reference.bbox), axis);
+      bboxes[bin] = merge(bboxes[bin], reference.bbox);
+      counts[bin] += 1;
+    }
+    auto right_bboxes = array<bbox3f, bvh_sah_bins>{};
+    auto right_counts = array<int, bvh_sah_bins>{};
+    auto right_bbox   = invalidb3f;
+    auto right_count  = 0;
+    for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+      right_bbox        = merge(right_bbox, bboxes[bin]);
+      right_count       = right_count + counts[bin];
+      right_bboxes[bin] = right_bbox;
+      right_counts[bin] = right_count;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+      left_bbox  = merge(left_bbox, bboxes[bin - 1]);
+      left_count = left_count + counts[bin - 1];
+      if (left_count == 0 || right_counts[bin] == 0) continue;
+      auto cost = left_count * bbox_area(left_bbox) +
+                  right_counts[bin] * bbox_area(right_bboxes[bin]);
+      if (cost < object_cost) {
+        object_cost  = cost;
+        object_axis  = axis;
+        object_bin   = bin;
+        object_bbox1 = left_bbox;
+        object_bbox2 = right_bboxes[bin];
+      }
+    }
+  }
 
-    // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+  // spatial split: only if children overlap and there is budget left
+  auto spatial_cost = flt_max;
+  auto spatial_axis = -1;
+  auto spatial_pos  = 0.0f;
+  auto overlap      = object_axis < 0
+                          ? bbox3f{node_bbox}
+                          : bbox3f{max(object_bbox1.min, object_bbox2.min),
+                           min(object_bbox1.max, object_bbox2.max)};
+  auto has_overlap  = overlap.min.x <= overlap.max.x &&
+                     overlap.min.y <= overlap.max.y &&
+                     overlap.min.z <= overlap.max.z;
+  if (budget > 0 && has_overlap &&
+      bbox_area(overlap) / root_area > 1e-5f) {
+    auto nsize = node_bbox.max - node_bbox.min;
+    for (auto axis : range(3)) {
+      if (nsize[axis] == 0) continue;
+      auto bin_size = nsize[axis] / bvh_sah_bins;
+      auto bboxes   = array<bbox3f, bvh_sah_bins>{};
+      auto entries  = array<int, bvh_sah_bins>{};
+      auto exits    = array<int, bvh_sah_bins>{};
+      bboxes.fill(invalidb3f);
+      for (auto& reference : references) {
+        auto first = clamp((int)((reference.bbox.min[axis] -
+                                     node_bbox.min[axis]) /
+                                 bin_size),
+            0, bvh_sah_bins - 1);
+        auto last  = clamp((int)((reference.bbox.max[axis] -
+                                    node_bbox.min[axis]) /
+                                bin_size),
+             first, bvh_sah_bins - 1);
+        for (auto bin = first; bin <= last; bin++) {
+          auto bin_bbox      = reference.bbox;
+          bin_bbox.min[axis] = max(bin_bbox.min[axis],
+              node_bbox.min[axis] + bin * bin_size);
+          bin_bbox.max[axis] = min(bin_bbox.max[axis],
+              node_bbox.min[axis] + (bin + 1) * bin_size);
+          bboxes[bin] = merge(
+              bboxes[bin], clip_primitive(reference.primitive, bin_bbox));
+        }
+        entries[first] += 1;
+        exits[last] += 1;
+      }
+      auto right_bboxes = array<bbox3f, bvh_sah_bins>{};
+      auto right_counts = array<int, bvh_sah_bins>{};
+      auto right_bbox   = invalidb3f;
+      auto right_count  = 0;
+      for (auto bin = bvh_sah_bins - 1; bin > 0; bin--) {
+        right_bbox        = merge(right_bbox, bboxes[bin]);
+        right_count       = right_count + exits[bin];
+        right_bboxes[bin] = right_bbox;
+        right_counts[bin] = right_count;
+      }
+      auto left_bbox  = invalidb3f;
+      auto left_count = 0;
+      for (auto bin = 1; bin < bvh_sah_bins; bin++) {
+        left_bbox  = merge(left_bbox, bboxes[bin - 1]);
+        left_count = left_count + entries[bin - 1];
+        if (left_count == 0 || right_counts[bin] == 0) continue;
+        if (left_count == num && right_counts[bin] == num) continue;
+        if (left_count + right_counts[bin] - num > budget) continue;
+        auto cost = left_count * bbox_area(left_bbox) +
+                    right_counts[bin] * bbox_area(right_bboxes[bin]);
+        if (cost < spatial_cost) {
+          spatial_cost = cost;
+          spatial_axis = axis;
+          spatial_pos  = node_bbox.min[axis] + bin * bin_size;
+        }
+      }
+    }
+  }
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis]) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
+  // split references
+  auto left = vector<bvh_reference>{}, right = vector<bvh_reference>{};
+  if (spatial_axis >= 0 && spatial_cost < object_cost) {
+    axis = spatial_axis;
+    for (auto& reference : references) {
+      if (reference.bbox.max[axis] <= spatial_pos) {
+        left.push_back(reference);
+      } else if (reference.bbox.min[axis] >= spatial_pos) {
+        right.push_back(reference);
       } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
+        auto left_bbox = reference.bbox, right_bbox = reference.bbox;
+        left_bbox.max[axis]  = spatial_pos;
+        right_bbox.min[axis] = spatial_pos;
+        left_bbox  = clip_primitive(reference.primitive, left_bbox);
+        right_bbox = clip_primitive(reference.primitive, right_bbox);
+        if (left_bbox.min.x <= left_bbox.max.x)
+          left.push_back({left_bbox, reference.primitive});
+        if (right_bbox.min.x <= right_bbox.max.x)
+          right.push_back({right_bbox, reference.primitive});
       }
-    } else {
-      for (auto idx : range(node.num)) {
-        auto primitive     = bvh.primitives[node.start + idx];
-        auto eintersection = intersect_element(primitive, ray);
-        if (!eintersection.hit) continue;
-        intersection = {
-            primitive, eintersection.uv, eintersection.distance, true};
-        ray.tmax = eintersection.distance;
+    }
+    budget -= (int)(left.size() + right.size()) - num;
+    if (!left.empty() && !right.empty()) return {left, right};
+    budget += (int)(left.size() + right.size()) - num;
+    left.clear();
+    right.clear();
+  }
+  if (object_axis >= 0) {
+    axis = object_axis;
+    for (auto& reference : references) {
+      if (get_bin(center(reference.bbox), object_axis) < object_bin) {
+        left.push_back(reference);
+      } else {
+        right.push_back(reference);
       }
     }
-
-    // check for early exit
-    if (find_any && intersection.hit) return intersection;
+    return {left, right};
   }
 
-  return intersection;
+  // if we were not able to split, just break the references in half
+  axis  = 0;
+  left  = {references.begin(), references.begin() + num / 2};
+  right = {references.begin() + num / 2, references.end()};
+  return {left, right};
 }
 
-// Intersect ray with a bvh.
-template <typename Overlap>
-static shape_intersection overlap_elements_bvh(const bvh_tree& bvh,
-    Overlap&& overlap_element, vec3f pos, float max_distance, bool find_any) {
-  // check if empty
-  if (bvh.nodes.empty()) return {};
+// Build BVH nodes with spatial splits. The primitive array stores primitive
+// references, so primitives may appear more than once. At most `budget`
+// times the number of primitives extra references are created.
+template <typename Clip>
+static bvh_tree make_spatial_bvh(
+    const vector<bbox3f>& bboxes, float budget, Clip&& clip_primitive) {
+  // bvh
+  auto bvh = bvh_tree{};
 
-  // node stack
-  auto node_stack        = array<int, 128>{};
-  auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  // prepare references
+  auto references = vector<bvh_reference>(bboxes.size());
+  for (auto idx : range(bboxes.size()))
+    references[idx] = {bboxes[idx], (int)idx};
 
-  // hit
-  auto intersection = shape_intersection{};
+  // reference budget
+  auto max_references = (int)(bboxes.size() * budget);
 
-  // walking stack
-  while (node_cur) {
-    // grab node
-    auto& node = bvh.nodes[node_stack[--node_cur]];
+  // root area
+  auto root_bbox = invalidb3f;
+  for (auto& bbox : bboxes) root_bbox = merge(root_bbox, bbox);
+  auto root_size = root_bbox.max - root_bbox.min;
+  auto root_area = 1e-12f + 2 * root_size.x * root_size.y +
+                   2 * root_size.x * root_size.z +
+                   2 * root_size.y * root_size.z;
 
-    // intersect bbox
-    if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
+  // push first node onto the stack
+  auto stack = vector<pair<int, vector<bvh_reference>>>{};
+  stack.push_back({0, std::move(references)});
+  bvh.nodes.emplace_back();
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // internal node
-      node_stack[node_cur++] = node.start + 0;
-      node_stack[node_cur++] = node.start + 1;
-    } else {
-      for (auto idx : range(node.num)) {
-        auto primitive     = bvh.primitives[node.start + idx];
-        auto eintersection = overlap_element(primitive, pos, max_distance);
-        if (!eintersection.hit) continue;
-        intersection = {
-            primitive, eintersection.uv, eintersection.distance, true};
-        max_distance = eintersection.distance;
-      }
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [nodeid, node_references] = std::move(stack.back());
+    stack.pop_back();
+
+    // compute bounds
+    auto bbox = invalidb3f;
+    for (auto& reference : node_references)
+      bbox = merge(bbox, reference.bbox);
+    bvh.nodes[nodeid].bbox = bbox;
+
+    // make a leaf node
+    if ((int)node_references.size() <= bvh_max_prims) {
+      auto& node    = bvh.nodes[nodeid];
+      node.internal = false;
+      node.num      = (int16_t)node_references.size();
+      node.start    = (int)bvh.primitives.size();
+      for (auto& reference : node_references)
+        bvh.primitives.push_back(reference.primitive);
+      continue;
     }
 
-    // check for early exit
-    if (find_any && intersection.hit) return intersection;
+    // split into two children
+    auto axis          = 0;
+    auto [left, right] = split_spatial_sah(node_references, bbox, root_area,
+        max_references, axis, clip_primitive);
+    node_references.clear();
+
+    // make an internal node, taking care that adding nodes invalidates
+    // references to them
+    auto  start   = (int)bvh.nodes.size();
+    auto& node    = bvh.nodes[nodeid];
+    node.internal = true;
+    node.axis     = (uint8_t)axis;
+    node.num      = 2;
+    node.start    = start;
+    bvh.nodes.emplace_back();
+    bvh.nodes.emplace_back();
+    stack.push_back({start + 0, std::move(left)});
+    stack.push_back({start + 1, std::move(right)});
   }
 
-  return intersection;
+  // cleanup
+  bvh.nodes.shrink_to_fit();
+  bvh.primitives.shrink_to_fit();
+
+  // done
+  return bvh;
 }
 
-}  // namespace yocto
+// Collapse a binary bvh into wide nodes. Each wide node takes the children
+// of a binary node, and repeatedly opens the largest internal child until
+// it has `bvh_wide_size` children.
+static void make_wide_bvh(bvh_tree& bvh) {
+  // clear
+  bvh.wide_nodes.clear();
+  if (bvh.nodes.empty()) return;
 
-// -----------------------------------------------------------------------------
-// BVH FOR SHAPE ELEMENTS
-// -----------------------------------------------------------------------------
-namespace yocto {
+  // surface area
+  auto bbox_area = [](const bbox3f& b) {
+    auto size = b.max - b.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
 
-// Build shape bvh
-bvh_tree make_points_bvh(const vector<int>& points,
-    const vector<vec3f>& positions, const vector<float>& radius,
-    bool highquality) {
-  // build primitives
-  auto bboxes = vector<bbox3f>(points.size());
-  for (auto idx : range(bboxes.size())) {
-    auto& p     = points[idx];
-    bboxes[idx] = point_bounds(positions[p], radius[p]);
+  // push first node onto the stack
+  auto stack = vector<pair<int, int>>{{0, 0}};
+  bvh.wide_nodes.emplace_back();
+
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [nodeid, wideid] = stack.back();
+    stack.pop_back();
+
+    // gather children
+    auto children = array<int, bvh_wide_size>{};
+    auto count    = 0;
+    if (bvh.nodes[nodeid].internal) {
+      children[count++] = bvh.nodes[nodeid].start + 0;
+      children[count++] = bvh.nodes[nodeid].start + 1;
+    } else {
+      children[count++] = nodeid;
+    }
+    while (count < bvh_wide_size) {
+      auto largest = -1;
+      for (auto idx : range(count)) {
+        auto& child = bvh.nodes[children[idx]];
+        if (!child.internal) continue;
+        if (largest < 0 || bbox_area(child.bbox) >
+                               bbox_area(bvh.nodes[children[largest]].bbox))
+          largest = idx;
+      }
+      if (largest < 0) break;
+      auto start        = bvh.nodes[children[largest]].start;
+      children[largest] = start + 0;
+      children[count++] = start + 1;
+    }
+
+    // make wide node
+    auto node  = bvh_wide_node{};
+    node.count = (int8_t)count;
+    for (auto idx : range(count)) {
+      auto& child        = bvh.nodes[children[idx]];
+      node.min_x[idx]    = child.bbox.min.x;
+      node.min_y[idx]    = child.bbox.min.y;
+      node.min_z[idx]    = child.bbox.min.z;
+      node.max_x[idx]    = child.bbox.max.x;
+      node.max_y[idx]    = child.bbox.max.y;
+      node.max_z[idx]    = child.bbox.max.z;
+      node.internal[idx] = child.internal;
+      if (child.internal) {
+        node.start[idx] = (int)bvh.wide_nodes.size();
+        node.num[idx]   = 0;
+        bvh.wide_nodes.emplace_back();
+        stack.push_back({children[idx], node.start[idx]});
+      } else {
+        node.start[idx] = child.start;
+        node.num[idx]   = child.num;
+      }
+    }
+    bvh.wide_nodes[wideid] = node;
   }
 
-  // build nodes
-  return make_bvh(bboxes, highquality);
+  // cleanup
+  bvh.wide_nodes.shrink_to_fit();
+}
+
+// Quantization scale for a grid of 255 cells of power of two size that covers
+// the given extent. Returns the exponent of the cell size.
+static int8_t make_compressed_scale(float origin, float max) {
+  auto exponent = -126;
+  if (max > origin) {
+    std::frexp((max - origin) / 255, &exponent);
+    exponent = clamp(exponent, -126, 127);
+    while (exponent < 127 && origin + 255 * std::ldexp(1.0f, exponent) < max)
+      exponent += 1;
+  }
+  return (int8_t)exponent;
+}
+
+// Cell size for a quantization exponent.
+static float get_compressed_scale(int8_t exponent) {
+  return std::bit_cast<float>((uint32_t)(exponent + 127) << 23);
+}
+
+// Quantize a bound on the grid, rounding down for minimum values and up for
+// maximum values, so that dequantized bounds are conservative. Bounds are
+// rounded outward by one more ulp, so that they stay conservative if the
+// dequantization multiply-add is rounded differently in traversal.
+static uint8_t quantize_compressed(
+    float value, float origin, float scale, bool round_up) {
+  auto target    = std::nextafter(value, round_up ? flt_max : -flt_max);
+  auto quantized = clamp((int)std::floor((target - origin) / scale), 0, 255);
+  if (round_up) {
+    while (quantized < 255 && origin + (float)quantized * scale < target)
+      quantized += 1;
+  } else {
+    while (quantized > 0 && origin + (float)quantized * scale > target)
+      quantized -= 1;
+  }
+  return (uint8_t)quantized;
+}
+
+// Check whether a child of a wide or compressed node is internal
+static bool is_internal_child(const bvh_wide_node& node, int child) {
+  return node.internal[child];
+}
+static bool is_internal_child(const bvh_compressed_node& node, int child) {
+  return node.num[child] == bvh_compressed_internal;
+}
+
+// Bounds of a child of a wide or compressed node. Compressed bounds are
+// dequantized as in intersect_wide_node().
+static bbox3f get_child_bbox(const bvh_wide_node& node, int child) {
+  return {{node.min_x[child], node.min_y[child], node.min_z[child]},
+      {node.max_x[child], node.max_y[child], node.max_z[child]}};
+}
+static bbox3f get_child_bbox(const bvh_compressed_node& node, int child) {
+  auto scale_x = get_compressed_scale(node.scale[0]);
+  auto scale_y = get_compressed_scale(node.scale[1]);
+  auto scale_z = get_compressed_scale(node.scale[2]);
+  return {{node.origin.x + (float)node.min_x[child] * scale_x,
+              node.origin.y + (float)node.min_y[child] * scale_y,
+              node.origin.z + (float)node.min_z[child] * scale_z},
+      {node.origin.x + (float)node.max_x[child] * scale_x,
+          node.origin.y + (float)node.max_y[child] * scale_y,
+          node.origin.z + (float)node.max_z[child] * scale_z}};
+}
+
+// Quantize the bounds of the children of a compressed node to the grid of
+// the node, that covers them.
+static void quantize_compressed_node(bvh_compressed_node& node,
+    const array<bbox3f, bvh_wide_size>& children) {
+  // node bounds
+  auto bbox = invalidb3f;
+  for (auto idx : range((int)node.count)) bbox = merge(bbox, children[idx]);
+  if (node.count == 0) bbox = {{0, 0, 0}, {0, 0, 0}};
+
+  // grid, enlarged by one ulp to fit the rounded bounds
+  for (auto axis : range(3)) {
+    bbox.min[axis] = std::nextafter(bbox.min[axis], -flt_max);
+    bbox.max[axis] = std::nextafter(bbox.max[axis], flt_max);
+  }
+  node.origin = bbox.min;
+  for (auto axis : range(3)) {
+    node.scale[axis] = make_compressed_scale(bbox.min[axis], bbox.max[axis]);
+  }
+  auto scale = vec3f{get_compressed_scale(node.scale[0]),
+      get_compressed_scale(node.scale[1]), get_compressed_scale(node.scale[2])};
+
+  // children
+  auto& origin = node.origin;
+  for (auto idx : range((int)node.count)) {
+    auto& child     = children[idx];
+    node.min_x[idx] = quantize_compressed(
+        child.min.x, origin.x, scale.x, false);
+    node.min_y[idx] = quantize_compressed(
+        child.min.y, origin.y, scale.y, false);
+    node.min_z[idx] = quantize_compressed(
+        child.min.z, origin.z, scale.z, false);
+    node.max_x[idx] = quantize_compressed(child.max.x, origin.x, scale.x, true);
+    node.max_y[idx] = quantize_compressed(child.max.y, origin.y, scale.y, true);
+    node.max_z[idx] = quantize_compressed(child.max.z, origin.z, scale.z, true);
+  }
+}
+
+// Compress wide nodes, quantizing child bounds to the grid of each node.
+// Binary and wide nodes are cleared, since compressed nodes are used in their
+// place for all queries.
+static void make_compressed_bvh(bvh_tree& bvh) {
+  bvh.compressed_nodes.clear();
+  bvh.compressed_nodes.resize(bvh.wide_nodes.size());
+  for (auto nodeid : range(bvh.wide_nodes.size())) {
+    auto& wnode    = bvh.wide_nodes[nodeid];
+    auto& cnode    = bvh.compressed_nodes[nodeid];
+    auto  children = array<bbox3f, bvh_wide_size>{};
+    cnode.count    = wnode.count;
+    for (auto idx : range((int)wnode.count)) {
+      children[idx]    = get_child_bbox(wnode, idx);
+      cnode.start[idx] = wnode.start[idx];
+      cnode.num[idx]   = wnode.internal[idx] ? bvh_compressed_internal
+                                             : (uint8_t)wnode.num[idx];
+    }
+    quantize_compressed_node(cnode, children);
+  }
+
+  // cleanup
+  bvh.nodes.clear();
+  bvh.nodes.shrink_to_fit();
+  bvh.wide_nodes.clear();
+  bvh.wide_nodes.shrink_to_fit();
+}
+
+// Check whether wide or compressed nodes are present.
+static bool has_wide_nodes(const bvh_tree& bvh) {
+  return !bvh.wide_nodes.empty() || !bvh.compressed_nodes.empty();
+}
+
+// Subtrees of a bvh, for the queries that walk binary and compressed nodes
+// in the same way. Subtrees are node indices for binary nodes, and children
+// of compressed nodes, stored as node * bvh_wide_size + child, with -1 for
+// the root.
+static bool is_empty_bvh(const bvh_tree& bvh) {
+  return bvh.nodes.empty() && bvh.compressed_nodes.empty();
+}
+static int get_root_subtree(const bvh_tree& bvh) {
+  return bvh.compressed_nodes.empty() ? 0 : -1;
+}
+static bool is_internal_subtree(const bvh_tree& bvh, int subtree) {
+  if (bvh.compressed_nodes.empty()) return bvh.nodes[subtree].internal;
+  if (subtree < 0) return true;
+  return is_internal_child(bvh.compressed_nodes[subtree / bvh_wide_size],
+      subtree % bvh_wide_size);
+}
+static bbox3f get_subtree_bbox(const bvh_tree& bvh, int subtree) {
+  if (bvh.compressed_nodes.empty()) return bvh.nodes[subtree].bbox;
+  if (subtree >= 0)
+    return get_child_bbox(bvh.compressed_nodes[subtree / bvh_wide_size],
+        subtree % bvh_wide_size);
+  auto& root = bvh.compressed_nodes[0];
+  auto  bbox = invalidb3f;
+  for (auto child : range((int)root.count)) {
+    bbox = merge(bbox, get_child_bbox(root, child));
+  }
+  return bbox;
+}
+
+// Children of an internal subtree. Returns their number.
+static int get_subtree_children(const bvh_tree& bvh, int subtree,
+    array<int, bvh_wide_size>& children) {
+  if (bvh.compressed_nodes.empty()) {
+    auto& node  = bvh.nodes[subtree];
+    children[0] = node.start + 0;
+    children[1] = node.start + 1;
+    return 2;
+  }
+  auto nodeid = subtree < 0 ? 0
+                            : bvh.compressed_nodes[subtree / bvh_wide_size]
+                                  .start[subtree % bvh_wide_size];
+  auto& node = bvh.compressed_nodes[nodeid];
+  for (auto child : range((int)node.count)) {
+    children[child] = nodeid * bvh_wide_size + child;
+  }
+  return node.count;
+}
+
+// Primitives of a leaf subtree, as start and number in the primitive array.
+static vec2i get_subtree_primitives(const bvh_tree& bvh, int subtree) {
+  if (bvh.compressed_nodes.empty()) {
+    auto& node = bvh.nodes[subtree];
+    return {node.start, node.num};
+  }
+  auto& node  = bvh.compressed_nodes[subtree / bvh_wide_size];
+  auto  child = subtree % bvh_wide_size;
+  return {node.start[child], (int)node.num[child]};
+}
+
+// Bounds of a bvh
+static bbox3f get_bvh_bbox(const bvh_tree& bvh) {
+  if (is_empty_bvh(bvh)) return invalidb3f;
+  return get_subtree_bbox(bvh, get_root_subtree(bvh));
+}
+
+// Bounds of a node computed from its children or primitives
+template <typename BBox>
+static bbox3f refit_node(
+    const bvh_tree& bvh, const bvh_node& node, BBox&& primitive_bbox) {
+  auto bbox = invalidb3f;
+  if (node.internal) {
+    for (auto idx : range(2)) {
+      bbox = merge(bbox, bvh.nodes[node.start + idx].bbox);
+    }
+  } else {
+    for (auto idx : range(node.num)) {
+      bbox = merge(bbox, primitive_bbox(bvh.primitives[node.start + idx]));
+    }
+  }
+  return bbox;
+}
+
+// Refit nodes bottom-up in parallel. Each leaf is refit by a task, that then
+// walks up the tree. Parents are refit by the task that reaches them last,
+// which is tracked with an atomic counter per node.
+static void refit_nodes_parallel(
+    bvh_tree& bvh, const vector<bbox3f>& bboxes) {
+  auto primitive_bbox = [&bboxes](int primitive) {
+    return bboxes[primitive];
+  };
+
+  // parents and leaves
+  auto parents = vector<int>(bvh.nodes.size(), -1);
+  auto leaves  = vector<int>{};
+  for (auto nodeid : range((int)bvh.nodes.size())) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      parents[node.start + 0] = nodeid;
+      parents[node.start + 1] = nodeid;
+    } else {
+      leaves.push_back(nodeid);
+    }
+  }
+
+  // refit leaves and their ancestors
+  auto counters = vector<std::atomic<int>>(bvh.nodes.size());
+  for_primitives(0, (int)leaves.size(), false, [&](int start, int end) {
+    for (auto idx : range(start, end)) {
+      auto nodeid         = leaves[idx];
+      bvh.nodes[nodeid].bbox = refit_node(
+          bvh, bvh.nodes[nodeid], primitive_bbox);
+      nodeid = parents[nodeid];
+      while (nodeid >= 0) {
+        // the first child to arrive stops, the second refits the parent
+        if (counters[nodeid].fetch_add(1, std::memory_order_acq_rel) == 0)
+          break;
+        bvh.nodes[nodeid].bbox = refit_node(
+            bvh, bvh.nodes[nodeid], primitive_bbox);
+        nodeid = parents[nodeid];
+      }
+    }
+  });
+}
+
+// Split axis of an internal node, taken as the axis along which the
+// children centers are farthest apart.
+static int8_t refit_axis(const bvh_tree& bvh, const bvh_node& node) {
+  auto delta = abs(center(bvh.nodes[node.start + 1].bbox) -
+                   center(bvh.nodes[node.start + 0].bbox));
+  return (int8_t)(delta.x >= delta.y && delta.x >= delta.z ? 0
+                  : delta.y >= delta.z                     ? 1
+                                                           : 2);
+}
+
+// Restore the quality of a refit bvh with tree rotations. For each internal
+// node, one child is swapped with a grandchild on the other side when this
+// reduces the surface area of the other side. Nodes are visited bottom-up.
+// Since swapped subtrees may end up before their parents, nodes are
+// reordered at the end.
+static void rotate_bvh(bvh_tree& bvh) {
+  // surface area
+  auto bbox_area = [](const bbox3f& b) {
+    auto size = b.max - b.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+
+  // rotate nodes, that were all refit before
+  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = bvh.nodes[nodeid];
+    if (!node.internal) continue;
+
+    // find the best rotation, as a child and a grandchild to swap
+    auto best_gain       = 0.0f;
+    auto best_child      = -1;
+    auto best_grandchild = -1;
+    for (auto side : range(2)) {
+      auto  child = node.start + side;
+      auto& other = bvh.nodes[node.start + 1 - side];
+      if (!other.internal) continue;
+      for (auto idx : range(2)) {
+        auto& kept = bvh.nodes[other.start + 1 - idx];
+        auto  gain = bbox_area(other.bbox) -
+                    bbox_area(merge(bvh.nodes[child].bbox, kept.bbox));
+        if (gain <= best_gain) continue;
+        best_gain       = gain;
+        best_child      = child;
+        best_grandchild = other.start + idx;
+      }
+    }
+    if (best_child < 0) continue;
+
+    // swap subtrees and refit the side that changed
+    std::swap(bvh.nodes[best_child], bvh.nodes[best_grandchild]);
+    auto& other = bvh.nodes[best_child == node.start ? node.start + 1
+                                                       : node.start];
+    other.bbox  = merge(bvh.nodes[other.start + 0].bbox,
+         bvh.nodes[other.start + 1].bbox);
+    other.axis  = refit_axis(bvh, other);
+    node.axis   = refit_axis(bvh, node);
+  }
+
+  // reorder nodes
+  reorder_bvh(bvh);
+}
+
+// Update wide nodes after a refit
+static void refit_wide_bvh(bvh_tree& bvh) {
+  if (!bvh.wide_nodes.empty()) make_wide_bvh(bvh);
+}
+
+// Refit compressed nodes, requantizing the bounds of their children. Since
+// only quantized bounds are stored, all nodes are refit, from the exact
+// bounds of their children. Children come after their parents, so nodes are
+// visited in reverse order. `primitive_bbox(primitive)` computes primitive
+// bounds.
+template <typename BBox>
+static void refit_compressed_bvh(bvh_tree& bvh, BBox&& primitive_bbox) {
+  auto bboxes = vector<bbox3f>(bvh.compressed_nodes.size(), invalidb3f);
+  for (auto nodeid = (int)bvh.compressed_nodes.size() - 1; nodeid >= 0;
+       nodeid--) {
+    auto& node     = bvh.compressed_nodes[nodeid];
+    auto  children = array<bbox3f, bvh_wide_size>{};
+    for (auto idx : range((int)node.count)) {
+      children[idx] = invalidb3f;
+      if (is_internal_child(node, idx)) {
+        children[idx] = bboxes[node.start[idx]];
+      } else {
+        for (auto primitive : range((int)node.num[idx])) {
+          children[idx] = merge(children[idx],
+              primitive_bbox(bvh.primitives[node.start[idx] + primitive]));
+        }
+      }
+      bboxes[nodeid] = merge(bboxes[nodeid], children[idx]);
+    }
+    quantize_compressed_node(node, children);
+  }
+}
+
+// Update bvh. Large bvhs are refit in parallel, unless `noparallel` is set.
+// If requested, tree rotations restore the quality of the tree.
+static void refit_bvh(bvh_tree& bvh, const vector<bbox3f>& bboxes,
+    bool rotate = false, bool noparallel = false) {
+  // compressed nodes are refit without rotations, that need binary nodes
+  if (!bvh.compressed_nodes.empty()) {
+    return refit_compressed_bvh(
+        bvh, [&bboxes](int primitive) { return bboxes[primitive]; });
+  }
+
+  // leaves are about half the nodes, and are refit in parallel only when
+  // for_primitives() splits them in chunks
+  if (!noparallel && (int)bvh.nodes.size() / 2 >= 2 * bvh_chunk_size) {
+    refit_nodes_parallel(bvh, bboxes);
+  } else {
+    auto primitive_bbox = [&bboxes](int primitive) {
+      return bboxes[primitive];
+    };
+    for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
+      auto& node = bvh.nodes[nodeid];
+      node.bbox  = refit_node(bvh, node, primitive_bbox);
+    }
+  }
+
+  // restore quality
+  if (rotate) rotate_bvh(bvh);
+
+  // update wide nodes
+  refit_wide_bvh(bvh);
+}
+
+// Update the nodes of a bvh whose primitives are updated, and their
+// ancestors. `primitive_bbox(primitive)` computes primitive bounds.
+template <typename BBox>
+static void refit_bvh(bvh_tree& bvh, const vector<bool>& updated,
+    BBox&& primitive_bbox, bool rotate = false) {
+  // compressed nodes are refit entirely
+  if (!bvh.compressed_nodes.empty()) {
+    return refit_compressed_bvh(bvh, primitive_bbox);
+  }
+
+  // refit the nodes with updated primitives or children
+  auto refit = vector<bool>(bvh.nodes.size(), false);
+  for (auto nodeid = (int)bvh.nodes.size() - 1; nodeid >= 0; nodeid--) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      if (!refit[node.start + 0] && !refit[node.start + 1]) continue;
+    } else {
+      auto leaf_updated = false;
+      for (auto idx : range(node.num)) {
+        if (updated[bvh.primitives[node.start + idx]]) leaf_updated = true;
+      }
+      if (!leaf_updated) continue;
+    }
+    node.bbox     = refit_node(bvh, node, primitive_bbox);
+    refit[nodeid] = true;
+  }
+
+  // restore quality
+  if (rotate) rotate_bvh(bvh);
+
+  // update wide nodes
+  refit_wide_bvh(bvh);
+}
+
+// Intersect ray with a bvh.
+template <typename Intersect>
+static shape_intersection intersect_elements_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_element, const ray3f& ray_, bool find_any) {
+  // use wide nodes if present
+  if (has_wide_nodes(bvh))
+    return intersect_elements_wide_bvh(bvh, intersect_element, ray_, find_any);
+
+  // check empty
+  if (bvh.nodes.empty()) return {};
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto intersection = shape_intersection{};
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // walking stack
+  while (node_cur) {
+    // grab node
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+
+    // intersect bbox
+    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // intersect node, switching based on node type
+    // for each type, iterate over the the primitive list
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis]) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
+      for (auto idx : range(node.num)) {
+        auto primitive     = bvh.primitives[node.start + idx];
+        auto eintersection = intersect_element(primitive, ray);
+        if (!eintersection.hit) continue;
+        intersection = {
+            primitive, eintersection.uv, eintersection.distance, true};
+        ray.tmax = eintersection.distance;
+      }
+    }
+
+    // check for early exit
+    if (find_any && intersection.hit) return intersection;
+  }
+
+  return intersection;
+}
+
+// Intersect a ray with the children of a wide node, returning the mask of
+// the children that are hit and their entry distance. This is the same test
+// as intersect_bbox() for each child, done with SSE instructions if present.
+static int intersect_wide_node(const bvh_wide_node& node, const ray3f& ray,
+    vec3f ray_dinv, array<float, bvh_wide_size>& tnear) {
+#ifdef YOCTO_BVH_SSE
+  // min and max match the scalar versions, also for NaNs
+  auto ox   = _mm_set1_ps(ray.o.x);
+  auto oy   = _mm_set1_ps(ray.o.y);
+  auto oz   = _mm_set1_ps(ray.o.z);
+  auto ix   = _mm_set1_ps(ray_dinv.x);
+  auto iy   = _mm_set1_ps(ray_dinv.y);
+  auto iz   = _mm_set1_ps(ray_dinv.z);
+  auto tx0  = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_x.data()), ox), ix);
+  auto ty0  = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_y.data()), oy), iy);
+  auto tz0  = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min_z.data()), oz), iz);
+  auto tx1  = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_x.data()), ox), ix);
+  auto ty1  = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_y.data()), oy), iy);
+  auto tz1  = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max_z.data()), oz), iz);
+  auto t0   = _mm_max_ps(_mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1),
+                                       _mm_min_ps(ty0, ty1)),
+                             _mm_min_ps(tz0, tz1)),
+        _mm_set1_ps(ray.tmin));
+  auto t1   = _mm_min_ps(_mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1),
+                                       _mm_max_ps(ty0, ty1)),
+                             _mm_max_ps(tz0, tz1)),
+        _mm_set1_ps(ray.tmax));
+  t1        = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+  auto mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+  _mm_storeu_ps(tnear.data(), t0);
+  return mask & ((1 << node.count) - 1);
+#else
+  auto mask = 0;
+  for (auto idx : range((int)node.count)) {
+    auto tx0 = (node.min_x[idx] - ray.o.x) * ray_dinv.x;
+    auto ty0 = (node.min_y[idx] - ray.o.y) * ray_dinv.y;
+    auto tz0 = (node.min_z[idx] - ray.o.z) * ray_dinv.z;
+    auto tx1 = (node.max_x[idx] - ray.o.x) * ray_dinv.x;
+    auto ty1 = (node.max_y[idx] - ray.o.y) * ray_dinv.y;
+    auto tz1 = (node.max_z[idx] - ray.o.z) * ray_dinv.z;
+    auto t0  = max(
+        max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1)), ray.tmin);
+    auto t1 = min(
+        min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)), ray.tmax);
+    t1 *= 1.00000024f;  // for double: 1.0000000000000004
+    tnear[idx] = t0;
+    if (t0 <= t1) mask |= 1 << idx;
+  }
+  return mask;
+#endif
+}
+
+// Intersect a ray with the children of a compressed node. This dequantizes
+// the child bounds and does the same test as for wide nodes.
+static int intersect_wide_node(const bvh_compressed_node& node,
+    const ray3f& ray, vec3f ray_dinv, array<float, bvh_wide_size>& tnear) {
+  auto scale_x = get_compressed_scale(node.scale[0]);
+  auto scale_y = get_compressed_scale(node.scale[1]);
+  auto scale_z = get_compressed_scale(node.scale[2]);
+#ifdef YOCTO_BVH_SSE
+  // dequantize bounds, with products that are exact for power of two scales
+  auto dequantize = [](const array<uint8_t, bvh_wide_size>& values,
+                        float origin, float scale) {
+    auto bytes = 0;
+    std::memcpy(&bytes, values.data(), sizeof(bytes));
+    auto zero  = _mm_setzero_si128();
+    auto ints  = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+    return _mm_add_ps(_mm_set1_ps(origin),
+        _mm_mul_ps(_mm_cvtepi32_ps(ints), _mm_set1_ps(scale)));
+  };
+  auto ox   = _mm_set1_ps(ray.o.x);
+  auto oy   = _mm_set1_ps(ray.o.y);
+  auto oz   = _mm_set1_ps(ray.o.z);
+  auto ix   = _mm_set1_ps(ray_dinv.x);
+  auto iy   = _mm_set1_ps(ray_dinv.y);
+  auto iz   = _mm_set1_ps(ray_dinv.z);
+  auto minx = dequantize(node.min_x, node.origin.x, scale_x);
+  auto miny = dequantize(node.min_y, node.origin.y, scale_y);
+  auto minz = dequantize(node.min_z, node.origin.z, scale_z);
+  auto maxx = dequantize(node.max_x, node.origin.x, scale_x);
+  auto maxy = dequantize(node.max_y, node.origin.y, scale_y);
+  auto maxz = dequantize(node.max_z, node.origin.z, scale_z);
+  auto tx0  = _mm_mul_ps(_mm_sub_ps(minx, ox), ix);
+  auto ty0  = _mm_mul_ps(_mm_sub_ps(miny, oy), iy);
+  auto tz0  = _mm_mul_ps(_mm_sub_ps(minz, oz), iz);
+  auto tx1  = _mm_mul_ps(_mm_sub_ps(maxx, ox), ix);
+  auto ty1  = _mm_mul_ps(_mm_sub_ps(maxy, oy), iy);
+  auto tz1  = _mm_mul_ps(_mm_sub_ps(maxz, oz), iz);
+  auto t0   = _mm_max_ps(_mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1),
+                                       _mm_min_ps(ty0, ty1)),
+                             _mm_min_ps(tz0, tz1)),
+        _mm_set1_ps(ray.tmin));
+  auto t1   = _mm_min_ps(_mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1),
+                                       _mm_max_ps(ty0, ty1)),
+                             _mm_max_ps(tz0, tz1)),
+        _mm_set1_ps(ray.tmax));
+  t1        = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+  auto mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+  _mm_storeu_ps(tnear.data(), t0);
+  return mask & ((1 << node.count) - 1);
+#else
+  auto mask = 0;
+  for (auto idx : range((int)node.count)) {
+    auto min_x = node.origin.x + (float)node.min_x[idx] * scale_x;
+    auto min_y = node.origin.y + (float)node.min_y[idx] * scale_y;
+    auto min_z = node.origin.z + (float)node.min_z[idx] * scale_z;
+    auto max_x = node.origin.x + (float)node.max_x[idx] * scale_x;
+    auto max_y = node.origin.y + (float)node.max_y[idx] * scale_y;
+    auto max_z = node.origin.z + (float)node.max_z[idx] * scale_z;
+    auto tx0   = (min_x - ray.o.x) * ray_dinv.x;
+    auto ty0   = (min_y - ray.o.y) * ray_dinv.y;
+    auto tz0   = (min_z - ray.o.z) * ray_dinv.z;
+    auto tx1   = (max_x - ray.o.x) * ray_dinv.x;
+    auto ty1   = (max_y - ray.o.y) * ray_dinv.y;
+    auto tz1   = (max_z - ray.o.z) * ray_dinv.z;
+    auto t0    = max(
+        max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1)), ray.tmin);
+    auto t1 = min(
+        min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)), ray.tmax);
+    t1 *= 1.00000024f;  // for double: 1.0000000000000004
+    tnear[idx] = t0;
+    if (t0 <= t1) mask |= 1 << idx;
+  }
+  return mask;
+#endif
+}
+
+// Intersect ray with wide or compressed nodes. Children are tested together
+// and visited nearest first. `intersect_primitive(index, ray)` takes the
+// index in the primitive array, returns whether the primitive was hit, and
+// updates ray.tmax when it does.
+template <typename Node, typename Intersect>
+static bool intersect_wide_nodes(const vector<Node>& nodes,
+    Intersect&& intersect_primitive, const ray3f& ray_, bool find_any) {
+  // check empty
+  if (nodes.empty()) return false;
+
+  // node stack, with leaves stored as ~(node * bvh_wide_size + child),
+  // and the entry distance of each node
+  auto node_stack        = array<int, 128>{};
+  auto dist_stack        = array<float, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur]   = 0;
+  dist_stack[node_cur++] = ray_.tmin;
+
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node, skipping nodes farther than the current hit
+    node_cur -= 1;
+    if (dist_stack[node_cur] > ray.tmax) continue;
+    auto nodeid = node_stack[node_cur];
+
+    // intersect leaf
+    if (nodeid < 0) {
+      auto& node  = nodes[~nodeid / bvh_wide_size];
+      auto  child = ~nodeid % bvh_wide_size;
+      for (auto idx : range((int)node.num[child])) {
+        if (intersect_primitive(node.start[child] + idx, ray)) hit = true;
+      }
+      if (find_any && hit) return hit;
+      continue;
+    }
+
+    // intersect children bboxes
+    auto& node  = nodes[nodeid];
+    auto  tnear = array<float, bvh_wide_size>{};
+    auto  mask  = intersect_wide_node(node, ray, ray_dinv, tnear);
+
+    // push hit children from farthest to nearest, so that the nearest is
+    // visited first
+    auto order = array<int, bvh_wide_size>{};
+    auto count = 0;
+    for (auto idx : range(bvh_wide_size)) {
+      if (!(mask & (1 << idx))) continue;
+      auto pos = count++;
+      while (pos > 0 && tnear[order[pos - 1]] < tnear[idx]) {
+        order[pos] = order[pos - 1];
+        pos -= 1;
+      }
+      order[pos] = idx;
+    }
+    for (auto idx : range(count)) {
+      auto child             = order[idx];
+      node_stack[node_cur]   = is_internal_child(node, child)
+                                   ? node.start[child]
+                                   : ~(nodeid * bvh_wide_size + child);
+      dist_stack[node_cur++] = tnear[child];
+    }
+  }
+
+  return hit;
+}
+
+// Intersect ray with a wide bvh, using either compressed or wide nodes.
+template <typename Intersect>
+static bool intersect_wide_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_primitive, const ray3f& ray, bool find_any) {
+  if (!bvh.compressed_nodes.empty()) {
+    return intersect_wide_nodes(
+        bvh.compressed_nodes, intersect_primitive, ray, find_any);
+  } else {
+    return intersect_wide_nodes(
+        bvh.wide_nodes, intersect_primitive, ray, find_any);
+  }
+}
+
+// Intersect ray with a wide bvh of shape elements.
+template <typename Intersect>
+static shape_intersection intersect_elements_wide_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_element, const ray3f& ray, bool find_any) {
+  auto intersection = shape_intersection{};
+  intersect_wide_bvh(
+      bvh,
+      [&](int index, ray3f& ray) {
+        auto primitive     = bvh.primitives[index];
+        auto eintersection = intersect_element(primitive, ray);
+        if (!eintersection.hit) return false;
+        intersection = {
+            primitive, eintersection.uv, eintersection.distance, true};
+        ray.tmax = eintersection.distance;
+        return true;
+      },
+      ray, find_any);
+  return intersection;
+}
+
+// Intersect ray with a bvh.
+template <typename Overlap>
+static shape_intersection overlap_elements_bvh(const bvh_tree& bvh,
+    Overlap&& overlap_element, vec3f pos, float max_distance, bool find_any) {
+  // check if empty
+  if (is_empty_bvh(bvh)) return {};
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = get_root_subtree(bvh);
+
+  // hit
+  auto intersection = shape_intersection{};
+
+  // walking stack
+  while (node_cur) {
+    // grab node
+    auto node = node_stack[--node_cur];
+
+    // intersect bbox
+    if (!overlap_bbox(pos, max_distance, get_subtree_bbox(bvh, node)))
+      continue;
+
+    // intersect node, switching based on node type
+    // for each type, iterate over the the primitive list
+    if (is_internal_subtree(bvh, node)) {
+      // internal node
+      auto children = array<int, bvh_wide_size>{};
+      auto count    = get_subtree_children(bvh, node, children);
+      for (auto idx : range(count)) node_stack[node_cur++] = children[idx];
+    } else {
+      auto [start, num] = get_subtree_primitives(bvh, node);
+      for (auto idx : range(num)) {
+        auto primitive     = bvh.primitives[start + idx];
+        auto eintersection = overlap_element(primitive, pos, max_distance);
+        if (!eintersection.hit) continue;
+        intersection = {
+            primitive, eintersection.uv, eintersection.distance, true};
+        max_distance = eintersection.distance;
+      }
+    }
+
+    // check for early exit
+    if (find_any && intersection.hit) return intersection;
+  }
+
+  return intersection;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// BVH FOR SHAPE ELEMENTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Build shape bvh
+bvh_tree make_points_bvh(const vector<int>& points,
+    const vector<vec3f>& positions, const vector<float>& radius,
+    bool highquality) {
+  // build primitives
+  auto bboxes = vector<bbox3f>(points.size());
+  for (auto idx : range(bboxes.size())) {
+    auto& p     = points[idx];
+    bboxes[idx] = point_bounds(positions[p], radius[p]);
+  }
+
+  // build nodes
+  return make_bvh(bboxes, highquality, false);
 }
 bvh_tree make_lines_bvh(const vector<vec2i>& lines,
     const vector<vec3f>& positions, const vector<float>& radius,
@@ -453,7 +1671,7 @@ bvh_tree make_lines_bvh(const vector<vec2i>& lines,
   }
 
   // build nodes
-  return make_bvh(bboxes, highquality);
+  return make_bvh(bboxes, highquality, false);
 }
 bvh_tree make_triangles_bvh(const vector<vec3i>& triangles,
     const vector<vec3f>& positions, bool highquality) {
@@ -466,7 +1684,7 @@ bvh_tree make_triangles_bvh(const vector<vec3i>& triangles,
   }
 
   // build nodes
-  return make_bvh(bboxes, highquality);
+  return make_bvh(bboxes, highquality, false);
 }
 bvh_tree make_quads_bvh(const vector<vec4i>& quads,
     const vector<vec3f>& positions, bool highquality) {
@@ -479,7 +1697,7 @@ bvh_tree make_quads_bvh(const vector<vec4i>& quads,
   }
 
   // build nodes
-  return make_bvh(bboxes, highquality);
+  return make_bvh(bboxes, highquality, false);
 }
 
 void refit_points_bvh(bvh_tree& bvh, const vector<int>& points,
@@ -645,7 +1863,19 @@ shape_intersection overlap_quads_bvh(const bvh_tree& bvh,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-shape_bvh make_shape_bvh(const shape_data& shape, bool highquality) {
+// Precompute triangle data in the order of the bvh primitives
+static void make_bvh_triangles(shape_bvh& sbvh, const shape_data& shape) {
+  auto& primitives = sbvh.bvh.primitives;
+  sbvh.triangles.resize(primitives.size());
+  for (auto idx : range(primitives.size())) {
+    auto& t             = shape.triangles[primitives[idx]];
+    auto& p0            = shape.positions[t.x];
+    sbvh.triangles[idx] = {
+        p0, shape.positions[t.y] - p0, shape.positions[t.z] - p0};
+  }
+}
+
+shape_bvh make_shape_bvh(const shape_data& shape, const bvh_params& params) {
   // bvh
   auto sbvh = shape_bvh{};
 
@@ -681,114 +1911,435 @@ shape_bvh make_shape_bvh(const shape_data& shape, bool highquality) {
     }
   }
 
-  // build nodes
-  sbvh.bvh = make_bvh(bboxes, highquality);
+  // build nodes, with spatial splits for lines, triangles and quads if
+  // requested
+  if (params.spatial_budget > 0 && !shape.lines.empty()) {
+    sbvh.bvh = make_spatial_bvh(
+        bboxes, params.spatial_budget,
+        [&shape](int element, const bbox3f& bbox) {
+          auto& l = shape.lines[element];
+          return clip_line_bounds(shape.positions[l.x], shape.positions[l.y],
+              shape.radius[l.x], shape.radius[l.y], bbox);
+        });
+  } else if (params.spatial_budget > 0 && !shape.triangles.empty()) {
+    sbvh.bvh = make_spatial_bvh(
+        bboxes, params.spatial_budget,
+        [&shape](int element, const bbox3f& bbox) {
+          auto& t = shape.triangles[element];
+          return clip_polygon_bounds({shape.positions[t.x],
+                                         shape.positions[t.y],
+                                         shape.positions[t.z], vec3f{}},
+              3, bbox);
+        });
+  } else if (params.spatial_budget > 0 && !shape.quads.empty()) {
+    sbvh.bvh = make_spatial_bvh(
+        bboxes, params.spatial_budget,
+        [&shape](int element, const bbox3f& bbox) {
+          auto& q = shape.quads[element];
+          return clip_polygon_bounds(
+              {shape.positions[q.x], shape.positions[q.y],
+                  shape.positions[q.z], shape.positions[q.w]},
+              q.z == q.w ? 3 : 4, bbox);
+        });
+  } else {
+    sbvh.bvh = make_bvh(bboxes, params.highquality, params.noparallel);
+  }
+  if (params.wide || params.compressed) make_wide_bvh(sbvh.bvh);
+  if (params.compressed) make_compressed_bvh(sbvh.bvh);
+
+  // precompute triangles
+  if (params.precomputed && !shape.triangles.empty())
+    make_bvh_triangles(sbvh, shape);
 
   // done
   return sbvh;
 }
 
-scene_bvh make_scene_bvh(
-    const scene_data& scene, bool highquality, bool noparallel) {
+// Instance record with the inverse of the instance frame
+static bvh_instance make_bvh_instance(const instance_data& instance) {
+  return {inverse(instance.frame, true), instance.shape};
+}
+
+// Build the instance records and bvh of a scene bvh, once shape bvhs are built
+static void make_instances_bvh(
+    scene_bvh& sbvh, const scene_data& scene, const bvh_params& params) {
+  // instance records
+  sbvh.instances.resize(scene.instances.size());
+  for (auto idx : range(scene.instances.size())) {
+    sbvh.instances[idx] = make_bvh_instance(scene.instances[idx]);
+  }
+
+  // instance bboxes
+  auto bboxes = vector<bbox3f>(scene.instances.size());
+  for (auto idx : range(bboxes.size())) {
+    auto& instance = scene.instances[idx];
+    auto& bvh      = sbvh.shapes[instance.shape].bvh;
+    bboxes[idx]    = is_empty_bvh(bvh)
+                         ? invalidb3f
+                         : transform_bbox(instance.frame, get_bvh_bbox(bvh));
+  }
+
+  // build nodes
+  sbvh.bvh = make_bvh(bboxes, params.highquality, params.noparallel);
+  if (params.wide || params.compressed) make_wide_bvh(sbvh.bvh);
+  if (params.compressed) make_compressed_bvh(sbvh.bvh);
+}
+
+scene_bvh make_scene_bvh(const scene_data& scene, const bvh_params& params) {
   // bvh
   auto sbvh = scene_bvh{};
 
   // build shape bvh
   sbvh.shapes.resize(scene.shapes.size());
-  if (noparallel) {
+  if (params.noparallel) {
     for (auto idx : range(scene.shapes.size())) {
-      sbvh.shapes[idx] = make_shape_bvh(scene.shapes[idx], highquality);
+      sbvh.shapes[idx] = make_shape_bvh(scene.shapes[idx], params);
     }
   } else {
     parallel_for(scene.shapes.size(), [&](size_t idx) {
-      sbvh.shapes[idx] = make_shape_bvh(scene.shapes[idx], highquality);
+      sbvh.shapes[idx] = make_shape_bvh(scene.shapes[idx], params);
     });
   }
 
-  // instance bboxes
-  auto bboxes = vector<bbox3f>(scene.instances.size());
-  for (auto idx : range(bboxes.size())) {
-    auto& instance = scene.instances[idx];
-    bboxes[idx]    = sbvh.shapes[instance.shape].bvh.nodes.empty()
-                         ? invalidb3f
-                         : transform_bbox(instance.frame,
-                               sbvh.shapes[instance.shape].bvh.nodes[0].bbox);
-  }
-
-  // build nodes
-  sbvh.bvh = make_bvh(bboxes, highquality);
+  // build instance bvh
+  make_instances_bvh(sbvh, scene, params);
 
   // done
   return sbvh;
 }
 
-void update_shape_bvh(shape_bvh& sbvh, const shape_data& shape) {
+// Build the bvh acceleration structure with default options.
+shape_bvh make_shape_bvh(const shape_data& shape, bool highquality) {
+  auto params        = bvh_params{};
+  params.highquality = highquality;
+  return make_shape_bvh(shape, params);
+}
+scene_bvh make_scene_bvh(
+    const scene_data& scene, bool highquality, bool noparallel) {
+  auto params        = bvh_params{};
+  params.highquality = highquality;
+  params.noparallel  = noparallel;
+  return make_scene_bvh(scene, params);
+}
+
+void update_shape_bvh(shape_bvh& sbvh, const shape_data& shape, bool rotate,
+    bool noparallel) {
   // build primitives
   auto bboxes = vector<bbox3f>{};
   if (!shape.points.empty()) {
     bboxes = vector<bbox3f>(shape.points.size());
-    for (auto idx : range(bboxes.size())) {
-      auto& p     = shape.points[idx];
-      bboxes[idx] = point_bounds(shape.positions[p], shape.radius[p]);
-    }
+    for_primitives(0, (int)bboxes.size(), noparallel, [&](int start, int end) {
+      for (auto idx : range(start, end)) {
+        auto& p     = shape.points[idx];
+        bboxes[idx] = point_bounds(shape.positions[p], shape.radius[p]);
+      }
+    });
   } else if (!shape.lines.empty()) {
     bboxes = vector<bbox3f>(shape.lines.size());
-    for (auto idx : range(bboxes.size())) {
-      auto& l     = shape.lines[idx];
-      bboxes[idx] = line_bounds(shape.positions[l.x], shape.positions[l.y],
-          shape.radius[l.x], shape.radius[l.y]);
-    }
+    for_primitives(0, (int)bboxes.size(), noparallel, [&](int start, int end) {
+      for (auto idx : range(start, end)) {
+        auto& l     = shape.lines[idx];
+        bboxes[idx] = line_bounds(shape.positions[l.x], shape.positions[l.y],
+            shape.radius[l.x], shape.radius[l.y]);
+      }
+    });
   } else if (!shape.triangles.empty()) {
     bboxes = vector<bbox3f>(shape.triangles.size());
-    for (auto idx : range(bboxes.size())) {
-      auto& t     = shape.triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
-    }
+    for_primitives(0, (int)bboxes.size(), noparallel, [&](int start, int end) {
+      for (auto idx : range(start, end)) {
+        auto& t     = shape.triangles[idx];
+        bboxes[idx] = triangle_bounds(
+            shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+      }
+    });
   } else if (!shape.quads.empty()) {
     bboxes = vector<bbox3f>(shape.quads.size());
-    for (auto idx : range(bboxes.size())) {
-      auto& q     = shape.quads[idx];
-      bboxes[idx] = quad_bounds(shape.positions[q.x], shape.positions[q.y],
-          shape.positions[q.z], shape.positions[q.w]);
-    }
+    for_primitives(0, (int)bboxes.size(), noparallel, [&](int start, int end) {
+      for (auto idx : range(start, end)) {
+        auto& q     = shape.quads[idx];
+        bboxes[idx] = quad_bounds(shape.positions[q.x], shape.positions[q.y],
+            shape.positions[q.z], shape.positions[q.w]);
+      }
+    });
   }
 
   // update nodes
-  refit_bvh(sbvh.bvh, bboxes);
+  refit_bvh(sbvh.bvh, bboxes, rotate, noparallel);
+
+  // update precomputed triangles
+  if (!sbvh.triangles.empty()) make_bvh_triangles(sbvh, shape);
 }
 
 void update_scene_bvh(scene_bvh& sbvh, const scene_data& scene,
-    const vector<int>& updated_instances, const vector<int>& updated_shapes) {
+    const vector<int>& updated_instances, const vector<int>& updated_shapes,
+    bool rotate, bool noparallel) {
   // update shapes
   for (auto shape : updated_shapes) {
-    update_shape_bvh(sbvh.shapes[shape], scene.shapes[shape]);
+    update_shape_bvh(
+        sbvh.shapes[shape], scene.shapes[shape], rotate, noparallel);
+  }
+
+  // instance bounds
+  auto instance_bbox = [&](int idx) {
+    auto& instance = scene.instances[idx];
+    auto& bvh      = sbvh.shapes[instance.shape].bvh;
+    if (is_empty_bvh(bvh)) return invalidb3f;
+    return transform_bbox(instance.frame, get_bvh_bbox(bvh));
+  };
+
+  // rebuild the instance bvh if the number of instances changed, since
+  // refitting only updates the instances already in the tree
+  if (sbvh.instances.size() != scene.instances.size()) {
+    auto params       = bvh_params{};
+    params.noparallel = noparallel;
+    params.wide       = !sbvh.bvh.wide_nodes.empty();
+    params.compressed = !sbvh.bvh.compressed_nodes.empty();
+    make_instances_bvh(sbvh, scene, params);
+    return;
   }
 
-  // handle instances
-  auto bboxes = vector<bbox3f>(scene.instances.size());
-  for (auto idx : range(bboxes.size())) {
-    auto& instance = scene.instances[idx];
-    bboxes[idx]    = transform_bbox(
-        instance.frame, sbvh.shapes[instance.shape].bvh.nodes[0].bbox);
+  // updated instances, including the instances of updated shapes
+  auto updated = vector<bool>(scene.instances.size(), false);
+  for (auto idx : updated_instances) {
+    sbvh.instances[idx] = make_bvh_instance(scene.instances[idx]);
+    updated[idx]        = true;
+  }
+  if (!updated_shapes.empty()) {
+    auto shape_updated = vector<bool>(scene.shapes.size(), false);
+    for (auto shape : updated_shapes) shape_updated[shape] = true;
+    for (auto idx : range(scene.instances.size())) {
+      if (shape_updated[scene.instances[idx].shape]) updated[idx] = true;
+    }
+  }
+
+  // update only the nodes above updated instances
+  refit_bvh(sbvh.bvh, updated, instance_bbox, rotate);
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH INTERSECTION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Intersect a ray with a precomputed triangle. This is the same computation
+// as intersect_triangle(), with edges read instead of computed.
+static prim_intersection intersect_triangle(
+    const ray3f& ray, const bvh_triangle& triangle) {
+  // compute determinant to solve a linear system
+  auto pvec = cross(ray.d, triangle.e2);
+  auto det  = dot(triangle.e1, pvec);
+
+  // check determinant and exit if triangle and ray are parallel
+  if (det == 0) return {};
+  auto inv_det = 1.0f / det;
+
+  // compute and check first bricentric coordinated
+  auto tvec = ray.o - triangle.p0;
+  auto u    = dot(tvec, pvec) * inv_det;
+  if (u < 0 || u > 1) return {};
+
+  // compute and check second bricentric coordinated
+  auto qvec = cross(tvec, triangle.e1);
+  auto v    = dot(ray.d, qvec) * inv_det;
+  if (v < 0 || u + v > 1) return {};
+
+  // compute and check ray parameter
+  auto t = dot(triangle.e2, qvec) * inv_det;
+  if (t < ray.tmin || t > ray.tmax) return {};
+
+  // intersection occurred: set params and exit
+  return {{u, v}, t, true};
+}
+
+shape_intersection intersect_shape_bvh(const shape_bvh& sbvh,
+    const shape_data& shape, const ray3f& ray_, bool find_any) {
+  // get bvh tree
+  auto& bvh = sbvh.bvh;
+
+  // use wide nodes if present
+  if (has_wide_nodes(bvh)) {
+    if (!shape.points.empty()) {
+      return intersect_elements_wide_bvh(
+          bvh,
+          [&shape](int element, const ray3f& ray) {
+            auto& p = shape.points[element];
+            return intersect_point(ray, shape.positions[p], shape.radius[p]);
+          },
+          ray_, find_any);
+    } else if (!shape.lines.empty()) {
+      return intersect_elements_wide_bvh(
+          bvh,
+          [&shape](int element, const ray3f& ray) {
+            auto& l = shape.lines[element];
+            return intersect_line(ray, shape.positions[l.x],
+                shape.positions[l.y], shape.radius[l.x], shape.radius[l.y]);
+          },
+          ray_, find_any);
+    } else if (!sbvh.triangles.empty()) {
+      auto intersection = shape_intersection{};
+      intersect_wide_bvh(
+          bvh,
+          [&](int index, ray3f& ray) {
+            auto tintersection = intersect_triangle(
+                ray, sbvh.triangles[index]);
+            if (!tintersection.hit) return false;
+            intersection = {bvh.primitives[index], tintersection.uv,
+                tintersection.distance, true};
+            ray.tmax     = tintersection.distance;
+            return true;
+          },
+          ray_, find_any);
+      return intersection;
+    } else if (!shape.triangles.empty()) {
+      return intersect_elements_wide_bvh(
+          bvh,
+          [&shape](int element, const ray3f& ray) {
+            auto& t = shape.triangles[element];
+            return intersect_triangle(ray, shape.positions[t.x],
+                shape.positions[t.y], shape.positions[t.z]);
+          },
+          ray_, find_any);
+    } else if (!shape.quads.empty()) {
+      return intersect_elements_wide_bvh(
+          bvh,
+          [&shape](int element, const ray3f& ray) {
+            auto& q = shape.quads[element];
+            return intersect_quad(ray, shape.positions[q.x],
+                shape.positions[q.y], shape.positions[q.z],
+                shape.positions[q.w]);
+          },
+          ray_, find_any);
+    } else {
+      return {};
+    }
+  }
+
+  // check empty
+  if (bvh.nodes.empty()) return {};
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // shared variables
+  auto intersection = shape_intersection{};
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
+      (ray_dinv.z < 0) ? 1 : 0};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+
+    // intersect bbox
+    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+
+    // intersect node, switching based on node type
+    // for each type, iterate over the the primitive list
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis] != 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else if (!shape.points.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& p             = shape.points[bvh.primitives[idx]];
+        auto  pintersection = intersect_point(
+            ray, shape.positions[p], shape.radius[p]);
+        if (!pintersection.hit) continue;
+        intersection = {bvh.primitives[idx], pintersection.uv,
+            pintersection.distance, true};
+        ray.tmax     = pintersection.distance;
+      }
+    } else if (!shape.lines.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& l             = shape.lines[bvh.primitives[idx]];
+        auto  pintersection = intersect_line(ray, shape.positions[l.x],
+             shape.positions[l.y], shape.radius[l.x], shape.radius[l.y]);
+        if (!pintersection.hit) continue;
+        intersection = {bvh.primitives[idx], pintersection.uv,
+            pintersection.distance, true};
+        ray.tmax     = pintersection.distance;
+      }
+    } else if (!sbvh.triangles.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto pintersection = intersect_triangle(ray, sbvh.triangles[idx]);
+        if (!pintersection.hit) continue;
+        intersection = {bvh.primitives[idx], pintersection.uv,
+            pintersection.distance, true};
+        ray.tmax     = pintersection.distance;
+      }
+    } else if (!shape.triangles.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& t             = shape.triangles[bvh.primitives[idx]];
+        auto  pintersection = intersect_triangle(ray, shape.positions[t.x],
+             shape.positions[t.y], shape.positions[t.z]);
+        if (!pintersection.hit) continue;
+        intersection = {bvh.primitives[idx], pintersection.uv,
+            pintersection.distance, true};
+        ray.tmax     = pintersection.distance;
+      }
+    } else if (!shape.quads.empty()) {
+      for (auto idx = node.start; idx < node.start + node.num; idx++) {
+        auto& q             = shape.quads[bvh.primitives[idx]];
+        auto  pintersection = intersect_quad(ray, shape.positions[q.x],
+             shape.positions[q.y], shape.positions[q.z], shape.positions[q.w]);
+        if (!pintersection.hit) continue;
+        intersection = {bvh.primitives[idx], pintersection.uv,
+            pintersection.distance, true};
+        ray.tmax     = pintersection.distance;
+      }
+    }
+
+    // check for early exit
+    if (find_any && intersection.hit) return intersection;
   }
 
-  // update nodes
-  refit_bvh(sbvh.bvh, bboxes);
+  return intersection;
 }
 
-}  // namespace yocto
-
-// -----------------------------------------------------------------------------
-// IMPLEMENTATION FOR BVH INTERSECTION
-// -----------------------------------------------------------------------------
-namespace yocto {
-
-shape_intersection intersect_shape_bvh(const shape_bvh& sbvh,
-    const shape_data& shape, const ray3f& ray_, bool find_any) {
-  // get bvh tree
+scene_intersection intersect_scene_bvh(const scene_bvh& sbvh,
+    const scene_data& scene, const ray3f& ray_, bool find_any) {
+  // get instances bvh
   auto& bvh = sbvh.bvh;
 
+  // use wide nodes if present
+  if (has_wide_nodes(bvh)) {
+    auto intersection = scene_intersection{};
+    intersect_wide_bvh(
+        bvh,
+        [&](int index, ray3f& ray) {
+          auto  instance  = bvh.primitives[index];
+          auto& instance_ = sbvh.instances[instance];
+          auto  inv_ray   = transform_ray(instance_.inv_frame, ray);
+          auto  sintersection = intersect_shape_bvh(
+               sbvh.shapes[instance_.shape], scene.shapes[instance_.shape],
+               inv_ray, find_any);
+          if (!sintersection.hit) return false;
+          intersection = {instance, sintersection.element, sintersection.uv,
+              sintersection.distance, true};
+          ray.tmax     = sintersection.distance;
+          return true;
+        },
+        ray_, find_any);
+    return intersection;
+  }
+
   // check empty
   if (bvh.nodes.empty()) return {};
 
@@ -797,8 +2348,8 @@ shape_intersection intersect_shape_bvh(const shape_bvh& sbvh,
   auto node_cur          = 0;
   node_stack[node_cur++] = 0;
 
-  // shared variables
-  auto intersection = shape_intersection{};
+  // intersection
+  auto intersection = scene_intersection{};
 
   // copy ray to modify it
   auto ray = ray_;
@@ -829,129 +2380,1049 @@ shape_intersection intersect_shape_bvh(const shape_bvh& sbvh,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
-    } else if (!shape.points.empty()) {
+    } else {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p             = shape.points[bvh.primitives[idx]];
-        auto  pintersection = intersect_point(
-            ray, shape.positions[p], shape.radius[p]);
-        if (!pintersection.hit) continue;
-        intersection = {bvh.primitives[idx], pintersection.uv,
-            pintersection.distance, true};
-        ray.tmax     = pintersection.distance;
+        auto& instance_ = sbvh.instances[bvh.primitives[idx]];
+        auto  inv_ray   = transform_ray(instance_.inv_frame, ray);
+        auto  sintersection = intersect_shape_bvh(sbvh.shapes[instance_.shape],
+             scene.shapes[instance_.shape], inv_ray, find_any);
+        if (!sintersection.hit) continue;
+        intersection = {bvh.primitives[idx], sintersection.element,
+            sintersection.uv, sintersection.distance, true};
+        ray.tmax     = sintersection.distance;
       }
-    } else if (!shape.lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l             = shape.lines[bvh.primitives[idx]];
-        auto  pintersection = intersect_line(ray, shape.positions[l.x],
-             shape.positions[l.y], shape.radius[l.x], shape.radius[l.y]);
-        if (!pintersection.hit) continue;
-        intersection = {bvh.primitives[idx], pintersection.uv,
-            pintersection.distance, true};
-        ray.tmax     = pintersection.distance;
+    }
+
+    // check for early exit
+    if (find_any && intersection.hit) return intersection;
+  }
+
+  return intersection;
+}
+
+scene_intersection intersect_instance_bvh(const scene_bvh& sbvh,
+    const scene_data& scene, int instance_, const ray3f& ray, bool find_any) {
+  auto& instance     = sbvh.instances[instance_];
+  auto  inv_ray      = transform_ray(instance.inv_frame, ray);
+  auto  intersection = intersect_shape_bvh(sbvh.shapes[instance.shape],
+       scene.shapes[instance.shape], inv_ray, find_any);
+  if (!intersection.hit) return {};
+  return {instance_, intersection.element, intersection.uv,
+      intersection.distance, true};
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH PACKET INTERSECTION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Lane mask for ray packets, with one bit per ray.
+using bvh_mask = uint32_t;
+
+// Packets are processed in groups of 4 lanes with SSE instructions.
+static_assert(bvh_packet_size == 4 || bvh_packet_size == 8 ||
+                  bvh_packet_size == 16,
+    "bvh_packet_size should be 4, 8 or 16");
+
+// Ray packet stored as a structure of arrays, so that lanes are loaded
+// together. Inverse directions are stored for box tests.
+struct bvh_packet {
+  array<float, bvh_packet_size> ox   = {};
+  array<float, bvh_packet_size> oy   = {};
+  array<float, bvh_packet_size> oz   = {};
+  array<float, bvh_packet_size> dx   = {};
+  array<float, bvh_packet_size> dy   = {};
+  array<float, bvh_packet_size> dz   = {};
+  array<float, bvh_packet_size> ix   = {};
+  array<float, bvh_packet_size> iy   = {};
+  array<float, bvh_packet_size> iz   = {};
+  array<float, bvh_packet_size> tmin = {};
+  array<float, bvh_packet_size> tmax = {};
+};
+
+// Element intersections for all rays in a packet.
+struct bvh_packet_hits {
+  array<float, bvh_packet_size> u        = {};
+  array<float, bvh_packet_size> v        = {};
+  array<float, bvh_packet_size> distance = {};
+};
+
+// Set and get packet rays
+static void set_packet_ray(bvh_packet& packet, int lane, const ray3f& ray) {
+  packet.ox[lane]   = ray.o.x;
+  packet.oy[lane]   = ray.o.y;
+  packet.oz[lane]   = ray.o.z;
+  packet.dx[lane]   = ray.d.x;
+  packet.dy[lane]   = ray.d.y;
+  packet.dz[lane]   = ray.d.z;
+  packet.ix[lane]   = 1 / ray.d.x;
+  packet.iy[lane]   = 1 / ray.d.y;
+  packet.iz[lane]   = 1 / ray.d.z;
+  packet.tmin[lane] = ray.tmin;
+  packet.tmax[lane] = ray.tmax;
+}
+static ray3f get_packet_ray(const bvh_packet& packet, int lane) {
+  return {{packet.ox[lane], packet.oy[lane], packet.oz[lane]},
+      {packet.dx[lane], packet.dy[lane], packet.dz[lane]}, packet.tmin[lane],
+      packet.tmax[lane]};
+}
+
+// Check whether any lane of a group of 4 lanes is in a mask
+static bool has_packet_lanes(bvh_mask mask, int lane) {
+  return ((mask >> lane) & 0xf) != 0;
+}
+
+// Intersect a ray packet with an axis-aligned bounding box. This is the same
+// test as intersect_bbox() for each lane, done with SSE instructions if
+// present.
+static bvh_mask intersect_bbox(
+    const bvh_packet& packet, const bbox3f& bbox, bvh_mask mask) {
+  auto result = (bvh_mask)0;
+#ifdef YOCTO_BVH_SSE
+  // min and max match the scalar versions, also for NaNs
+  auto min_x = _mm_set1_ps(bbox.min.x);
+  auto min_y = _mm_set1_ps(bbox.min.y);
+  auto min_z = _mm_set1_ps(bbox.min.z);
+  auto max_x = _mm_set1_ps(bbox.max.x);
+  auto max_y = _mm_set1_ps(bbox.max.y);
+  auto max_z = _mm_set1_ps(bbox.max.z);
+  for (auto lane = 0; lane < bvh_packet_size; lane += 4) {
+    if (!has_packet_lanes(mask, lane)) continue;
+    auto ox  = _mm_loadu_ps(packet.ox.data() + lane);
+    auto oy  = _mm_loadu_ps(packet.oy.data() + lane);
+    auto oz  = _mm_loadu_ps(packet.oz.data() + lane);
+    auto ix  = _mm_loadu_ps(packet.ix.data() + lane);
+    auto iy  = _mm_loadu_ps(packet.iy.data() + lane);
+    auto iz  = _mm_loadu_ps(packet.iz.data() + lane);
+    auto tx0 = _mm_mul_ps(_mm_sub_ps(min_x, ox), ix);
+    auto ty0 = _mm_mul_ps(_mm_sub_ps(min_y, oy), iy);
+    auto tz0 = _mm_mul_ps(_mm_sub_ps(min_z, oz), iz);
+    auto tx1 = _mm_mul_ps(_mm_sub_ps(max_x, ox), ix);
+    auto ty1 = _mm_mul_ps(_mm_sub_ps(max_y, oy), iy);
+    auto tz1 = _mm_mul_ps(_mm_sub_ps(max_z, oz), iz);
+    auto t0  = _mm_max_ps(_mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1),
+                                         _mm_min_ps(ty0, ty1)),
+                              _mm_min_ps(tz0, tz1)),
+         _mm_loadu_ps(packet.tmin.data() + lane));
+    auto t1  = _mm_min_ps(_mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1),
+                                         _mm_max_ps(ty0, ty1)),
+                              _mm_max_ps(tz0, tz1)),
+         _mm_loadu_ps(packet.tmax.data() + lane));
+    t1       = _mm_mul_ps(t1, _mm_set1_ps(1.00000024f));
+    result |= (bvh_mask)_mm_movemask_ps(_mm_cmple_ps(t0, t1)) << lane;
+  }
+#else
+  for (auto lane : range(bvh_packet_size)) {
+    auto tx0 = (bbox.min.x - packet.ox[lane]) * packet.ix[lane];
+    auto ty0 = (bbox.min.y - packet.oy[lane]) * packet.iy[lane];
+    auto tz0 = (bbox.min.z - packet.oz[lane]) * packet.iz[lane];
+    auto tx1 = (bbox.max.x - packet.ox[lane]) * packet.ix[lane];
+    auto ty1 = (bbox.max.y - packet.oy[lane]) * packet.iy[lane];
+    auto tz1 = (bbox.max.z - packet.oz[lane]) * packet.iz[lane];
+    auto t0  = max(max(max(min(tx0, tx1), min(ty0, ty1)), min(tz0, tz1)),
+         packet.tmin[lane]);
+    auto t1  = min(min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)),
+         packet.tmax[lane]);
+    t1 *= 1.00000024f;  // for double: 1.0000000000000004
+    if (t0 <= t1) result |= (bvh_mask)1 << lane;
+  }
+#endif
+  return result & mask;
+}
+
+// Intersect a ray packet with a triangle given by its first vertex and the
+// edges from it. This is the same test as intersect_triangle() for each
+// lane, done with SSE instructions if present.
+static bvh_mask intersect_triangle(const bvh_packet& packet, bvh_mask mask,
+    const bvh_triangle& triangle, bvh_packet_hits& hits) {
+  auto& p0     = triangle.p0;
+  auto& edge1  = triangle.e1;
+  auto& edge2  = triangle.e2;
+  auto  result = (bvh_mask)0;
+#ifdef YOCTO_BVH_SSE
+  auto p0x = _mm_set1_ps(p0.x), p0y = _mm_set1_ps(p0.y),
+       p0z = _mm_set1_ps(p0.z);
+  auto e1x = _mm_set1_ps(edge1.x), e1y = _mm_set1_ps(edge1.y),
+       e1z = _mm_set1_ps(edge1.z);
+  auto e2x = _mm_set1_ps(edge2.x), e2y = _mm_set1_ps(edge2.y),
+       e2z = _mm_set1_ps(edge2.z);
+  auto zero = _mm_setzero_ps(), one = _mm_set1_ps(1);
+  for (auto lane = 0; lane < bvh_packet_size; lane += 4) {
+    if (!has_packet_lanes(mask, lane)) continue;
+    auto dx      = _mm_loadu_ps(packet.dx.data() + lane);
+    auto dy      = _mm_loadu_ps(packet.dy.data() + lane);
+    auto dz      = _mm_loadu_ps(packet.dz.data() + lane);
+    auto px      = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    auto py      = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    auto pz      = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    auto det     = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px),
+                                  _mm_mul_ps(e1y, py)),
+            _mm_mul_ps(e1z, pz));
+    auto inv_det = _mm_div_ps(one, det);
+    auto tx      = _mm_sub_ps(_mm_loadu_ps(packet.ox.data() + lane), p0x);
+    auto ty      = _mm_sub_ps(_mm_loadu_ps(packet.oy.data() + lane), p0y);
+    auto tz      = _mm_sub_ps(_mm_loadu_ps(packet.oz.data() + lane), p0z);
+    auto u       = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)),
+            _mm_mul_ps(tz, pz)),
+        inv_det);
+    auto qx      = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    auto qy      = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    auto qz      = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    auto v       = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+            _mm_mul_ps(dz, qz)),
+        inv_det);
+    auto t       = _mm_mul_ps(
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+            _mm_mul_ps(e2z, qz)),
+        inv_det);
+    _mm_storeu_ps(hits.u.data() + lane, u);
+    _mm_storeu_ps(hits.v.data() + lane, v);
+    _mm_storeu_ps(hits.distance.data() + lane, t);
+    // comparisons are false for NaNs, as in the scalar version
+    auto miss = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)),
+        _mm_or_ps(_mm_cmplt_ps(v, zero),
+            _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+    miss      = _mm_or_ps(miss,
+             _mm_or_ps(_mm_cmplt_ps(t, _mm_loadu_ps(packet.tmin.data() + lane)),
+                 _mm_cmpgt_ps(t, _mm_loadu_ps(packet.tmax.data() + lane))));
+    auto hit  = _mm_andnot_ps(miss, _mm_cmpneq_ps(det, zero));
+    result |= (bvh_mask)_mm_movemask_ps(hit) << lane;
+  }
+#else
+  for (auto lane : range(bvh_packet_size)) {
+    auto dx      = packet.dx[lane];
+    auto dy      = packet.dy[lane];
+    auto dz      = packet.dz[lane];
+    auto px      = dy * edge2.z - dz * edge2.y;
+    auto py      = dz * edge2.x - dx * edge2.z;
+    auto pz      = dx * edge2.y - dy * edge2.x;
+    auto det     = edge1.x * px + edge1.y * py + edge1.z * pz;
+    auto inv_det = 1.0f / det;
+    auto tx      = packet.ox[lane] - p0.x;
+    auto ty      = packet.oy[lane] - p0.y;
+    auto tz      = packet.oz[lane] - p0.z;
+    auto u       = (tx * px + ty * py + tz * pz) * inv_det;
+    auto qx      = ty * edge1.z - tz * edge1.y;
+    auto qy      = tz * edge1.x - tx * edge1.z;
+    auto qz      = tx * edge1.y - ty * edge1.x;
+    auto v       = (dx * qx + dy * qy + dz * qz) * inv_det;
+    auto t       = (edge2.x * qx + edge2.y * qy + edge2.z * qz) * inv_det;
+    hits.u[lane] = u;
+    hits.v[lane] = v;
+    hits.distance[lane] = t;
+    if (det != 0 && !(u < 0 || u > 1) && !(v < 0 || u + v > 1) &&
+        !(t < packet.tmin[lane] || t > packet.tmax[lane]))
+      result |= (bvh_mask)1 << lane;
+  }
+#endif
+  return result & mask;
+}
+
+// Intersect a ray packet with a triangle. This is the same test as
+// intersect_triangle() for each lane.
+static bvh_mask intersect_triangle(const bvh_packet& packet, bvh_mask mask,
+    vec3f p0, vec3f p1, vec3f p2, bvh_packet_hits& hits) {
+  return intersect_triangle(packet, mask, {p0, p1 - p0, p2 - p0}, hits);
+}
+
+// Intersect a ray packet with a quad. This is the same test as
+// intersect_quad() for each lane.
+static bvh_mask intersect_quad(const bvh_packet& packet, bvh_mask mask,
+    vec3f p0, vec3f p1, vec3f p2, vec3f p3, bvh_packet_hits& hits) {
+  if (p2 == p3) return intersect_triangle(packet, mask, p0, p1, p3, hits);
+  auto hits2 = bvh_packet_hits{};
+  auto mask1 = intersect_triangle(packet, mask, p0, p1, p3, hits);
+  auto mask2 = intersect_triangle(packet, mask, p2, p3, p1, hits2);
+  if (!mask2) return mask1;
+  for (auto lane : range(bvh_packet_size)) {
+    auto bit = (bvh_mask)1 << lane;
+    if (!(mask2 & bit)) continue;
+    if ((mask1 & bit) && hits.distance[lane] < hits2.distance[lane]) continue;
+    hits.u[lane]        = 1 - hits2.u[lane];
+    hits.v[lane]        = 1 - hits2.v[lane];
+    hits.distance[lane] = hits2.distance[lane];
+  }
+  return mask1 | mask2;
+}
+
+// Intersect a ray packet with an element, one lane at a time, for elements
+// that do not have a packet test.
+template <typename Intersect>
+static bvh_mask intersect_lanes(const bvh_packet& packet, bvh_mask mask,
+    bvh_packet_hits& hits, Intersect&& intersect_element) {
+  auto result = (bvh_mask)0;
+  for (auto lane : range(bvh_packet_size)) {
+    auto bit = (bvh_mask)1 << lane;
+    if (!(mask & bit)) continue;
+    auto intersection = intersect_element(get_packet_ray(packet, lane));
+    if (!intersection.hit) continue;
+    hits.u[lane]        = intersection.uv.x;
+    hits.v[lane]        = intersection.uv.y;
+    hits.distance[lane] = intersection.distance;
+    result |= bit;
+  }
+  return result;
+}
+
+// Intersect a ray packet with wide or compressed nodes. Children are tested
+// against all active rays, and pushed with the rays that hit them, nearest
+// first along the first of these rays. `intersect_primitive(index, packet,
+// mask)` takes the index in the primitive array, returns the rays that hit
+// the primitive, and updates their tmax.
+template <typename Node, typename Intersect>
+static bvh_mask intersect_packet_nodes(const vector<Node>& nodes,
+    Intersect&& intersect_primitive, bvh_packet& packet, bvh_mask active,
+    bool find_any) {
+  // check empty
+  if (nodes.empty()) return 0;
+
+  // node stack, with leaves stored as ~(node * bvh_wide_size + child),
+  // and the rays to test for each node
+  auto node_stack        = array<int, 128>{};
+  auto mask_stack        = array<bvh_mask, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur]   = 0;
+  mask_stack[node_cur++] = active;
+
+  // hits
+  auto result = (bvh_mask)0;
+
+  // walking stack
+  while (node_cur != 0 && active != 0) {
+    // grab node
+    node_cur -= 1;
+    auto nodeid = node_stack[node_cur];
+    auto mask   = mask_stack[node_cur] & active;
+    if (!mask) continue;
+
+    // intersect leaf
+    if (nodeid < 0) {
+      auto& node  = nodes[~nodeid / bvh_wide_size];
+      auto  child = ~nodeid % bvh_wide_size;
+      for (auto idx : range((int)node.num[child])) {
+        result |= intersect_primitive(node.start[child] + idx, packet, mask);
       }
-    } else if (!shape.triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t             = shape.triangles[bvh.primitives[idx]];
-        auto  pintersection = intersect_triangle(ray, shape.positions[t.x],
-             shape.positions[t.y], shape.positions[t.z]);
-        if (!pintersection.hit) continue;
-        intersection = {bvh.primitives[idx], pintersection.uv,
-            pintersection.distance, true};
-        ray.tmax     = pintersection.distance;
+      if (find_any) active &= ~result;
+      continue;
+    }
+
+    // intersect children bboxes, with their distance along the first ray
+    auto& node   = nodes[nodeid];
+    auto  lane   = std::countr_zero(mask);
+    auto  masks  = array<bvh_mask, bvh_wide_size>{};
+    auto  tnear  = array<float, bvh_wide_size>{};
+    auto  order  = array<int, bvh_wide_size>{};
+    auto  count  = 0;
+    auto  origin = vec3f{packet.ox[lane], packet.oy[lane], packet.oz[lane]};
+    auto  dir    = vec3f{packet.dx[lane], packet.dy[lane], packet.dz[lane]};
+    for (auto child : range((int)node.count)) {
+      auto bbox    = get_child_bbox(node, child);
+      masks[child] = intersect_bbox(packet, bbox, mask);
+      if (!masks[child]) continue;
+      tnear[child] = dot(center(bbox) - origin, dir);
+      // push from farthest to nearest, so that the nearest is visited first
+      auto pos = count++;
+      while (pos > 0 && tnear[order[pos - 1]] < tnear[child]) {
+        order[pos] = order[pos - 1];
+        pos -= 1;
       }
-    } else if (!shape.quads.empty()) {
+      order[pos] = child;
+    }
+    for (auto idx : range(count)) {
+      auto child             = order[idx];
+      node_stack[node_cur]   = is_internal_child(node, child)
+                                   ? node.start[child]
+                                   : ~(nodeid * bvh_wide_size + child);
+      mask_stack[node_cur++] = masks[child];
+    }
+  }
+
+  return result;
+}
+
+// Intersect a ray packet with a bvh, using wide or compressed nodes if
+// present. Binary nodes are tested against all active rays and visited if
+// any ray hits them. `intersect_primitive(index, packet, mask)` is as for
+// intersect_packet_nodes(). Returns the rays that hit.
+template <typename Intersect>
+static bvh_mask intersect_packet_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_primitive, bvh_packet& packet, bvh_mask active,
+    bool find_any) {
+  // use wide nodes if present
+  if (!bvh.compressed_nodes.empty()) {
+    return intersect_packet_nodes(
+        bvh.compressed_nodes, intersect_primitive, packet, active, find_any);
+  } else if (!bvh.wide_nodes.empty()) {
+    return intersect_packet_nodes(
+        bvh.wide_nodes, intersect_primitive, packet, active, find_any);
+  }
+
+  // check empty
+  if (bvh.nodes.empty()) return 0;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = 0;
+
+  // hits
+  auto result = (bvh_mask)0;
+
+  // walking stack
+  while (node_cur != 0 && active != 0) {
+    // grab node
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+
+    // intersect bbox
+    auto mask = intersect_bbox(packet, node.bbox, active);
+    if (!mask) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // order children using the direction of the first active ray
+      auto  lane     = std::countr_zero(mask);
+      auto& ray_dinv = node.axis == 0   ? packet.ix
+                       : node.axis == 1 ? packet.iy
+                                        : packet.iz;
+      if (ray_dinv[lane] < 0) {
+        node_stack[node_cur++] = node.start + 0;
+        node_stack[node_cur++] = node.start + 1;
+      } else {
+        node_stack[node_cur++] = node.start + 1;
+        node_stack[node_cur++] = node.start + 0;
+      }
+    } else {
       for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q             = shape.quads[bvh.primitives[idx]];
-        auto  pintersection = intersect_quad(ray, shape.positions[q.x],
-             shape.positions[q.y], shape.positions[q.z], shape.positions[q.w]);
-        if (!pintersection.hit) continue;
-        intersection = {bvh.primitives[idx], pintersection.uv,
-            pintersection.distance, true};
-        ray.tmax     = pintersection.distance;
+        result |= intersect_primitive(idx, packet, mask);
       }
     }
 
-    // check for early exit
-    if (find_any && intersection.hit) return intersection;
+    // remove rays that are done
+    if (find_any) active &= ~result;
+  }
+
+  return result;
+}
+
+// Intersect a ray packet with a bvh of shape elements.
+// `intersect_element(index, packet, mask, hits)` takes the index in the
+// primitive array.
+template <typename Intersect>
+static bvh_mask intersect_elements_bvh(const bvh_tree& bvh,
+    Intersect&& intersect_element, bvh_packet& packet, bvh_mask active,
+    shape_intersection* intersections, bool find_any) {
+  auto hits = bvh_packet_hits{};
+  return intersect_packet_bvh(
+      bvh,
+      [&](int index, bvh_packet& packet, bvh_mask mask) {
+        auto hmask = intersect_element(index, packet, mask, hits);
+        if (!hmask) return hmask;
+        auto primitive = bvh.primitives[index];
+        for (auto lane : range(bvh_packet_size)) {
+          if (!(hmask & ((bvh_mask)1 << lane))) continue;
+          intersections[lane] = {primitive, {hits.u[lane], hits.v[lane]},
+              hits.distance[lane], true};
+          packet.tmax[lane]   = hits.distance[lane];
+        }
+        return hmask;
+      },
+      packet, active, find_any);
+}
+
+// Intersect a ray packet with a shape bvh.
+static bvh_mask intersect_shape_bvh(const shape_bvh& sbvh,
+    const shape_data& shape, bvh_packet& packet, bvh_mask active,
+    shape_intersection* intersections, bool find_any) {
+  auto& primitives = sbvh.bvh.primitives;
+  if (!shape.points.empty()) {
+    return intersect_elements_bvh(
+        sbvh.bvh,
+        [&](int index, const bvh_packet& packet, bvh_mask mask,
+            bvh_packet_hits& hits) {
+          auto& p = shape.points[primitives[index]];
+          return intersect_lanes(packet, mask, hits, [&](const ray3f& ray) {
+            return intersect_point(ray, shape.positions[p], shape.radius[p]);
+          });
+        },
+        packet, active, intersections, find_any);
+  } else if (!shape.lines.empty()) {
+    return intersect_elements_bvh(
+        sbvh.bvh,
+        [&](int index, const bvh_packet& packet, bvh_mask mask,
+            bvh_packet_hits& hits) {
+          auto& l = shape.lines[primitives[index]];
+          return intersect_lanes(packet, mask, hits, [&](const ray3f& ray) {
+            return intersect_line(ray, shape.positions[l.x],
+                shape.positions[l.y], shape.radius[l.x], shape.radius[l.y]);
+          });
+        },
+        packet, active, intersections, find_any);
+  } else if (!sbvh.triangles.empty()) {
+    return intersect_elements_bvh(
+        sbvh.bvh,
+        [&](int index, const bvh_packet& packet, bvh_mask mask,
+            bvh_packet_hits& hits) {
+          return intersect_triangle(packet, mask, sbvh.triangles[index], hits);
+        },
+        packet, active, intersections, find_any);
+  } else if (!shape.triangles.empty()) {
+    return intersect_elements_bvh(
+        sbvh.bvh,
+        [&](int index, const bvh_packet& packet, bvh_mask mask,
+            bvh_packet_hits& hits) {
+          auto& t = shape.triangles[primitives[index]];
+          return intersect_triangle(packet, mask, shape.positions[t.x],
+              shape.positions[t.y], shape.positions[t.z], hits);
+        },
+        packet, active, intersections, find_any);
+  } else if (!shape.quads.empty()) {
+    return intersect_elements_bvh(
+        sbvh.bvh,
+        [&](int index, const bvh_packet& packet, bvh_mask mask,
+            bvh_packet_hits& hits) {
+          auto& q = shape.quads[primitives[index]];
+          return intersect_quad(packet, mask, shape.positions[q.x],
+              shape.positions[q.y], shape.positions[q.z], shape.positions[q.w],
+              hits);
+        },
+        packet, active, intersections, find_any);
+  } else {
+    return 0;
+  }
+}
+
+// Intersect a ray packet with a scene bvh. Rays are transformed to the local
+// frame of each instance they reach, and traced as a packet in the shape.
+static bvh_mask intersect_scene_bvh(const scene_bvh& sbvh,
+    const scene_data& scene, bvh_packet& packet, bvh_mask active,
+    scene_intersection* intersections, bool find_any) {
+  auto local_packet   = bvh_packet{};
+  auto sintersections = array<shape_intersection, bvh_packet_size>{};
+  return intersect_packet_bvh(
+      sbvh.bvh,
+      [&](int index, bvh_packet& packet, bvh_mask mask) {
+        auto  instance_id = sbvh.bvh.primitives[index];
+        auto& instance_   = sbvh.instances[instance_id];
+        auto& inv_frame   = instance_.inv_frame;
+        for (auto lane : range(bvh_packet_size)) {
+          if (!(mask & ((bvh_mask)1 << lane))) continue;
+          set_packet_ray(local_packet, lane,
+              transform_ray(inv_frame, get_packet_ray(packet, lane)));
+        }
+        auto hmask = intersect_shape_bvh(sbvh.shapes[instance_.shape],
+            scene.shapes[instance_.shape], local_packet, mask,
+            sintersections.data(), find_any);
+        if (!hmask) return hmask;
+        for (auto lane : range(bvh_packet_size)) {
+          if (!(hmask & ((bvh_mask)1 << lane))) continue;
+          auto& sintersection = sintersections[lane];
+          intersections[lane] = {instance_id, sintersection.element,
+              sintersection.uv, sintersection.distance, true};
+          packet.tmax[lane]   = sintersection.distance;
+        }
+        return hmask;
+      },
+      packet, active, find_any);
+}
+
+// Intersect rays with a bvh in packets.
+template <typename Intersection, typename Intersect>
+static vector<Intersection> intersect_packets(
+    const vector<ray3f>& rays, Intersect&& intersect_packet) {
+  auto intersections = vector<Intersection>(rays.size());
+  auto packet        = bvh_packet{};
+  for (auto start = (size_t)0; start < rays.size();
+       start += bvh_packet_size) {
+    auto num    = (int)min(rays.size() - start, (size_t)bvh_packet_size);
+    auto active = (bvh_mask)0;
+    for (auto lane : range(num)) {
+      set_packet_ray(packet, lane, rays[start + lane]);
+      active |= (bvh_mask)1 << lane;
+    }
+    intersect_packet(packet, active, intersections.data() + start);
+  }
+  return intersections;
+}
+
+vector<shape_intersection> intersect_shape_bvh(const shape_bvh& sbvh,
+    const shape_data& shape, const vector<ray3f>& rays, bool find_any) {
+  return intersect_packets<shape_intersection>(
+      rays, [&](bvh_packet& packet, bvh_mask active,
+                shape_intersection* intersections) {
+        intersect_shape_bvh(
+            sbvh, shape, packet, active, intersections, find_any);
+      });
+}
+
+vector<scene_intersection> intersect_scene_bvh(const scene_bvh& sbvh,
+    const scene_data& scene, const vector<ray3f>& rays, bool find_any) {
+  return intersect_packets<scene_intersection>(
+      rays, [&](bvh_packet& packet, bvh_mask active,
+                scene_intersection* intersections) {
+        intersect_scene_bvh(
+            sbvh, scene, packet, active, intersections, find_any);
+      });
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BATCHED QUERIES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Number of queries processed by each task of batched queries.
+const auto bvh_batch_size = 1024;
+
+// Morton code of a position quantized to 10 bits per axis in the given bounds
+static uint64_t morton_code(vec3f position, const bbox3f& bounds) {
+  auto spread = [](uint64_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+  };
+  auto size = max(bounds.max - bounds.min, vec3f{1e-12f, 1e-12f, 1e-12f});
+  auto cell = clamp((position - bounds.min) / size, 0.0f, 1.0f) * 1023.0f;
+  return spread((uint64_t)cell.x) | (spread((uint64_t)cell.y) << 1) |
+         (spread((uint64_t)cell.z) << 2);
+}
+
+// Sort key for ray coherence.
+uint64_t ray_sort_key(const ray3f& ray, const bbox3f& bounds) {
+  auto octant = (uint64_t)((ray.d.x < 0 ? 1 : 0) | (ray.d.y < 0 ? 2 : 0) |
+                           (ray.d.z < 0 ? 4 : 0));
+  return (octant << 30) | morton_code(ray.o, bounds);
+}
+
+// Bounds of a set of positions
+template <typename Position>
+static bbox3f query_bounds(int num, bool noparallel, Position&& position) {
+  return reduce_primitives(
+      0, num, noparallel, invalidb3f,
+      [&](bbox3f& bbox, int start, int end) {
+        for (auto idx : range(start, end)) bbox = merge(bbox, position(idx));
+      },
+      [](const bbox3f& a, const bbox3f& b) { return merge(a, b); });
+}
+
+// Sort pairs of keys and indices with a radix sort on 11-bit digits, up to
+// the highest bit set in the keys. Each pass counts digits and scatters
+// pairs by chunks in parallel. Chunks are scattered in order, so the sort is
+// stable.
+void sort_ray_keys(vector<pair<uint64_t, int>>& keys, bool noparallel) {
+  // largest key
+  auto num     = (int)keys.size();
+  auto max_key = reduce_primitives(
+      0, num, noparallel, (uint64_t)0,
+      [&](uint64_t& value, int start, int end) {
+        for (auto idx : range(start, end))
+          value = max(value, keys[idx].first);
+      },
+      [](uint64_t a, uint64_t b) { return max(a, b); });
+
+  // chunks
+  const auto digit_bits = 11, num_digits = 1 << digit_bits;
+  auto       nchunks    = (num + bvh_chunk_size - 1) / bvh_chunk_size;
+  auto       for_chunks = [&](auto&& func) {
+    if (noparallel) {
+      for (auto chunk : range(nchunks)) func(chunk);
+    } else {
+      parallel_for(nchunks, func);
+    }
+  };
+
+  // sort by digits, starting from the least significant one
+  auto offsets = vector<int>((size_t)nchunks * num_digits);
+  auto sorted  = vector<pair<uint64_t, int>>(num);
+  for (auto shift = 0; shift < (int)std::bit_width(max_key);
+       shift += digit_bits) {
+    // count digits in chunks
+    std::fill(offsets.begin(), offsets.end(), 0);
+    for_chunks([&](int chunk) {
+      auto counts = offsets.data() + (size_t)chunk * num_digits;
+      auto end    = min((chunk + 1) * bvh_chunk_size, num);
+      for (auto idx : range(chunk * bvh_chunk_size, end)) {
+        counts[(keys[idx].first >> shift) & (num_digits - 1)] += 1;
+      }
+    });
+
+    // offsets of digits in chunks, with chunks in order within each digit
+    auto offset = 0;
+    for (auto digit : range(num_digits)) {
+      for (auto chunk : range(nchunks)) {
+        auto& count = offsets[(size_t)chunk * num_digits + digit];
+        auto  next  = offset + count;
+        count       = offset;
+        offset      = next;
+      }
+    }
+
+    // scatter chunks
+    for_chunks([&](int chunk) {
+      auto counts = offsets.data() + (size_t)chunk * num_digits;
+      auto end    = min((chunk + 1) * bvh_chunk_size, num);
+      for (auto idx : range(chunk * bvh_chunk_size, end)) {
+        sorted[counts[(keys[idx].first >> shift) & (num_digits - 1)]++] =
+            keys[idx];
+      }
+    });
+    std::swap(keys, sorted);
+  }
+}
+
+// Run a query on batches of items sorted by `key(idx)`, in parallel.
+// `query(indices, num)` processes `num` items whose indices are given.
+template <typename Key, typename Query>
+static void query_sorted(int num, bool noparallel, Key&& key, Query&& query) {
+  // sort items by key
+  auto keys = vector<pair<uint64_t, int>>(num);
+  for_primitives(0, num, noparallel, [&](int start, int end) {
+    for (auto idx : range(start, end)) keys[idx] = {key(idx), idx};
+  });
+  sort_ray_keys(keys, noparallel);
+  auto order = vector<int>(num);
+  for_primitives(0, num, noparallel, [&](int start, int end) {
+    for (auto idx : range(start, end)) order[idx] = keys[idx].second;
+  });
+  keys = {};
+
+  // run batches
+  auto nbatches = (num + bvh_batch_size - 1) / bvh_batch_size;
+  auto run      = [&](int batch) {
+    auto start = batch * bvh_batch_size;
+    query(order.data() + start, min(bvh_batch_size, num - start));
+  };
+  if (noparallel) {
+    for (auto batch : range(nbatches)) run(batch);
+  } else {
+    parallel_for(nbatches, run);
+  }
+}
+
+// Run a query on batches of rays sorted for coherence, in parallel.
+template <typename Query>
+static void query_rays(span<const ray3f> rays, bool noparallel, Query&& query) {
+  auto num    = (int)rays.size();
+  auto bounds = query_bounds(
+      num, noparallel, [&](int idx) { return rays[idx].o; });
+  query_sorted(
+      num, noparallel,
+      [&](int idx) { return ray_sort_key(rays[idx], bounds); }, query);
+}
+
+// Batched ray intersection
+void intersect_scene_bvh(const scene_bvh& sbvh, const scene_data& scene,
+    span<const ray3f> rays, span<scene_intersection> intersections,
+    bool find_any, bool noparallel) {
+  if (rays.size() != intersections.size())
+    throw std::invalid_argument{"rays and results should have the same size"};
+  query_rays(rays, noparallel, [&](const int* indices, int num) {
+    for (auto idx : range(num)) {
+      intersections[indices[idx]] = intersect_scene_bvh(
+          sbvh, scene, rays[indices[idx]], find_any);
+    }
+  });
+}
+
+// Intersect a ray with a shape element
+static prim_intersection intersect_element(
+    const shape_data& shape, int element, const ray3f& ray) {
+  if (!shape.points.empty()) {
+    auto& p = shape.points[element];
+    return intersect_point(ray, shape.positions[p], shape.radius[p]);
+  } else if (!shape.lines.empty()) {
+    auto& l = shape.lines[element];
+    return intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
+        shape.radius[l.x], shape.radius[l.y]);
+  } else if (!shape.triangles.empty()) {
+    auto& t = shape.triangles[element];
+    return intersect_triangle(
+        ray, shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+  } else if (!shape.quads.empty()) {
+    auto& q = shape.quads[element];
+    return intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
+        shape.positions[q.z], shape.positions[q.w]);
+  } else {
+    return {};
+  }
+}
+
+// Collect all the elements hit by a ray, as pairs of instance and element.
+// Elements may be collected more than once in spatial split bvhs.
+static void collect_shape_bvh(const shape_bvh& sbvh, const shape_data& shape,
+    int instance, const ray3f& ray, vector<vec2i>& hits) {
+  // get bvh tree
+  auto& bvh = sbvh.bvh;
+  if (is_empty_bvh(bvh)) return;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = get_root_subtree(bvh);
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur != 0) {
+    auto node = node_stack[--node_cur];
+    if (!intersect_bbox(ray, ray_dinv, get_subtree_bbox(bvh, node))) continue;
+    if (is_internal_subtree(bvh, node)) {
+      auto children = array<int, bvh_wide_size>{};
+      auto count    = get_subtree_children(bvh, node, children);
+      for (auto idx : range(count)) node_stack[node_cur++] = children[idx];
+    } else {
+      auto [start, num] = get_subtree_primitives(bvh, node);
+      for (auto idx = start; idx < start + num; idx++) {
+        auto element = bvh.primitives[idx];
+        if (intersect_element(shape, element, ray).hit)
+          hits.push_back({instance, element});
+      }
+    }
   }
-
-  return intersection;
 }
 
-scene_intersection intersect_scene_bvh(const scene_bvh& sbvh,
-    const scene_data& scene, const ray3f& ray_, bool find_any) {
+// Count the distinct elements hit by a ray
+static int count_scene_bvh(const scene_bvh& sbvh, const scene_data& scene,
+    const ray3f& ray, vector<vec2i>& hits) {
   // get instances bvh
   auto& bvh = sbvh.bvh;
-
-  // check empty
-  if (bvh.nodes.empty()) return {};
+  if (is_empty_bvh(bvh)) return 0;
 
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
-
-  // intersection
-  auto intersection = scene_intersection{};
-
-  // copy ray to modify it
-  auto ray = ray_;
+  node_stack[node_cur++] = get_root_subtree(bvh);
 
   // prepare ray for fast queries
-  auto ray_dinv  = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-  auto ray_dsign = vec3i{(ray_dinv.x < 0) ? 1 : 0, (ray_dinv.y < 0) ? 1 : 0,
-      (ray_dinv.z < 0) ? 1 : 0};
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
 
   // walking stack
+  hits.clear();
   while (node_cur != 0) {
-    // grab node
-    auto& node = bvh.nodes[node_stack[--node_cur]];
+    auto node = node_stack[--node_cur];
+    if (!intersect_bbox(ray, ray_dinv, get_subtree_bbox(bvh, node))) continue;
+    if (is_internal_subtree(bvh, node)) {
+      auto children = array<int, bvh_wide_size>{};
+      auto count    = get_subtree_children(bvh, node, children);
+      for (auto idx : range(count)) node_stack[node_cur++] = children[idx];
+    } else {
+      auto [start, num] = get_subtree_primitives(bvh, node);
+      for (auto idx = start; idx < start + num; idx++) {
+        auto  instance  = bvh.primitives[idx];
+        auto& instance_ = sbvh.instances[instance];
+        collect_shape_bvh(sbvh.shapes[instance_.shape],
+            scene.shapes[instance_.shape], instance,
+            transform_ray(instance_.inv_frame, ray), hits);
+      }
+    }
+  }
 
-    // intersect bbox
-    // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
-    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+  // remove duplicates
+  std::sort(hits.begin(), hits.end(), [](vec2i a, vec2i b) {
+    return a.x < b.x || (a.x == b.x && a.y < b.y);
+  });
+  return (int)(std::unique(hits.begin(), hits.end()) - hits.begin());
+}
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // for internal nodes, attempts to proceed along the
-      // split axis from smallest to largest nodes
-      if (ray_dsign[node.axis] != 0) {
-        node_stack[node_cur++] = node.start + 0;
-        node_stack[node_cur++] = node.start + 1;
-      } else {
-        node_stack[node_cur++] = node.start + 1;
-        node_stack[node_cur++] = node.start + 0;
+// Batched ray hit counts
+void count_scene_bvh(const scene_bvh& sbvh, const scene_data& scene,
+    span<const ray3f> rays, span<int> counts, bool noparallel) {
+  if (rays.size() != counts.size())
+    throw std::invalid_argument{"rays and results should have the same size"};
+  query_rays(rays, noparallel, [&](const int* indices, int num) {
+    auto hits = vector<vec2i>{};
+    for (auto idx : range(num)) {
+      counts[indices[idx]] = count_scene_bvh(
+          sbvh, scene, rays[indices[idx]], hits);
+    }
+  });
+}
+
+// Distance of a shape element to a position within a maximum distance.
+// Missing radius are treated as zero.
+static prim_intersection overlap_shape_element(
+    const shape_data& shape, int element, vec3f pos, float max_distance) {
+  auto radius = [&](int vertex) {
+    return shape.radius.empty() ? 0.0f : shape.radius[vertex];
+  };
+  if (!shape.points.empty()) {
+    auto& p = shape.points[element];
+    return overlap_point(pos, max_distance, shape.positions[p], radius(p));
+  } else if (!shape.lines.empty()) {
+    auto& l = shape.lines[element];
+    return overlap_line(pos, max_distance, shape.positions[l.x],
+        shape.positions[l.y], radius(l.x), radius(l.y));
+  } else if (!shape.triangles.empty()) {
+    auto& t = shape.triangles[element];
+    return overlap_triangle(pos, max_distance, shape.positions[t.x],
+        shape.positions[t.y], shape.positions[t.z], radius(t.x), radius(t.y),
+        radius(t.z));
+  } else if (!shape.quads.empty()) {
+    auto& q = shape.quads[element];
+    return overlap_quad(pos, max_distance, shape.positions[q.x],
+        shape.positions[q.y], shape.positions[q.z], shape.positions[q.w],
+        radius(q.x), radius(q.y), radius(q.z), radius(q.w));
+  } else {
+    return {};
+  }
+}
+
+// Squared distance of a position to a bbox
+static float bbox_distance_squared(vec3f pos, const bbox3f& bbox) {
+  auto delta = max(max(bbox.min - pos, pos - bbox.max), vec3f{0, 0, 0});
+  return dot(delta, delta);
+}
+
+// Walk a bvh visiting the leaves closest to a position first, and skipping
+// nodes farther than `max_distance()`, that shrinks as elements are found.
+template <typename MaxDistance, typename VisitElement>
+static void closest_bvh_elements(const bvh_tree& bvh, vec3f pos,
+    MaxDistance&& max_distance, VisitElement&& visit_element) {
+  // check if empty
+  if (is_empty_bvh(bvh)) return;
+
+  // node stack
+  auto node_stack        = array<int, 128>{};
+  auto node_cur          = 0;
+  node_stack[node_cur++] = get_root_subtree(bvh);
+
+  // walking stack
+  while (node_cur != 0) {
+    auto node = node_stack[--node_cur];
+    if (!overlap_bbox(pos, max_distance(), get_subtree_bbox(bvh, node)))
+      continue;
+    if (is_internal_subtree(bvh, node)) {
+      // sort children by distance, and push the farthest first, so that the
+      // closest is visited first
+      auto children  = array<int, bvh_wide_size>{};
+      auto distances = array<float, bvh_wide_size>{};
+      auto count     = get_subtree_children(bvh, node, children);
+      for (auto idx : range(count)) {
+        distances[idx] = bbox_distance_squared(
+            pos, get_subtree_bbox(bvh, children[idx]));
+        for (auto cur = idx; cur > 0 && distances[cur - 1] > distances[cur];
+             cur--) {
+          std::swap(distances[cur - 1], distances[cur]);
+          std::swap(children[cur - 1], children[cur]);
+        }
+      }
+      for (auto idx = count - 1; idx >= 0; idx--) {
+        node_stack[node_cur++] = children[idx];
       }
     } else {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& instance_ = scene.instances[bvh.primitives[idx]];
-        auto  inv_ray   = transform_ray(inverse(instance_.frame, true), ray);
-        auto  sintersection = intersect_shape_bvh(sbvh.shapes[instance_.shape],
-             scene.shapes[instance_.shape], inv_ray, find_any);
-        if (!sintersection.hit) continue;
-        intersection = {bvh.primitives[idx], sintersection.element,
-            sintersection.uv, sintersection.distance, true};
-        ray.tmax     = sintersection.distance;
+      auto [start, num] = get_subtree_primitives(bvh, node);
+      for (auto idx = start; idx < start + num; idx++) {
+        visit_element(bvh.primitives[idx]);
       }
     }
-
-    // check for early exit
-    if (find_any && intersection.hit) return intersection;
   }
+}
 
-  return intersection;
+// Batched closest elements
+void overlap_shape_bvh(const shape_bvh& sbvh, const shape_data& shape,
+    span<const vec3f> positions, float max_distance,
+    span<shape_intersection> intersections, bool noparallel) {
+  if (positions.size() != intersections.size())
+    throw std::invalid_argument{
+        "positions and results should have the same size"};
+  auto num    = (int)positions.size();
+  auto bounds = query_bounds(
+      num, noparallel, [&](int idx) { return positions[idx]; });
+  query_sorted(
+      num, noparallel,
+      [&](int idx) { return morton_code(positions[idx], bounds); },
+      [&](const int* indices, int num) {
+        auto previous = -1;
+        for (auto idx : range(num)) {
+          auto pos          = positions[indices[idx]];
+          auto intersection = shape_intersection{};
+          auto distance     = max_distance;
+          // the element closest to the previous query bounds the search
+          auto visit = [&](int element) {
+            auto eintersection = overlap_shape_element(
+                shape, element, pos, distance);
+            if (!eintersection.hit) return;
+            intersection = {
+                element, eintersection.uv, eintersection.distance, true};
+            distance = eintersection.distance;
+          };
+          if (previous >= 0) visit(previous);
+          closest_bvh_elements(
+              sbvh.bvh, pos, [&] { return distance; }, visit);
+          intersections[indices[idx]] = intersection;
+          if (intersection.hit) previous = intersection.element;
+        }
+      });
 }
 
-scene_intersection intersect_instance_bvh(const scene_bvh& sbvh,
-    const scene_data& scene, int instance_, const ray3f& ray, bool find_any) {
-  auto& instance     = scene.instances[instance_];
-  auto  inv_ray      = transform_ray(inverse(instance.frame, true), ray);
-  auto  intersection = intersect_shape_bvh(sbvh.shapes[instance.shape],
-       scene.shapes[instance.shape], inv_ray, find_any);
-  if (!intersection.hit) return {};
-  return {instance_, intersection.element, intersection.uv,
-      intersection.distance, true};
+// Batched k-nearest elements
+void nearest_shape_bvh(const shape_bvh& sbvh, const shape_data& shape,
+    span<const vec3f> positions, float max_distance, int k,
+    span<shape_intersection> neighbors, bool noparallel) {
+  if (k <= 0) throw std::invalid_argument{"k should be positive"};
+  if (positions.size() * k != neighbors.size())
+    throw std::invalid_argument{
+        "results should have k elements for each position"};
+  auto num    = (int)positions.size();
+  auto bounds = query_bounds(
+      num, noparallel, [&](int idx) { return positions[idx]; });
+  query_sorted(
+      num, noparallel,
+      [&](int idx) { return morton_code(positions[idx], bounds); },
+      [&](const int* indices, int num) {
+        // max heap on distance of the neighbors found so far
+        auto farther = [](const shape_intersection& a,
+                           const shape_intersection& b) {
+          return a.distance < b.distance;
+        };
+        auto heap     = vector<shape_intersection>{};
+        auto previous = vector<int>{};
+        for (auto idx : range(num)) {
+          auto pos      = positions[indices[idx]];
+          auto distance = [&] {
+            return (int)heap.size() == k ? heap.front().distance
+                                         : max_distance;
+          };
+          // skip the elements referenced more than once with spatial splits
+          auto visit = [&](int element) {
+            auto eintersection = overlap_shape_element(
+                shape, element, pos, distance());
+            if (!eintersection.hit) return;
+            for (auto& neighbor : heap) {
+              if (neighbor.element == element) return;
+            }
+            if ((int)heap.size() == k) {
+              std::pop_heap(heap.begin(), heap.end(), farther);
+              heap.pop_back();
+            }
+            heap.push_back(
+                {element, eintersection.uv, eintersection.distance, true});
+            std::push_heap(heap.begin(), heap.end(), farther);
+          };
+          // the neighbors of the previous query bound the search
+          heap.clear();
+          for (auto element : previous) visit(element);
+          closest_bvh_elements(sbvh.bvh, pos, distance, visit);
+          // write neighbors sorted by distance
+          std::sort_heap(heap.begin(), heap.end(), farther);
+          auto results = neighbors.subspan((size_t)indices[idx] * k, k);
+          for (auto neighbor : range(k)) {
+            results[neighbor] = neighbor < (int)heap.size()
+                                    ? heap[neighbor]
+                                    : shape_intersection{};
+          }
+          previous.clear();
+          for (auto& neighbor : heap) previous.push_back(neighbor.element);
+        }
+      });
 }
 
 }  // namespace yocto
@@ -968,12 +3439,12 @@ shape_intersection overlap_shape_bvh(const shape_bvh& sbvh,
   auto& bvh = sbvh.bvh;
 
   // check if empty
-  if (bvh.nodes.empty()) return {};
+  if (is_empty_bvh(bvh)) return {};
 
   // node stack
-  auto node_stack        = array<int, 64>{};
+  auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  node_stack[node_cur++] = get_root_subtree(bvh);
 
   // intersection
   auto intersection = shape_intersection{};
@@ -981,20 +3452,26 @@ shape_intersection overlap_shape_bvh(const shape_bvh& sbvh,
   // walking stack
   while (node_cur != 0) {
     // grab node
-    auto& node = bvh.nodes[node_stack[--node_cur]];
+    auto node = node_stack[--node_cur];
 
     // intersect bbox
-    if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
+    if (!overlap_bbox(pos, max_distance, get_subtree_bbox(bvh, node)))
+      continue;
+
+    // internal node
+    if (is_internal_subtree(bvh, node)) {
+      auto children = array<int, bvh_wide_size>{};
+      auto count    = get_subtree_children(bvh, node, children);
+      for (auto idx : range(count)) node_stack[node_cur++] = children[idx];
+      continue;
+    }
 
-    // intersect node, switching based on node type
+    // intersect leaf, switching based on shape type
     // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // internal node
-      node_stack[node_cur++] = node.start + 0;
-      node_stack[node_cur++] = node.start + 1;
-    } else if (!shape.points.empty()) {
-      for (auto idx : range(node.num)) {
-        auto  primitive     = bvh.primitives[node.start + idx];
+    auto [start, num] = get_subtree_primitives(bvh, node);
+    if (!shape.points.empty()) {
+      for (auto idx : range(num)) {
+        auto  primitive     = bvh.primitives[start + idx];
         auto& p             = shape.points[primitive];
         auto  eintersection = overlap_point(
             pos, max_distance, shape.positions[p], shape.radius[p]);
@@ -1004,8 +3481,8 @@ shape_intersection overlap_shape_bvh(const shape_bvh& sbvh,
         max_distance = eintersection.distance;
       }
     } else if (!shape.lines.empty()) {
-      for (auto idx : range(node.num)) {
-        auto  primitive     = bvh.primitives[node.start + idx];
+      for (auto idx : range(num)) {
+        auto  primitive     = bvh.primitives[start + idx];
         auto& l             = shape.lines[primitive];
         auto  eintersection = overlap_line(pos, max_distance,
              shape.positions[l.x], shape.positions[l.y], shape.radius[l.x],
@@ -1016,8 +3493,8 @@ shape_intersection overlap_shape_bvh(const shape_bvh& sbvh,
         max_distance = eintersection.distance;
       }
     } else if (!shape.triangles.empty()) {
-      for (auto idx : range(node.num)) {
-        auto  primitive     = bvh.primitives[node.start + idx];
+      for (auto idx : range(num)) {
+        auto  primitive     = bvh.primitives[start + idx];
         auto& t             = shape.triangles[primitive];
         auto  eintersection = overlap_triangle(pos, max_distance,
              shape.positions[t.x], shape.positions[t.y], shape.positions[t.z],
@@ -1028,8 +3505,8 @@ shape_intersection overlap_shape_bvh(const shape_bvh& sbvh,
         max_distance = eintersection.distance;
       }
     } else if (!shape.quads.empty()) {
-      for (auto idx : range(node.num)) {
-        auto  primitive     = bvh.primitives[node.start + idx];
+      for (auto idx : range(num)) {
+        auto  primitive     = bvh.primitives[start + idx];
         auto& q             = shape.quads[primitive];
         auto  eintersection = overlap_quad(pos, max_distance,
              shape.positions[q.x], shape.positions[q.y], shape.positions[q.z],
@@ -1056,12 +3533,12 @@ scene_intersection overlap_scene_bvh(const scene_bvh& sbvh,
   auto& bvh = sbvh.bvh;
 
   // check if empty
-  if (bvh.nodes.empty()) return {};
+  if (is_empty_bvh(bvh)) return {};
 
   // node stack
-  auto node_stack        = array<int, 64>{};
+  auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  node_stack[node_cur++] = get_root_subtree(bvh);
 
   // intersection
   auto intersection = scene_intersection{};
@@ -1069,29 +3546,32 @@ scene_intersection overlap_scene_bvh(const scene_bvh& sbvh,
   // walking stack
   while (node_cur != 0) {
     // grab node
-    auto& node = bvh.nodes[node_stack[--node_cur]];
+    auto node = node_stack[--node_cur];
 
     // intersect bbox
-    if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
+    if (!overlap_bbox(pos, max_distance, get_subtree_bbox(bvh, node)))
+      continue;
+
+    // internal node
+    if (is_internal_subtree(bvh, node)) {
+      auto children = array<int, bvh_wide_size>{};
+      auto count    = get_subtree_children(bvh, node, children);
+      for (auto idx : range(count)) node_stack[node_cur++] = children[idx];
+      continue;
+    }
 
-    // intersect node, switching based on node type
-    // for each type, iterate over the the primitive list
-    if (node.internal) {
-      // internal node
-      node_stack[node_cur++] = node.start + 0;
-      node_stack[node_cur++] = node.start + 1;
-    } else {
-      for (auto idx : range(node.num)) {
-        auto  primitive = bvh.primitives[node.start + idx];
-        auto& instance_ = scene.instances[primitive];
-        auto  inv_pos   = transform_point(inverse(instance_.frame, true), pos);
-        auto  sintersection = overlap_shape_bvh(sbvh.shapes[instance_.shape],
-             scene.shapes[instance_.shape], inv_pos, max_distance, find_any);
-        if (!sintersection.hit) continue;
-        intersection = {primitive, sintersection.element, sintersection.uv,
-            sintersection.distance, true};
-        max_distance = sintersection.distance;
-      }
+    // intersect leaf instances
+    auto [start, num] = get_subtree_primitives(bvh, node);
+    for (auto idx : range(num)) {
+      auto  primitive     = bvh.primitives[start + idx];
+      auto& instance_     = sbvh.instances[primitive];
+      auto  inv_pos       = transform_point(instance_.inv_frame, pos);
+      auto  sintersection = overlap_shape_bvh(sbvh.shapes[instance_.shape],
+           scene.shapes[instance_.shape], inv_pos, max_distance, find_any);
+      if (!sintersection.hit) continue;
+      intersection = {primitive, sintersection.element, sintersection.uv,
+          sintersection.distance, true};
+      max_distance = sintersection.distance;
     }
 
     // check for early exit
@@ -1101,65 +3581,624 @@ scene_intersection overlap_scene_bvh(const scene_bvh& sbvh,
   return intersection;
 }
 
-#if 0
-// Finds the overlap between BVH leaf nodes.
-template <typename OverlapElem>
-void overlap_bvh_elems(const bvh_data& bvh1, const bvh_data& bvh2,
-                bool skip_duplicates, bool skip_self, vector<vec2i>& overlaps,
-                const OverlapElem& overlap_elems) {
-    // node stack
-    vec2i node_stack[128];
-    auto node_cur = 0;
-    node_stack[node_cur++] = {0, 0};
-
-    // walking stack
-    while (node_cur) {
-        // grab node
-        auto node_idx = node_stack[--node_cur];
-        const auto node1 = bvh1->nodes[node_idx.x];
-        const auto node2 = bvh2->nodes[node_idx.y];
-
-        // intersect bbox
-        if (!overlap_bbox(node1.bbox, node2.bbox)) continue;
-
-        // check for leaves
-        if (node1.isleaf && node2.isleaf) {
-            // collide primitives
-            for (auto i1 = node1.start; i1 < node1.start + node1.count; i1++) {
-                for (auto i2 = node2.start; i2 < node2.start + node2.count;
-                      i2++) {
-                    auto idx1 = bvh1->sorted_prim[i1];
-                    auto idx2 = bvh2->sorted_prim[i2];
-                    if (skip_duplicates && idx1 > idx2) continue;
-                    if (skip_self && idx1 == idx2) continue;
-                    if (overlap_elems(idx1, idx2))
-                        overlaps.push_back({idx1, idx2});
-                }
-            }
-        } else {
-            // descend
-            if (node1.isleaf) {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                      idx2++) {
-                    node_stack[node_cur++] = {node_idx.x, (int)idx2};
-                }
-            } else if (node2.isleaf) {
-                for (auto idx1 = node1.start; idx1 < node1.start + node1.count;
-                      idx1++) {
-                    node_stack[node_cur++] = {(int)idx1, node_idx.y};
-                }
-            } else {
-                for (auto idx2 = node2.start; idx2 < node2.start + node2.count;
-                      idx2++) {
-                    for (auto idx1 = node1.start;
-                          idx1 < node1.start + node1.count; idx1++) {
-                        node_stack[node_cur++] = {(int)idx1, (int)idx2};
-                    }
-                }
-            }
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH ELEMENT OVERLAPS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Number of node pairs expanded serially before parallel traversal.
+const auto bvh_overlap_tasks = 256;
+
+// Finds the overlaps between two bvhs. Node bounds of the second bvh are
+// given by `node_bbox2(node)`, so that it can be traversed in another frame.
+// If `symmetric`, the two bvhs are the same, and node pairs are visited only
+// once in either order, with element pairs returned in sorted order.
+template <typename NodeBBox, typename OverlapElements>
+static vector<vec2i> overlap_bvh_pairs(const bvh_tree& bvh1,
+    const bvh_tree& bvh2, bool symmetric, bool skip_duplicates, bool skip_self,
+    NodeBBox&& node_bbox2, OverlapElements&& overlap_elements,
+    bool noparallel) {
+  // check if empty
+  if (is_empty_bvh(bvh1) || is_empty_bvh(bvh2)) return {};
+
+  // collide primitives of two leaves
+  auto overlap_leaves = [&](int node1, int node2, bool same,
+                            vector<vec2i>& overlaps) {
+    auto [start1, num1] = get_subtree_primitives(bvh1, node1);
+    auto [start2, num2] = get_subtree_primitives(bvh2, node2);
+    for (auto i1 = start1; i1 < start1 + num1; i1++) {
+      auto i2_start = same ? (skip_self ? i1 + 1 : i1) : start2;
+      for (auto i2 = i2_start; i2 < start2 + num2; i2++) {
+        auto idx1 = bvh1.primitives[i1], idx2 = bvh2.primitives[i2];
+        if (symmetric && idx1 > idx2) std::swap(idx1, idx2);
+        if (skip_duplicates && idx1 > idx2) continue;
+        if (skip_self && idx1 == idx2) continue;
+        if (overlap_elements(idx1, idx2)) overlaps.push_back({idx1, idx2});
+      }
+    }
+  };
+
+  // expand a pair of nodes, pushing the pairs of their children
+  auto bbox_area = [](const bbox3f& bbox) {
+    auto size = bbox.max - bbox.min;
+    return size.x * size.y + size.y * size.z + size.z * size.x;
+  };
+  auto expand = [&](vec2i node_idx, vector<vec2i>& stack,
+                    vector<vec2i>& overlaps) {
+    auto children = array<int, bvh_wide_size>{};
+    if (symmetric && node_idx.x == node_idx.y) {
+      if (!is_internal_subtree(bvh1, node_idx.x)) {
+        overlap_leaves(node_idx.x, node_idx.x, true, overlaps);
+      } else {
+        auto count = get_subtree_children(bvh1, node_idx.x, children);
+        for (auto idx1 : range(count)) {
+          for (auto idx2 : range(idx1, count)) {
+            stack.push_back({children[idx1], children[idx2]});
+          }
         }
+      }
+      return;
+    }
+    auto bbox1 = get_subtree_bbox(bvh1, node_idx.x);
+    auto bbox2 = node_bbox2(node_idx.y);
+    if (!overlap_bbox(bbox1, bbox2)) return;
+    auto internal1 = is_internal_subtree(bvh1, node_idx.x);
+    auto internal2 = is_internal_subtree(bvh2, node_idx.y);
+    if (!internal1 && !internal2) {
+      overlap_leaves(node_idx.x, node_idx.y, false, overlaps);
+    } else if (internal1 &&
+               (!internal2 || bbox_area(bbox1) >= bbox_area(bbox2))) {
+      auto count = get_subtree_children(bvh1, node_idx.x, children);
+      for (auto idx : range(count)) {
+        stack.push_back({children[idx], node_idx.y});
+      }
+    } else {
+      auto count = get_subtree_children(bvh2, node_idx.y, children);
+      for (auto idx : range(count)) {
+        stack.push_back({node_idx.x, children[idx]});
+      }
+    }
+  };
+
+  // expand node pairs breadth first to have enough tasks
+  auto overlaps = vector<vec2i>{};
+  auto frontier = vector<vec2i>{
+      {get_root_subtree(bvh1), get_root_subtree(bvh2)}};
+  while (!noparallel && !frontier.empty() &&
+         frontier.size() < bvh_overlap_tasks) {
+    auto next = vector<vec2i>{};
+    for (auto node_idx : frontier) expand(node_idx, next, overlaps);
+    frontier = std::move(next);
+  }
+
+  // traverse the remaining pairs depth first
+  auto task_overlaps = vector<vector<vec2i>>(frontier.size());
+  auto traverse      = [&](size_t task) {
+    auto stack = vector<vec2i>{frontier[task]};
+    while (!stack.empty()) {
+      auto node_idx = stack.back();
+      stack.pop_back();
+      expand(node_idx, stack, task_overlaps[task]);
     }
+  };
+  if (noparallel) {
+    for (auto task : range(frontier.size())) traverse(task);
+  } else {
+    parallel_for(frontier.size(), traverse);
+  }
+
+  // merge overlaps, removing the repetitions due to spatial splits
+  for (auto& overlaps_ : task_overlaps) {
+    overlaps.insert(overlaps.end(), overlaps_.begin(), overlaps_.end());
+  }
+  auto less = [](vec2i a, vec2i b) {
+    return a.x < b.x || (a.x == b.x && a.y < b.y);
+  };
+  std::sort(overlaps.begin(), overlaps.end(), less);
+  overlaps.erase(std::unique(overlaps.begin(), overlaps.end()), overlaps.end());
+  return overlaps;
+}
+
+// Finds the overlaps between two bvhs.
+vector<vec2i> overlap_bvh_elements(const bvh_tree& bvh1, const bvh_tree& bvh2,
+    bool skip_duplicates, bool skip_self,
+    const function<bool(int, int)>& overlap_elements, bool noparallel) {
+  return overlap_bvh_pairs(
+      bvh1, bvh2, &bvh1 == &bvh2 && skip_duplicates, skip_duplicates,
+      skip_self, [&bvh2](int node) { return get_subtree_bbox(bvh2, node); },
+      overlap_elements, noparallel);
+}
+
+// Vertex indices of a shape element, repeating the last one.
+static vec4i get_element_vertices(const shape_data& shape, int element) {
+  if (!shape.points.empty()) {
+    auto p = shape.points[element];
+    return {p, p, p, p};
+  } else if (!shape.lines.empty()) {
+    auto l = shape.lines[element];
+    return {l.x, l.y, l.y, l.y};
+  } else if (!shape.triangles.empty()) {
+    auto t = shape.triangles[element];
+    return {t.x, t.y, t.z, t.z};
+  } else if (!shape.quads.empty()) {
+    return shape.quads[element];
+  } else {
+    return {-1, -1, -1, -1};
+  }
+}
+
+// Shape element prepared for overlap tests, with positions transformed by a
+// frame. Points and lines are only described by their bounds.
+struct overlap_element {
+  array<vec3f, 4> positions = {};
+  int             triangles = 0;
+  bbox3f          bbox      = invalidb3f;
+};
+
+// Prepare a shape element for overlap tests.
+static overlap_element make_overlap_element(
+    const shape_data& shape, int element, const frame3f& frame) {
+  auto oelement = overlap_element{};
+  auto vertices = get_element_vertices(shape, element);
+  if (!shape.points.empty()) {
+    oelement.bbox = transform_bbox(frame,
+        point_bounds(shape.positions[vertices.x], shape.radius[vertices.x]));
+  } else if (!shape.lines.empty()) {
+    oelement.bbox = transform_bbox(
+        frame, line_bounds(shape.positions[vertices.x],
+                   shape.positions[vertices.y], shape.radius[vertices.x],
+                   shape.radius[vertices.y]));
+  } else if (!shape.triangles.empty() || !shape.quads.empty()) {
+    for (auto idx : range(4)) {
+      oelement.positions[idx] = transform_point(
+          frame, shape.positions[vertices[idx]]);
+      oelement.bbox = merge(oelement.bbox, oelement.positions[idx]);
+    }
+    oelement.triangles = vertices.z == vertices.w ? 1 : 2;
+  }
+  return oelement;
+}
+
+// Check whether two triangles overlap, by looking for a separating axis among
+// the face normals, the cross products of edges, and the edge normals in the
+// face planes, that cover coplanar triangles.
+static bool overlap_triangles(const array<vec3f, 3>& triangle1,
+    const array<vec3f, 3>& triangle2) {
+  auto separated = [&](vec3f axis) {
+    if (dot(axis, axis) < 1e-20f) return false;
+    auto min1 = flt_max, max1 = -flt_max, min2 = flt_max, max2 = -flt_max;
+    for (auto idx : range(3)) {
+      auto d1 = dot(axis, triangle1[idx]), d2 = dot(axis, triangle2[idx]);
+      min1 = min(min1, d1), max1 = max(max1, d1);
+      min2 = min(min2, d2), max2 = max(max2, d2);
+    }
+    return max1 < min2 || max2 < min1;
+  };
+  auto edges1 = array<vec3f, 3>{}, edges2 = array<vec3f, 3>{};
+  for (auto idx : range(3)) {
+    edges1[idx] = triangle1[(idx + 1) % 3] - triangle1[idx];
+    edges2[idx] = triangle2[(idx + 1) % 3] - triangle2[idx];
+  }
+  auto normal1 = cross(edges1[0], edges1[1]);
+  auto normal2 = cross(edges2[0], edges2[1]);
+  if (separated(normal1) || separated(normal2)) return false;
+  for (auto idx1 : range(3)) {
+    for (auto idx2 : range(3)) {
+      if (separated(cross(edges1[idx1], edges2[idx2]))) return false;
+    }
+  }
+  for (auto idx : range(3)) {
+    if (separated(cross(normal1, edges1[idx]))) return false;
+    if (separated(cross(normal2, edges2[idx]))) return false;
+  }
+  return true;
+}
+
+// Check whether two prepared shape elements overlap
+static bool overlap_elements(
+    const overlap_element& element1, const overlap_element& element2) {
+  if (!overlap_bbox(element1.bbox, element2.bbox)) return false;
+  if (element1.triangles == 0 || element2.triangles == 0) return true;
+  auto get_triangle = [](const overlap_element& element, int triangle) {
+    auto& p = element.positions;
+    return triangle == 0 ? array<vec3f, 3>{p[0], p[1], p[3]}
+                         : array<vec3f, 3>{p[2], p[3], p[1]};
+  };
+  for (auto triangle1 : range(element1.triangles)) {
+    for (auto triangle2 : range(element2.triangles)) {
+      if (overlap_triangles(get_triangle(element1, triangle1),
+              get_triangle(element2, triangle2)))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Finds the overlaps between two shapes
+vector<vec2i> overlap_shape_bvh(const shape_bvh& sbvh1,
+    const shape_data& shape1, const shape_bvh& sbvh2, const shape_data& shape2,
+    bool noparallel) {
+  auto& bvh2 = sbvh2.bvh;
+  return overlap_bvh_pairs(
+      sbvh1.bvh, bvh2, false, false, false,
+      [&bvh2](int node) { return get_subtree_bbox(bvh2, node); },
+      [&](int element1, int element2) {
+        return overlap_elements(
+            make_overlap_element(shape1, element1, identity3x4f),
+            make_overlap_element(shape2, element2, identity3x4f));
+      },
+      noparallel);
+}
+
+// Finds the self-overlaps of a shape
+vector<vec2i> overlap_shape_bvh(
+    const shape_bvh& sbvh, const shape_data& shape, bool noparallel) {
+  auto& bvh = sbvh.bvh;
+  return overlap_bvh_pairs(
+      bvh, bvh, true, true, true,
+      [&bvh](int node) { return get_subtree_bbox(bvh, node); },
+      [&](int element1, int element2) {
+        auto vertices1 = get_element_vertices(shape, element1);
+        auto vertices2 = get_element_vertices(shape, element2);
+        for (auto idx1 : range(4)) {
+          for (auto idx2 : range(4)) {
+            if (vertices1[idx1] == vertices2[idx2]) return false;
+          }
+        }
+        return overlap_elements(
+            make_overlap_element(shape, element1, identity3x4f),
+            make_overlap_element(shape, element2, identity3x4f));
+      },
+      noparallel);
+}
+
+// Finds the overlaps between instances of a scene
+vector<scene_overlap> overlap_scene_bvh(
+    const scene_bvh& sbvh, const scene_data& scene, bool noparallel) {
+  // candidate instance pairs, from the bounds of their shapes
+  auto instance_bbox = [&](int instance) {
+    auto& shape_bvh = sbvh.shapes[sbvh.instances[instance].shape].bvh;
+    if (is_empty_bvh(shape_bvh)) return invalidb3f;
+    return transform_bbox(
+        scene.instances[instance].frame, get_bvh_bbox(shape_bvh));
+  };
+  auto candidates = overlap_bvh_pairs(
+      sbvh.bvh, sbvh.bvh, true, true, true,
+      [&sbvh](int node) { return get_subtree_bbox(sbvh.bvh, node); },
+      [&](int instance1, int instance2) {
+        return overlap_bbox(instance_bbox(instance1), instance_bbox(instance2));
+      },
+      noparallel);
+
+  // overlap shapes in the frame of the first instance, splitting the work
+  // within shapes only when there are few candidates
+  auto shape_noparallel = noparallel ||
+                          (int)candidates.size() >= get_parallel_threads();
+  auto candidate_overlaps = vector<vector<vec2i>>(candidates.size());
+  auto overlap_instances  = [&](size_t candidate) {
+    auto [instance1, instance2] = candidates[candidate];
+    auto& record1 = sbvh.instances[instance1];
+    auto& record2 = sbvh.instances[instance2];
+    auto& shape1  = scene.shapes[record1.shape];
+    auto& shape2  = scene.shapes[record2.shape];
+    auto& bvh2    = sbvh.shapes[record2.shape].bvh;
+    auto  frame   = record1.inv_frame * scene.instances[instance2].frame;
+    candidate_overlaps[candidate] = overlap_bvh_pairs(
+        sbvh.shapes[record1.shape].bvh, bvh2, false, false, false,
+        [&](int node) {
+          return transform_bbox(frame, get_subtree_bbox(bvh2, node));
+        },
+        [&](int element1, int element2) {
+          return overlap_elements(
+              make_overlap_element(shape1, element1, identity3x4f),
+              make_overlap_element(shape2, element2, frame));
+        },
+        shape_noparallel);
+  };
+  if (noparallel) {
+    for (auto candidate : range(candidates.size())) {
+      overlap_instances(candidate);
+    }
+  } else {
+    parallel_for(candidates.size(), overlap_instances);
+  }
+
+  // collect overlaps, sorted by instances and elements
+  auto overlaps = vector<scene_overlap>{};
+  for (auto candidate : range(candidates.size())) {
+    auto [instance1, instance2] = candidates[candidate];
+    for (auto [element1, element2] : candidate_overlaps[candidate]) {
+      overlaps.push_back({instance1, element1, instance2, element2});
+    }
+  }
+  return overlaps;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF BVH CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Magic number and version of bvh files. The version changes with the layout
+// of bvh data.
+const auto bvh_file_magic = array<char, 8>{
+    'Y', 'O', 'C', 'T', 'O', 'B', 'V', 'H'};
+const auto bvh_file_version = (uint64_t)3;
+
+// Alignment of the arrays in bvh files.
+const auto bvh_file_alignment = (size_t)64;
+
+// Hash of a buffer, using FNV-1a on 64-bit words for speed, with a shift
+// that mixes high bits back into low bits.
+static uint64_t hash_bvh_data(uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const unsigned char*)data;
+  auto words = size / sizeof(uint64_t);
+  for (auto idx = (size_t)0; idx < words; idx++) {
+    auto word = (uint64_t)0;
+    std::memcpy(&word, bytes + idx * sizeof(uint64_t), sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ull;
+    hash ^= hash >> 32;
+  }
+  for (auto idx = words * sizeof(uint64_t); idx < size; idx++) {
+    hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+template <typename T>
+static uint64_t hash_bvh_data(uint64_t hash, const vector<T>& values) {
+  auto size = (uint64_t)values.size();
+  hash      = hash_bvh_data(hash, &size, sizeof(size));
+  return hash_bvh_data(hash, values.data(), values.size() * sizeof(T));
+}
+
+// Hash of the shape elements, positions and radius, and of the build
+// parameters, used as key for cached shape bvhs.
+uint64_t hash_shape_bvh(const shape_data& shape, const bvh_params& params) {
+  auto hash = 0xcbf29ce484222325ull;
+  hash      = hash_bvh_data(hash, &bvh_file_version, sizeof(bvh_file_version));
+  hash      = hash_bvh_data(hash, shape.points);
+  hash      = hash_bvh_data(hash, shape.lines);
+  hash      = hash_bvh_data(hash, shape.triangles);
+  hash      = hash_bvh_data(hash, shape.quads);
+  hash      = hash_bvh_data(hash, shape.positions);
+  hash      = hash_bvh_data(hash, shape.radius);
+  auto options = array<float, 5>{(float)params.highquality,
+      (float)params.wide, params.spatial_budget, (float)params.compressed,
+      (float)params.precomputed};
+  return hash_bvh_data(hash, options.data(), sizeof(options));
+}
+
+// Write and read bvh arrays, as a size followed by padded data
+template <typename T>
+static void write_bvh_array(FILE* fs, const vector<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  auto size = (uint64_t)values.size();
+  auto pad  = array<char, bvh_file_alignment>{};
+  auto data = size * sizeof(T);
+  if (fwrite(&size, sizeof(size), 1, fs) != 1)
+    throw std::runtime_error{"cannot write bvh"};
+  if (fwrite(pad.data(), 1, bvh_file_alignment - sizeof(size), fs) !=
+      bvh_file_alignment - sizeof(size))
+    throw std::runtime_error{"cannot write bvh"};
+  if (data && fwrite(values.data(), 1, data, fs) != data)
+    throw std::runtime_error{"cannot write bvh"};
+  auto padding = (bvh_file_alignment - data % bvh_file_alignment) %
+                 bvh_file_alignment;
+  if (padding && fwrite(pad.data(), 1, padding, fs) != padding)
+    throw std::runtime_error{"cannot write bvh"};
+}
+template <typename T>
+static void read_bvh_array(FILE* fs, vector<T>& values) {
+  auto size = (uint64_t)0;
+  if (fread(&size, sizeof(size), 1, fs) != 1)
+    throw std::runtime_error{"cannot read bvh"};
+  if (fseek(fs, bvh_file_alignment - sizeof(size), SEEK_CUR) != 0)
+    throw std::runtime_error{"cannot read bvh"};
+  if (size > ((uint64_t)1 << 40) / sizeof(T))
+    throw std::runtime_error{"corrupted bvh"};
+  values.resize(size);
+  auto data = size * sizeof(T);
+  if (data && fread(values.data(), 1, data, fs) != data)
+    throw std::runtime_error{"cannot read bvh"};
+  auto padding = (bvh_file_alignment - data % bvh_file_alignment) %
+                 bvh_file_alignment;
+  if (padding && fseek(fs, (long)padding, SEEK_CUR) != 0)
+    throw std::runtime_error{"cannot read bvh"};
+}
+
+// Header of bvh files, padded to the file alignment, storing the sizes of
+// the bvh data to check the memory layout, and the number of elements and
+// the hash of the shape to check that the file matches it.
+struct bvh_file_header {
+  array<char, 8> magic           = bvh_file_magic;
+  uint64_t       version         = bvh_file_version;
+  uint64_t       node_size       = sizeof(bvh_node);
+  uint64_t       wide_size       = sizeof(bvh_wide_node);
+  uint64_t       compressed_size = sizeof(bvh_compressed_node);
+  uint64_t       triangle_size   = sizeof(bvh_triangle);
+  uint64_t       elements        = 0;
+  uint64_t       hash            = 0;
+};
+
+// Number of shape elements referenced by bvh primitives
+static size_t get_bvh_elements(const shape_data& shape) {
+  if (!shape.points.empty()) return shape.points.size();
+  if (!shape.lines.empty()) return shape.lines.size();
+  if (!shape.triangles.empty()) return shape.triangles.size();
+  if (!shape.quads.empty()) return shape.quads.size();
+  return 0;
+}
+
+// Check that all bvh indices are in range, and that children come after
+// their parents, so that traversals of a loaded bvh terminate.
+static void check_shape_bvh(const shape_bvh& sbvh, const shape_data& shape) {
+  auto& bvh        = sbvh.bvh;
+  auto  nodes      = (int64_t)bvh.nodes.size();
+  auto  primitives = (int64_t)bvh.primitives.size();
+  auto  elements   = (int64_t)get_bvh_elements(shape);
+  auto  check_leaf = [&](int64_t start, int64_t num) {
+    if (start < 0 || num < 0 || start + num > primitives)
+      throw std::runtime_error{"corrupted bvh"};
+  };
+  if (is_empty_bvh(bvh)) throw std::runtime_error{"corrupted bvh"};
+  for (auto nodeid : range(nodes)) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      if (node.start <= nodeid || node.start + 1 >= nodes)
+        throw std::runtime_error{"corrupted bvh"};
+    } else {
+      check_leaf(node.start, node.num);
+    }
+  }
+  for (auto primitive : bvh.primitives) {
+    if (primitive < 0 || primitive >= elements)
+      throw std::runtime_error{"corrupted bvh"};
+  }
+  auto wide_nodes = (int64_t)bvh.wide_nodes.size();
+  for (auto nodeid : range(wide_nodes)) {
+    auto& node = bvh.wide_nodes[nodeid];
+    if (node.count < 0 || node.count > bvh_wide_size)
+      throw std::runtime_error{"corrupted bvh"};
+    for (auto idx : range((int)node.count)) {
+      if (node.internal[idx]) {
+        if (node.start[idx] <= nodeid || node.start[idx] >= wide_nodes)
+          throw std::runtime_error{"corrupted bvh"};
+      } else {
+        check_leaf(node.start[idx], node.num[idx]);
+      }
+    }
+  }
+  auto compressed_nodes = (int64_t)bvh.compressed_nodes.size();
+  for (auto nodeid : range(compressed_nodes)) {
+    auto& node = bvh.compressed_nodes[nodeid];
+    if (node.count < 0 || node.count > bvh_wide_size)
+      throw std::runtime_error{"corrupted bvh"};
+    for (auto idx : range((int)node.count)) {
+      if (node.num[idx] == bvh_compressed_internal) {
+        if (node.start[idx] <= nodeid || node.start[idx] >= compressed_nodes)
+          throw std::runtime_error{"corrupted bvh"};
+      } else {
+        check_leaf(node.start[idx], node.num[idx]);
+      }
+    }
+  }
+  if (!sbvh.triangles.empty() &&
+      (shape.triangles.empty() ||
+          (int64_t)sbvh.triangles.size() != primitives))
+    throw std::runtime_error{"corrupted bvh"};
+}
+
+// Load a shape bvh
+shape_bvh load_shape_bvh(
+    const string& filename, const shape_data& shape, uint64_t hash) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) throw std::runtime_error{filename + ": file not found"};
+  try {
+    auto header    = bvh_file_header{};
+    auto check     = bvh_file_header{};
+    check.elements = get_bvh_elements(shape);
+    check.hash     = hash;
+    if (fread(&header, sizeof(header), 1, fs) != 1)
+      throw std::runtime_error{"cannot read bvh"};
+    if (std::memcmp(&header, &check, sizeof(header)) != 0)
+      throw std::runtime_error{"unsupported or mismatched bvh"};
+    auto sbvh = shape_bvh{};
+    read_bvh_array(fs, sbvh.bvh.nodes);
+    read_bvh_array(fs, sbvh.bvh.primitives);
+    read_bvh_array(fs, sbvh.bvh.wide_nodes);
+    read_bvh_array(fs, sbvh.bvh.compressed_nodes);
+    read_bvh_array(fs, sbvh.triangles);
+    check_shape_bvh(sbvh, shape);
+    fclose(fs);
+    return sbvh;
+  } catch (const std::exception& error) {
+    fclose(fs);
+    throw std::runtime_error{filename + ": " + error.what()};
+  }
+}
+
+// Save a shape bvh
+void save_shape_bvh(const string& filename, const shape_bvh& sbvh,
+    const shape_data& shape, uint64_t hash) {
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) throw std::runtime_error{filename + ": cannot create file"};
+  try {
+    auto header     = bvh_file_header{};
+    header.elements = get_bvh_elements(shape);
+    header.hash     = hash;
+    if (fwrite(&header, sizeof(header), 1, fs) != 1)
+      throw std::runtime_error{"cannot write bvh"};
+    write_bvh_array(fs, sbvh.bvh.nodes);
+    write_bvh_array(fs, sbvh.bvh.primitives);
+    write_bvh_array(fs, sbvh.bvh.wide_nodes);
+    write_bvh_array(fs, sbvh.bvh.compressed_nodes);
+    write_bvh_array(fs, sbvh.triangles);
+    auto closed = fclose(fs) == 0;
+    fs          = nullptr;
+    if (!closed) throw std::runtime_error{"cannot write bvh"};
+  } catch (const std::exception& error) {
+    if (fs) fclose(fs);
+    throw std::runtime_error{filename + ": " + error.what()};
+  }
+}
+
+// Build a scene bvh, loading and saving shape bvhs in a cache directory
+scene_bvh make_cached_scene_bvh(const scene_data& scene,
+    const string& cachedir, const bvh_params& params) {
+  // bvh
+  auto sbvh = scene_bvh{};
+
+  // make cache directory, building without the cache if that fails, since
+  // the cache is optional
+  auto ec = std::error_code{};
+  std::filesystem::create_directories(std::filesystem::u8path(cachedir), ec);
+  if (ec) return make_scene_bvh(scene, params);
+
+  // load or build shape bvhs
+  auto load_or_build = [&](size_t idx) {
+    auto& shape    = scene.shapes[idx];
+    auto  hash     = hash_shape_bvh(shape, params);
+    auto  name     = array<char, 32>{};
+    std::snprintf(name.data(), name.size(), "%016llx.ybvh",
+        (unsigned long long)hash);
+    auto  filename = cachedir + "/" + name.data();
+    try {
+      sbvh.shapes[idx] = load_shape_bvh(filename, shape, hash);
+      return;
+    } catch (const std::exception&) {
+      // build if missing or invalid
+    }
+    sbvh.shapes[idx] = make_shape_bvh(shape, params);
+    // write to a temporary file and rename it, so that readers never see
+    // partial files
+    auto tempname = filename + "." + std::to_string(std::random_device{}()) +
+                    ".tmp";
+    try {
+      save_shape_bvh(tempname, sbvh.shapes[idx], shape, hash);
+      std::filesystem::rename(std::filesystem::u8path(tempname),
+          std::filesystem::u8path(filename));
+    } catch (const std::exception&) {
+      // the cache is optional, so failures only skip saving
+      auto ec = std::error_code{};
+      std::filesystem::remove(std::filesystem::u8path(tempname), ec);
+    }
+  };
+  sbvh.shapes.resize(scene.shapes.size());
+  if (params.noparallel) {
+    for (auto idx : range(scene.shapes.size())) load_or_build(idx);
+  } else {
+    parallel_for(scene.shapes.size(), load_or_build);
+  }
+
+  // build instance bvh
+  make_instances_bvh(sbvh, scene, params);
+
+  // done
+  return sbvh;
 }
-#endif
 
 }  // namespace yocto
@@ -40,7 +40,9 @@
 
 #include <array>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -55,6 +57,8 @@ namespace yocto {
 
 // using directives
 using std::array;
+using std::function;
+using std::span;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -78,13 +82,59 @@ struct bvh_node {
   bool    internal = false;
 };
 
+// Number of children of wide BVH nodes.
+const auto bvh_wide_size = 4;
+
+// Wide BVH node collapsed from the binary tree. The bounds of the children
+// are stored as a structure of arrays, so that a ray is tested against all
+// children at once. Children are either wide nodes, for which start is the
+// node index, or leaves, for which start and num refer to the primitives.
+struct bvh_wide_node {
+  array<float, bvh_wide_size>   min_x    = {};
+  array<float, bvh_wide_size>   min_y    = {};
+  array<float, bvh_wide_size>   min_z    = {};
+  array<float, bvh_wide_size>   max_x    = {};
+  array<float, bvh_wide_size>   max_y    = {};
+  array<float, bvh_wide_size>   max_z    = {};
+  array<int32_t, bvh_wide_size> start    = {};
+  array<int16_t, bvh_wide_size> num      = {};
+  array<bool, bvh_wide_size>    internal = {};
+  int8_t                        count    = 0;
+};
+
+// Compressed wide BVH node, taking one cache line. Child bounds are quantized
+// to 8 bits on a grid starting at the node origin, with power of two cell
+// sizes stored as exponents, and are rounded outwards so that they are
+// conservative. Leaves store the primitive start and count, while internal
+// children have count `bvh_compressed_internal` and start as node index.
+struct alignas(64) bvh_compressed_node {
+  vec3f                         origin = {0, 0, 0};
+  array<int8_t, 3>              scale  = {0, 0, 0};
+  int8_t                        count  = 0;
+  array<uint8_t, bvh_wide_size> min_x  = {};
+  array<uint8_t, bvh_wide_size> min_y  = {};
+  array<uint8_t, bvh_wide_size> min_z  = {};
+  array<uint8_t, bvh_wide_size> max_x  = {};
+  array<uint8_t, bvh_wide_size> max_y  = {};
+  array<uint8_t, bvh_wide_size> max_z  = {};
+  array<int32_t, bvh_wide_size> start  = {};
+  array<uint8_t, bvh_wide_size> num    = {};
+};
+
+// Count of internal children of compressed nodes.
+const auto bvh_compressed_internal = (uint8_t)255;
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// Application data is not stored explicitly.
+// Wide nodes, if present, are used for ray intersection in place of nodes.
+// Compressed nodes, if present, are used for all queries, and the binary
+// nodes are not stored. Application data is not stored explicitly.
 struct bvh_tree {
-  vector<bvh_node> nodes      = {};
-  vector<int>      primitives = {};
+  vector<bvh_node>            nodes            = {};
+  vector<int>                 primitives       = {};
+  vector<bvh_wide_node>       wide_nodes       = {};
+  vector<bvh_compressed_node> compressed_nodes = {};
 };
 
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
@@ -159,6 +209,17 @@ shape_intersection overlap_quads_bvh(const bvh_tree& bvh,
     const vector<float>& radius, vec3f pos, float max_distance,
     bool find_any = false);
 
+// Find all pairs of overlapping elements between two bvhs, or within a bvh if
+// the same tree is passed twice. Pairs of elements in leaves with overlapping
+// bounds are checked by `overlap_elements(element1, element2)`, that is called
+// concurrently and should be thread-safe. With `skip_duplicates`, only pairs
+// with element1 <= element2 are reported, and with `skip_self`, pairs of the
+// same element are skipped. Returns sorted pairs without repetitions. Node
+// pairs are traversed in parallel on the shared pool, unless `noparallel`.
+vector<vec2i> overlap_bvh_elements(const bvh_tree& bvh1, const bvh_tree& bvh2,
+    bool skip_duplicates, bool skip_self,
+    const function<bool(int, int)>& overlap_elements, bool noparallel = false);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -166,27 +227,81 @@ shape_intersection overlap_quads_bvh(const bvh_tree& bvh,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Shape BVHs are just the bvh for the shape.
+// Triangle data precomputed for ray intersection, storing the first vertex
+// and the edges from it.
+struct bvh_triangle {
+  vec3f p0 = {0, 0, 0};
+  vec3f e1 = {0, 0, 0};
+  vec3f e2 = {0, 0, 0};
+};
+
+// Shape BVHs store the bvh for the shape, and optionally the triangle data
+// precomputed for intersection, in the order of the bvh primitives.
 struct shape_bvh {
-  bvh_tree bvh = {};
+  bvh_tree             bvh       = {};
+  vector<bvh_triangle> triangles = {};
+};
+
+// Instance record for scene BVHs, storing the world to object frame of an
+// instance and its shape, so that rays are transformed without inverting
+// instance frames during queries.
+struct bvh_instance {
+  frame3f inv_frame = identity3x4f;
+  int     shape     = -1;
 };
 
-// Scene BVHs store the bvh for instances and shapes.
+// Scene BVHs store the bvh for instances and shapes, and the instance records.
 // Application data is not stored explicitly.
 struct scene_bvh {
-  bvh_tree          bvh    = {};
-  vector<shape_bvh> shapes = {};
+  bvh_tree             bvh       = {};
+  vector<shape_bvh>    shapes    = {};
+  vector<bvh_instance> instances = {};
+};
+
+// Options for building bvhs. Large bvhs are built in parallel, unless
+// `noparallel` is set, with the high quality bvh using a binned SAH.
+// Wide bvhs collapse the binary tree into nodes with up to `bvh_wide_size`
+// children for faster ray queries.
+// A positive spatial budget builds line, triangle and quad bvhs with spatial
+// splits, that clip elements at split planes and store duplicated element
+// references. The budget is the maximum number of extra references as a
+// fraction of the number of elements. Spatial split bvhs are slower to build
+// but faster to trace for scenes with large or elongated triangles, or with
+// dense hair made of diagonal line segments.
+// Compressed bvhs store wide nodes with quantized bounds in place of the
+// binary and wide nodes, and use them for all queries. This takes about
+// half the memory of binary nodes, and reduces memory traffic. Queries
+// other than ray intersection are slower, since they dequantize bounds.
+// Precomputed bvhs store triangle vertices and edges in leaf order, so that
+// ray queries do not gather vertices. This uses 36 bytes per triangle.
+struct bvh_params {
+  bool  highquality    = false;
+  bool  noparallel     = false;
+  bool  wide           = false;
+  float spatial_budget = 0;
+  bool  compressed     = false;
+  bool  precomputed    = false;
 };
 
 // Build the bvh acceleration structure.
+shape_bvh make_shape_bvh(const shape_data& shape, const bvh_params& params);
+scene_bvh make_scene_bvh(const scene_data& scene, const bvh_params& params);
 shape_bvh make_shape_bvh(const shape_data& shape, bool highquality = false);
-scene_bvh make_scene_bvh(
-    const scene_data& scene, bool highquality = false, bool noparallel = false);
-
-// Refit bvh data
-void update_shape_bvh(shape_bvh& bvh, const shape_data& shape);
+scene_bvh make_scene_bvh(const scene_data& scene, bool highquality = false,
+    bool noparallel = false);
+
+// Refit bvh data. Large bvhs are refit in parallel, unless `noparallel` is
+// set. Scene bvhs refit only the nodes above the updated instances and the
+// instances of the updated shapes. If the number of instances changed, the
+// instance bvh is rebuilt instead, with the default build quality. If
+// `rotate` is set, tree rotations restore the quality of bvhs that degrade
+// over many refits, e.g. for deforming meshes. Compressed bvhs are refit
+// entirely and serially, and are not rotated.
+void update_shape_bvh(shape_bvh& bvh, const shape_data& shape,
+    bool rotate = false, bool noparallel = false);
 void update_scene_bvh(scene_bvh& bvh, const scene_data& scene,
-    const vector<int>& updated_instances, const vector<int>& updated_shapes);
+    const vector<int>& updated_instances, const vector<int>& updated_shapes,
+    bool rotate = false, bool noparallel = false);
 
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
@@ -212,6 +327,43 @@ scene_intersection intersect_instance_bvh(const scene_bvh& bvh,
     const scene_data& scene, int instance, const ray3f& ray,
     bool find_any = false);
 
+// Number of rays traced together in a packet, set at build time to 4, 8 or
+// 16 with YOCTO_BVH_PACKET_SIZE. Lanes are tested 4 at a time with SSE.
+#ifndef YOCTO_BVH_PACKET_SIZE
+#define YOCTO_BVH_PACKET_SIZE 8
+#endif
+const auto bvh_packet_size = YOCTO_BVH_PACKET_SIZE;
+
+// Intersect rays with a bvh returning either the first or any intersection
+// for each ray depending on `find_any`. Rays are traced in packets of
+// `bvh_packet_size` rays, testing each node against all rays in a packet,
+// and using wide, compressed and precomputed triangle data if present.
+// This is faster than tracing rays one at a time only for coherent rays,
+// like camera rays or sorted rays, so it is best used on ray batches.
+vector<shape_intersection> intersect_shape_bvh(const shape_bvh& bvh,
+    const shape_data& shape, const vector<ray3f>& rays, bool find_any = false);
+vector<scene_intersection> intersect_scene_bvh(const scene_bvh& bvh,
+    const scene_data& scene, const vector<ray3f>& rays, bool find_any = false);
+
+// Intersect large batches of rays with a bvh, writing either the first or any
+// intersection for each ray depending on `find_any`, or the number of
+// distinct elements hit by each ray. Rays are sorted for coherence by
+// ray_sort_key(), and traced in parallel on the shared pool, unless
+// `noparallel` is set. Results are written in the order of the input rays.
+void intersect_scene_bvh(const scene_bvh& bvh, const scene_data& scene,
+    span<const ray3f> rays, span<scene_intersection> intersections,
+    bool find_any = false, bool noparallel = false);
+void count_scene_bvh(const scene_bvh& bvh, const scene_data& scene,
+    span<const ray3f> rays, span<int> counts, bool noparallel = false);
+
+// Sort key for ray coherence. Rays are grouped by direction octant, then by
+// the Morton code of their origin quantized in the given bounds.
+uint64_t ray_sort_key(const ray3f& ray, const bbox3f& bounds);
+
+// Sort pairs of keys and indices by key, with a stable parallel radix sort,
+// unless `noparallel` is set. Pairs with equal keys keep their order.
+void sort_ray_keys(vector<pair<uint64_t, int>>& keys, bool noparallel = false);
+
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance, the instance id, the shape element
@@ -223,6 +375,77 @@ scene_intersection overlap_scene_bvh(const scene_bvh& bvh,
     const scene_data& scene, vec3f pos, float max_distance,
     bool find_any = false);
 
+// Find the closest shape element to each position in a large batch, within
+// a maximum distance, or the `k` closest elements sorted by distance, written
+// in `neighbors` at index `position * k`. Missing neighbors have hit set to
+// false. K-nearest queries are mostly used with point shapes. Positions are
+// sorted spatially, and each query starts from the results of the previous
+// one, that bound the search. Queries run in parallel on the shared pool,
+// unless `noparallel` is set. Results are written in the order of positions.
+void overlap_shape_bvh(const shape_bvh& bvh, const shape_data& shape,
+    span<const vec3f> positions, float max_distance,
+    span<shape_intersection> intersections, bool noparallel = false);
+void nearest_shape_bvh(const shape_bvh& bvh, const shape_data& shape,
+    span<const vec3f> positions, float max_distance, int k,
+    span<shape_intersection> neighbors, bool noparallel = false);
+
+// Pair of overlapping elements of two instances.
+struct scene_overlap {
+  int instance1 = -1;
+  int element1  = -1;
+  int instance2 = -1;
+  int element2  = -1;
+};
+
+// Find all pairs of overlapping elements between two shapes in the same frame,
+// returned as pairs of element indices. Triangles and quads are tested
+// exactly, while points and lines are tested by their bounds.
+vector<vec2i> overlap_shape_bvh(const shape_bvh& bvh1, const shape_data& shape1,
+    const shape_bvh& bvh2, const shape_data& shape2, bool noparallel = false);
+
+// Find the self-overlaps of a shape, as pairs of distinct elements with
+// element1 < element2. Elements that share vertices are not reported.
+vector<vec2i> overlap_shape_bvh(
+    const shape_bvh& bvh, const shape_data& shape, bool noparallel = false);
+
+// Find all pairs of overlapping elements between different instances of a
+// scene, for interference checks. Candidate instance pairs are found from the
+// instance bvh, then shape bvhs are traversed in the frame of the first
+// instance. Returns pairs with instance1 < instance2, in sorted order.
+vector<scene_overlap> overlap_scene_bvh(
+    const scene_bvh& bvh, const scene_data& scene, bool noparallel = false);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// BVH CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Hash of the shape elements, positions and radius, and of the build
+// parameters, used as key for cached shape bvhs.
+uint64_t hash_shape_bvh(const shape_data& shape, const bvh_params& params);
+
+// Load/save a shape bvh. The file stores the bvh arrays as they are laid out
+// in memory, aligned to cache lines, so loading does not parse data.
+// Files are only valid on machines with the same layout. Files also store
+// the number of shape elements and the shape hash, from hash_shape_bvh(),
+// that are checked on load together with all bvh indices, so that stale or
+// corrupted files are rejected. Throws std::runtime_error on errors.
+shape_bvh load_shape_bvh(
+    const string& filename, const shape_data& shape, uint64_t hash);
+void save_shape_bvh(const string& filename, const shape_bvh& bvh,
+    const shape_data& shape, uint64_t hash);
+
+// Build the bvh acceleration structure as make_scene_bvh(), loading shape
+// bvhs from a cache directory if they were saved before, and saving the
+// shape bvhs that are built. Files are named by hash_shape_bvh(), and are
+// written atomically, so that concurrent renders can share the cache.
+// The instance bvh is always built. If the cache directory cannot be
+// created, the bvh is built without the cache.
+scene_bvh make_cached_scene_bvh(const scene_data& scene,
+    const string& cachedir, const bvh_params& params);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
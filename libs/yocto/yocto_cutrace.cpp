@@ -519,12 +519,36 @@ cutrace_context make_cutrace_context(const trace_params& params) {
   return context;
 }
 
+// device params, copied from the fields of trace_params used on the device
+static cutrace_params make_cutrace_params(const trace_params& params) {
+  auto cuparams           = cutrace_params{};
+  cuparams.camera         = params.camera;
+  cuparams.resolution     = params.resolution;
+  cuparams.sampler        = params.sampler;
+  cuparams.falsecolor     = params.falsecolor;
+  cuparams.samples        = params.samples;
+  cuparams.bounces        = params.bounces;
+  cuparams.clamp          = params.clamp;
+  cuparams.nocaustics     = params.nocaustics;
+  cuparams.envhidden      = params.envhidden;
+  cuparams.tentfilter     = params.tentfilter;
+  cuparams.seed           = params.seed;
+  cuparams.embreebvh      = params.embreebvh;
+  cuparams.highqualitybvh = params.highqualitybvh;
+  cuparams.noparallel     = params.noparallel;
+  cuparams.pratio         = params.pratio;
+  cuparams.denoise        = params.denoise;
+  cuparams.batch          = params.batch;
+  return cuparams;
+}
+
 // start a new render
 void trace_start(cutrace_context& context, cutrace_state& state,
     const cuscene_data& cuscene, const cuscene_bvh& bvh,
     const cutrace_lights& lights, const scene_data& scene,
     const trace_params& params) {
-  auto globals = cutrace_globals{};
+  auto globals  = cutrace_globals{};
+  auto cuparams = make_cutrace_params(params);
   update_buffer_value(context.cuda_stream, context.globals_buffer,
       offsetof(cutrace_globals, state), state);
   update_buffer_value(context.cuda_stream, context.globals_buffer,
@@ -534,7 +558,7 @@ void trace_start(cutrace_context& context, cutrace_state& state,
   update_buffer_value(context.cuda_stream, context.globals_buffer,
       offsetof(cutrace_globals, lights), lights);
   update_buffer_value(context.cuda_stream, context.globals_buffer,
-      offsetof(cutrace_globals, params), params);
+      offsetof(cutrace_globals, params), cuparams);
   // sync to avoid errors
   sync_gpu(context.cuda_stream);
 }
@@ -333,7 +333,7 @@ enum struct trace_falsecolor_type {
 // Default trace seed
 constexpr auto trace_default_seed = 961748941ull;
 
-// params
+// params, with the same layout as cutrace_params on the host
 struct trace_params {
   int                   camera         = 0;
   int                   resolution     = 1280;
@@ -1022,6 +1022,15 @@ static ray3f sample_camera(const camera_data& camera, vec2i ij,
   }
 }
 
+// Blocks of environment texels sampled together, as in Yocto/Trace. On the
+// GPU, blocks are sampled uniformly.
+static int get_environment_block(int width, int height) {
+  auto block = 1;
+  while ((size_t)width * (size_t)height > (size_t)block * block * (1 << 21))
+    block *= 2;
+  return block;
+}
+
 // Sample lights wrt solid angle
 static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
     vec3f position, float rl, float rel, vec2f ruv) {
@@ -1038,9 +1047,15 @@ static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
     auto& environment = scene.environments[light.environment];
     if (environment.emission_tex != invalidid) {
       auto& emission_tex = scene.textures[environment.emission_tex];
-      auto  idx          = sample_discrete(light.elements_cdf, rel);
-      auto  uv = vec2f{((idx % emission_tex.width) + 0.5f) / emission_tex.width,
-          ((idx / emission_tex.width) + 0.5f) / emission_tex.height};
+      auto  block        = get_environment_block(
+          emission_tex.width, emission_tex.height);
+      auto grid = (emission_tex.width + block - 1) / block;
+      auto idx   = sample_discrete(light.elements_cdf, rel);
+      auto start = vec2i{(idx % grid) * block, (idx / grid) * block};
+      auto size  = vec2i{min(block, emission_tex.width - start.x),
+          min(block, emission_tex.height - start.y)};
+      auto uv    = vec2f{(start.x + ruv.x * size.x) / emission_tex.width,
+          (start.y + ruv.y * size.y) / emission_tex.height};
       return transform_direction(environment.frame,
           {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
               sin(uv.x * 2 * pif) * sin(uv.y * pif)});
@@ -1087,17 +1102,26 @@ static float sample_lights_pdf(const scene_data& scene, const trace_bvh& bvh,
         auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
             acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
         if (texcoord.x < 0) texcoord.x += 1;
-        auto i = clamp(
+        auto block = get_environment_block(
+            emission_tex.width, emission_tex.height);
+        auto grid = (emission_tex.width + block - 1) / block;
+        auto i    = clamp(
             (int)(texcoord.x * emission_tex.width), 0, emission_tex.width - 1);
         auto j    = clamp((int)(texcoord.y * emission_tex.height), 0,
                emission_tex.height - 1);
         auto prob = sample_discrete_pdf(
-                        light.elements_cdf, j * emission_tex.width + i) /
+                        light.elements_cdf, (j / block) * grid + i / block) /
                     light.elements_cdf.back();
-        auto angle = (2 * pif / emission_tex.width) *
-                     (pif / emission_tex.height) *
-                     sin(pif * (j + 0.5f) / emission_tex.height);
-        pdf += prob / angle;
+        // blocks are sampled uniformly in uv, and may be clipped at the border
+        auto size = vec2f{
+            (float)(min((i / block + 1) * block, emission_tex.width) -
+                    (i / block) * block),
+            (float)(min((j / block + 1) * block, emission_tex.height) -
+                    (j / block) * block)};
+        auto angle = (2 * pif * size.x / emission_tex.width) *
+                     (pif * size.y / emission_tex.height) *
+                     sqrt(max(1 - wl.y * wl.y, 0.0f));
+        if (angle > 0) pdf += prob / angle;
       } else {
         pdf += 1 / (4 * pif);
       }
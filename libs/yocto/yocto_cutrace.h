@@ -348,13 +348,36 @@ struct cutrace_lights {
   ~cutrace_lights();
 };
 
+// params, with the same layout as trace_params in device code. These are
+// copied from trace_params, that has host-only fields and is not trivially
+// copyable, so fields added to trace_params do not change the device layout.
+struct cutrace_params {
+  int                   camera         = 0;
+  int                   resolution     = 1280;
+  trace_sampler_type    sampler        = trace_sampler_type::path;
+  trace_falsecolor_type falsecolor     = trace_falsecolor_type::color;
+  int                   samples        = 512;
+  int                   bounces        = 8;
+  float                 clamp          = 10;
+  bool                  nocaustics     = false;
+  bool                  envhidden      = false;
+  bool                  tentfilter     = false;
+  uint64_t              seed           = trace_default_seed;
+  bool                  embreebvh      = false;
+  bool                  highqualitybvh = false;
+  bool                  noparallel     = false;
+  int                   pratio         = 8;
+  bool                  denoise        = false;
+  int                   batch          = 1;
+};
+
 // device params
 struct cutrace_globals {
   cutrace_state          state  = {};
   cuscene_data           scene  = {};
   OptixTraversableHandle bvh    = {};
   cutrace_lights         lights = {};
-  trace_params           params = {};
+  cutrace_params         params = {};
 };
 
 // empty stb record
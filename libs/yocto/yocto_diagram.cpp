@@ -32,10 +32,10 @@
 
 #include "yocto_diagram.h"
 
-#include <future>
 #include <unordered_set>
 
 #include "yocto_bvh.h"
+#include "yocto_parallel.h"
 #include "yocto_sampling.h"
 #include "yocto_sceneio.h"
 
@@ -1258,9 +1258,9 @@ diagram_shape dimagelabel(vec2i size, float scale) {
   auto opositions = dconstants::quad_positions;
   for (auto& oposition : opositions) oposition = oposition * oscale + ocenter;
   return {
+      .quads     = dconstants::quad_quads,
       .positions = opositions,
       .texcoords = dconstants::quad_texcoords,
-      .quads     = dconstants::quad_quads,
   };
 }
 diagram_shape dimagelabel(const image<vec4f>& image, float scale) {
@@ -1470,7 +1470,7 @@ diagram_scene& add_plotaxes(diagram_scene& diagram, const bbox2f& bounds,
     tpositions.push_back({min.x, y, 0});
     tlabels.push_back(label + "!!l");
   }
-  add_labels(diagram, {.positions = tpositions, .labels = tlabels});
+  add_labels(diagram, {.labels = tlabels, .positions = tpositions});
 
   return diagram;
 }
@@ -1601,7 +1601,7 @@ diagram_scene& add_plotaxes3(diagram_scene& diagram, const bbox3f& bounds,
     tpositions.push_back({min.x, min.y, z});
     tlabels.push_back(label + "!!r");
   }
-  add_labels(diagram, {.positions = tpositions, .labels = tlabels});
+  add_labels(diagram, {.labels = tlabels, .positions = tpositions});
 
   return diagram;
 }
@@ -2225,33 +2225,6 @@ image<vec4f> render_diagram(const diagram_data& diagram, int resolution,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the two integer indices.
-template <typename Func>
-inline void parallel_for_batch(vec2i num, Func&& func) {
-  auto              futures  = vector<std::future<void>>{};
-  auto              nthreads = std::thread::hardware_concurrency();
-  std::atomic<int>  next_idx(0);
-  std::atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, &has_error, num]() {
-          try {
-            while (true) {
-              auto j = next_idx.fetch_add(1);
-              if (j >= num[1]) break;
-              if (has_error) break;
-              for (auto i = 0; i < num[0]; i++) func(vec2i{i, j});
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
-}
-
 // Generates a ray from a camera.
 static ray3f eval_camera(const camera_data& camera, vec2f uv_) {
   auto film = vec2f{camera.film, camera.film / camera.aspect};
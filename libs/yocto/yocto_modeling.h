@@ -37,6 +37,7 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <array>
 #include <tuple>
 #include <unordered_map>
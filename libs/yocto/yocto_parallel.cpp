@@ -0,0 +1,270 @@
+//
+// Implementation for Yocto/Parallel
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2022 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include "yocto_parallel.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::unique_ptr;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF THREAD POOL
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// A group of tasks started by one call to parallel_tasks(). It lives on the
+// stack of the caller, that waits until all its tasks have completed.
+struct parallel_job {
+  const std::function<void(int)>* func    = nullptr;
+  std::atomic<int>                pending = 0;
+  std::exception_ptr              error   = nullptr;
+  std::mutex                      error_mutex;
+};
+
+// A task is one index of a job.
+struct parallel_task {
+  parallel_job* job   = nullptr;
+  int           index = 0;
+};
+
+// Task deque owned by a worker. The owner pushes and pops at the back, while
+// other threads steal from the front.
+struct parallel_queue {
+  std::deque<parallel_task> tasks = {};
+  std::mutex                mutex;
+};
+
+// Shared pool. Queue `nworkers` is used by threads outside the pool.
+struct parallel_pool {
+  int                                nthreads = 0;
+  vector<std::thread>                workers  = {};
+  vector<unique_ptr<parallel_queue>> queues   = {};
+  std::atomic<int>                   queued   = 0;
+  std::atomic<int>                   next     = 0;
+  std::atomic<bool>                  stop     = false;
+  std::mutex                         sleep_mutex;
+  std::condition_variable            sleep_cv;
+};
+
+// Worker index of the current thread, -1 for threads not in the pool.
+static thread_local parallel_pool* parallel_worker_pool  = nullptr;
+static thread_local int            parallel_worker_index = -1;
+
+// Wake up sleeping threads. Locking ensures that no wakeup is lost.
+static void notify_pool(parallel_pool& pool) {
+  { auto lock = std::lock_guard{pool.sleep_mutex}; }
+  pool.sleep_cv.notify_all();
+}
+
+// Push a task to the queue of the current worker, or spread external tasks.
+static void push_task(parallel_pool& pool, const parallel_task& task) {
+  auto queue_id = (parallel_worker_pool == &pool)
+                      ? parallel_worker_index
+                      : (int)(pool.next++ % (int)pool.queues.size());
+  auto& queue = *pool.queues[queue_id];
+  {
+    auto lock = std::lock_guard{queue.mutex};
+    queue.tasks.push_back(task);
+  }
+  pool.queued += 1;
+}
+
+// Pop a task from the given queue, either from the back or the front.
+static bool pop_task(
+    parallel_pool& pool, parallel_queue& queue, bool back, parallel_task& task) {
+  auto lock = std::lock_guard{queue.mutex};
+  if (queue.tasks.empty()) return false;
+  if (back) {
+    task = queue.tasks.back();
+    queue.tasks.pop_back();
+  } else {
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+  }
+  pool.queued -= 1;
+  return true;
+}
+
+// Get a task, first from the own queue, then by stealing from the others.
+static bool get_task(parallel_pool& pool, parallel_task& task) {
+  auto nqueues = (int)pool.queues.size();
+  auto own     = (parallel_worker_pool == &pool) ? parallel_worker_index
+                                                 : nqueues - 1;
+  if (pop_task(pool, *pool.queues[own], true, task)) return true;
+  for (auto offset = 1; offset < nqueues; offset++) {
+    auto& queue = *pool.queues[(own + offset) % nqueues];
+    if (pop_task(pool, queue, false, task)) return true;
+  }
+  return false;
+}
+
+// Run a task, storing the first error in its job.
+static void run_task(parallel_pool& pool, const parallel_task& task) {
+  auto job = task.job;
+  try {
+    (*job->func)(task.index);
+  } catch (...) {
+    auto lock = std::lock_guard{job->error_mutex};
+    if (!job->error) job->error = std::current_exception();
+  }
+  // the job may be destroyed as soon as the counter reaches zero
+  if (job->pending.fetch_sub(1) == 1) notify_pool(pool);
+}
+
+// Worker loop
+static void run_worker(parallel_pool& pool, int index) {
+  parallel_worker_pool  = &pool;
+  parallel_worker_index = index;
+  auto task             = parallel_task{};
+  while (true) {
+    if (get_task(pool, task)) {
+      run_task(pool, task);
+      continue;
+    }
+    auto lock = std::unique_lock{pool.sleep_mutex};
+    pool.sleep_cv.wait(lock, [&pool] { return pool.stop || pool.queued > 0; });
+    if (pool.stop) break;
+  }
+}
+
+// Stop workers and join them
+static void stop_pool(parallel_pool& pool) {
+  pool.stop = true;
+  notify_pool(pool);
+  for (auto& worker : pool.workers) worker.join();
+  pool.workers.clear();
+}
+
+// Create a pool. The caller participates in loops, so the pool creates one
+// less worker than the number of threads.
+static unique_ptr<parallel_pool> make_pool(int nthreads) {
+  auto pool      = std::make_unique<parallel_pool>();
+  pool->nthreads = nthreads;
+  for (auto idx = 0; idx < nthreads; idx++) {
+    pool->queues.push_back(std::make_unique<parallel_queue>());
+  }
+  for (auto idx = 0; idx < nthreads - 1; idx++) {
+    pool->workers.emplace_back(run_worker, std::ref(*pool), idx);
+  }
+  return pool;
+}
+
+// Pool holder, stopping workers at exit
+struct parallel_pool_holder {
+  unique_ptr<parallel_pool> pool     = nullptr;
+  int                       nthreads = 0;
+  std::mutex                mutex;
+  ~parallel_pool_holder() {
+    if (pool) stop_pool(*pool);
+  }
+};
+static parallel_pool_holder parallel_shared_pool = {};
+
+// Number of threads for a request
+static int get_requested_threads(int nthreads) {
+  if (nthreads > 0) return nthreads;
+  return std::max((int)std::thread::hardware_concurrency(), 1);
+}
+
+// Get the shared pool, creating it if needed
+static parallel_pool& get_pool() {
+  auto lock = std::lock_guard{parallel_shared_pool.mutex};
+  if (!parallel_shared_pool.pool) {
+    parallel_shared_pool.pool = make_pool(
+        get_requested_threads(parallel_shared_pool.nthreads));
+  }
+  return *parallel_shared_pool.pool;
+}
+
+// Sets the number of threads used by parallel loops.
+void set_parallel_threads(int nthreads) {
+  auto lock                     = std::lock_guard{parallel_shared_pool.mutex};
+  parallel_shared_pool.nthreads = nthreads;
+  if (parallel_shared_pool.pool &&
+      parallel_shared_pool.pool->nthreads != get_requested_threads(nthreads)) {
+    stop_pool(*parallel_shared_pool.pool);
+    parallel_shared_pool.pool = nullptr;
+  }
+}
+
+// Gets the number of threads used by parallel loops.
+int get_parallel_threads() { return get_pool().nthreads; }
+
+// Runs tasks on the shared pool and waits for their completion.
+void parallel_tasks(int num, const std::function<void(int)>& func) {
+  if (num <= 0) return;
+  auto& pool = get_pool();
+
+  // run serially if there is nothing to share
+  if (num == 1 || pool.workers.empty()) {
+    for (auto idx = 0; idx < num; idx++) func(idx);
+    return;
+  }
+
+  // push tasks, keeping the first for the caller
+  auto job    = parallel_job{};
+  job.func    = &func;
+  job.pending = num;
+  for (auto idx = 1; idx < num; idx++) push_task(pool, {&job, idx});
+  notify_pool(pool);
+  run_task(pool, {&job, 0});
+
+  // help while waiting, so that nested loops cannot deadlock
+  auto task = parallel_task{};
+  while (job.pending > 0) {
+    if (get_task(pool, task)) {
+      run_task(pool, task);
+      continue;
+    }
+    auto lock = std::unique_lock{pool.sleep_mutex};
+    pool.sleep_cv.wait(
+        lock, [&] { return job.pending == 0 || pool.queued > 0; });
+  }
+
+  // propagate errors
+  if (job.error) std::rethrow_exception(job.error);
+}
+
+}  // namespace yocto
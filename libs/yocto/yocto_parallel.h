@@ -0,0 +1,193 @@
+//
+// # Yocto/Parallel: Concurrency utilities
+//
+// Yocto/Parallel provides a shared work-stealing thread pool used by all
+// Yocto/GL libraries, together with parallel loops built on top of it.
+// Yocto/Parallel is implemented in `yocto_parallel.h` and `yocto_parallel.cpp`.
+//
+
+//
+// LICENSE:
+//
+// Copyright (c) 2016 -- 2022 Fabio Pellacini
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+
+#ifndef _YOCTO_PARALLEL_H_
+#define _YOCTO_PARALLEL_H_
+
+// -----------------------------------------------------------------------------
+// INCLUDES
+// -----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "yocto_math.h"
+
+// -----------------------------------------------------------------------------
+// USING DIRECTIVES
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// using directives
+using std::vector;
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// THREAD POOL
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Sets the number of threads used by parallel loops, including the calling
+// thread. Zero uses the hardware concurrency. The shared pool is created on
+// first use and recreated when the number of threads changes, so this should
+// be called when no parallel loop is running.
+void set_parallel_threads(int nthreads);
+
+// Gets the number of threads used by parallel loops, including the caller.
+int get_parallel_threads();
+
+// Runs `func(idx)` for `idx` in [0, num) as tasks on the shared pool and
+// waits for their completion. The calling thread runs tasks while waiting,
+// so tasks may themselves start parallel loops. The first exception thrown
+// by a task is rethrown in the caller once all tasks have completed.
+void parallel_tasks(int num, const std::function<void(int)>& func);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// PARALLEL LOOPS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Parallel for loop on the shared pool. `Func` takes the integer index.
+template <typename T, typename Func>
+inline void parallel_for(T num, Func&& func);
+
+// Parallel for loop on the shared pool. `Func` takes the two integer indices,
+// and rows are distributed to threads.
+template <typename T, typename Func>
+inline void parallel_for(T num1, T num2, Func&& func);
+
+// Parallel for loop on the shared pool over a 2D domain. `Func` takes a vec2i
+// index, and rows are distributed to threads.
+template <typename Func>
+inline void parallel_for_batch(vec2i num, Func&& func);
+
+// Parallel for loop on the shared pool. `Func` takes a reference to a `T`.
+template <typename T, typename Func>
+inline void parallel_foreach(vector<T>& values, Func&& func);
+template <typename T, typename Func>
+inline void parallel_foreach(const vector<T>& values, Func&& func);
+
+// Parallel for loop on the shared pool over two sequences of the same length.
+// `Func` takes references to the elements of both sequences.
+template <typename Sequence1, typename Sequence2, typename Func>
+inline void parallel_zip(
+    Sequence1&& sequence1, Sequence2&& sequence2, Func&& func);
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+//
+//
+// IMPLEMENTATION
+//
+//
+// -----------------------------------------------------------------------------
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION OF PARALLEL LOOPS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Parallel for loop on the shared pool. `Func` takes the integer index.
+template <typename T, typename Func>
+inline void parallel_for(T num, Func&& func) {
+  if (num <= 0) return;
+  auto              ntasks = (int)std::min((T)get_parallel_threads(), num);
+  std::atomic<T>    next_idx(0);
+  std::atomic<bool> has_error(false);
+  parallel_tasks(ntasks, [&func, &next_idx, &has_error, num](int) {
+    try {
+      while (true) {
+        if (has_error) break;
+        auto idx = next_idx.fetch_add(1);
+        if (idx >= num) break;
+        func(idx);
+      }
+    } catch (...) {
+      has_error = true;
+      throw;
+    }
+  });
+}
+
+// Parallel for loop on the shared pool. `Func` takes the two integer indices.
+template <typename T, typename Func>
+inline void parallel_for(T num1, T num2, Func&& func) {
+  parallel_for(num2, [&func, num1](T j) {
+    for (auto i = (T)0; i < num1; i++) func(i, j);
+  });
+}
+
+// Parallel for loop on the shared pool over a 2D domain.
+template <typename Func>
+inline void parallel_for_batch(vec2i num, Func&& func) {
+  parallel_for(num[1], [&func, num](int j) {
+    for (auto i = 0; i < num[0]; i++) func(vec2i{i, j});
+  });
+}
+
+// Parallel for loop on the shared pool. `Func` takes a reference to a `T`.
+template <typename T, typename Func>
+inline void parallel_foreach(vector<T>& values, Func&& func) {
+  parallel_for(
+      values.size(), [&func, &values](size_t idx) { func(values[idx]); });
+}
+template <typename T, typename Func>
+inline void parallel_foreach(const vector<T>& values, Func&& func) {
+  parallel_for(
+      values.size(), [&func, &values](size_t idx) { func(values[idx]); });
+}
+
+// Parallel for loop on the shared pool over two sequences.
+template <typename Sequence1, typename Sequence2, typename Func>
+inline void parallel_zip(
+    Sequence1&& sequence1, Sequence2&& sequence2, Func&& func) {
+  if (std::size(sequence1) != std::size(sequence2))
+    throw std::out_of_range{"invalid sequence lengths"};
+  parallel_for(std::size(sequence1), [&](size_t idx) {
+    func(std::forward<Sequence1>(sequence1)[idx],
+        std::forward<Sequence2>(sequence2)[idx]);
+  });
+}
+
+}  // namespace yocto
+
+#endif
@@ -166,6 +166,14 @@ inline int sample_discrete(const vector<float>& cdf, float r);
 // Pdf for uniform discrete distribution sampling.
 inline float sample_discrete_pdf(const vector<float>& cdf, int idx);
 
+// Sample a discrete distribution represented by an alias table in constant
+// time. Each entry stores the probability of keeping its index and its alias.
+// Two random numbers are used, so that large tables keep their precision.
+inline int sample_alias(const vector<pair<float, int>>& alias, vec2f r);
+// Make the alias table of a discrete distribution from its weights.
+inline vector<pair<float, int>> sample_alias_table(
+    const vector<float>& weights);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -432,6 +440,48 @@ inline float sample_discrete_pdf(const vector<float>& cdf, int idx) {
   return cdf[idx] - cdf[idx - 1];
 }
 
+// Sample a discrete distribution represented by an alias table in constant
+// time. Each entry stores the probability of keeping its index and its alias.
+// Two random numbers are used, so that large tables keep their precision.
+inline int sample_alias(const vector<pair<float, int>>& alias, vec2f r) {
+  auto size = (int)alias.size();
+  auto idx  = clamp((int)(r.x * size), 0, size - 1);
+  return r.y < alias[idx].first ? idx : alias[idx].second;
+}
+// Make the alias table of a discrete distribution from its weights, using
+// Vose's method. Zero weights give a uniform distribution.
+inline vector<pair<float, int>> sample_alias_table(
+    const vector<float>& weights) {
+  auto size  = (int)weights.size();
+  auto alias = vector<pair<float, int>>(size);
+  for (auto idx = 0; idx < size; idx++) alias[idx] = {1.0f, idx};
+  auto total = 0.0;
+  for (auto weight : weights) total += weight;
+  if (total <= 0) return alias;
+  auto scaled = vector<double>(size);
+  auto small = vector<int>{}, large = vector<int>{};
+  for (auto idx = 0; idx < size; idx++) {
+    scaled[idx] = weights[idx] * size / total;
+    if (scaled[idx] < 1) {
+      small.push_back(idx);
+    } else {
+      large.push_back(idx);
+    }
+  }
+  while (!small.empty() && !large.empty()) {
+    auto lesser  = small.back();
+    auto greater = large.back();
+    small.pop_back();
+    alias[lesser]   = {(float)scaled[lesser], greater};
+    scaled[greater] = (scaled[greater] + scaled[lesser]) - 1;
+    if (scaled[greater] < 1) {
+      large.pop_back();
+      small.push_back(greater);
+    }
+  }
+  return alias;
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -42,7 +42,6 @@
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
-#include <future>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <stdexcept>
@@ -53,6 +52,7 @@
 #include "yocto_geometry.h"
 #include "yocto_image.h"
 #include "yocto_modelio.h"
+#include "yocto_parallel.h"
 #include "yocto_pbrtio.h"
 #include "yocto_shading.h"
 #include "yocto_shape.h"
@@ -73,8 +73,8 @@ using namespace std::string_literals;
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
+// Parallel for on the shared pool that can be disabled with `noparallel`.
+// `Func` takes the integer index.
 template <typename T, typename Func>
 inline void parallel_for(T num, bool noparallel, Func&& func) {
   if (noparallel) {
@@ -82,32 +82,12 @@ inline void parallel_for(T num, bool noparallel, Func&& func) {
       func(idx);
     }
   } else {
-    auto              futures  = vector<std::future<void>>{};
-    auto              nthreads = std::thread::hardware_concurrency();
-    std::atomic<T>    next_idx(0);
-    std::atomic<bool> has_error(false);
-    for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-      futures.emplace_back(
-          std::async(std::launch::async, [&func, &next_idx, &has_error, num]() {
-            while (true) {
-              if (has_error) break;
-              auto idx = next_idx.fetch_add(1);
-              if (idx >= num) break;
-              try {
-                func(idx);
-              } catch (std::exception& error) {
-                has_error = true;
-                throw;
-              }
-            }
-          }));
-    }
-    for (auto& f : futures) f.get();
+    parallel_for(num, std::forward<Func>(func));
   }
 }
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the integer index.
+// Parallel zip on the shared pool that can be disabled with `noparallel`.
+// `Func` takes references to the elements of both sequences.
 template <typename Sequence1, typename Sequence2, typename Func>
 inline void parallel_zip(Sequence1&& sequence1, Sequence2&& sequence2,
     bool noparallel, Func&& func) {
@@ -119,34 +99,13 @@ inline void parallel_zip(Sequence1&& sequence1, Sequence2&& sequence2,
           std::forward<Sequence2>(sequence2)[idx]);
     }
   } else {
-    auto                num      = std::size(sequence1);
-    auto                futures  = vector<std::future<void>>{};
-    auto                nthreads = std::thread::hardware_concurrency();
-    std::atomic<size_t> next_idx(0);
-    std::atomic<bool>   has_error(false);
-    for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-      futures.emplace_back(std::async(std::launch::async,
-          [&func, &next_idx, &has_error, num, &sequence1, &sequence2]() {
-            try {
-              while (true) {
-                auto idx = next_idx.fetch_add(1);
-                if (idx >= num) break;
-                if (has_error) break;
-                func(std::forward<Sequence1>(sequence1)[idx],
-                    std::forward<Sequence2>(sequence2)[idx]);
-              }
-            } catch (...) {
-              has_error = true;
-              throw;
-            }
-          }));
-    }
-    for (auto& f : futures) f.get();
+    parallel_zip(std::forward<Sequence1>(sequence1),
+        std::forward<Sequence2>(sequence2), std::forward<Func>(func));
   }
 }
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes a reference to a `T`.
+// Parallel foreach on the shared pool that can be disabled with `noparallel`.
+// `Func` takes a reference to a `T`.
 template <typename T, typename Func>
 inline void parallel_foreach(vector<T>& values, bool noparallel, Func&& func) {
   return parallel_for(values.size(), noparallel,
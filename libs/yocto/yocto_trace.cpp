@@ -29,6 +29,7 @@
 #include "yocto_trace.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <future>
 #include <memory>
@@ -37,6 +38,7 @@
 
 #include "yocto_color.h"
 #include "yocto_geometry.h"
+#include "yocto_parallel.h"
 #include "yocto_sampling.h"
 #include "yocto_shading.h"
 #include "yocto_shape.h"
@@ -46,62 +48,52 @@
 #endif
 
 // -----------------------------------------------------------------------------
-// PARALLEL HELPERS
+// TILE SCHEDULING
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the two integer indices.
-template <typename T, typename Func>
-inline void parallel_for(T num1, T num2, Func&& func) {
-  auto              futures  = vector<std::future<void>>{};
-  auto              nthreads = std::thread::hardware_concurrency();
-  std::atomic<T>    next_idx(0);
-  std::atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&func, &next_idx, &has_error, num1, num2]() {
-          try {
-            while (true) {
-              auto j = next_idx.fetch_add(1);
-              if (j >= num2) break;
-              if (has_error) break;
-              for (auto i = (T)0; i < num1; i++) func(i, j);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+// Morton code of a tile, interleaving the bits of its coordinates.
+static uint32_t morton_code(vec2i ij) {
+  auto spread = [](uint32_t x) {
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+  };
+  return spread((uint32_t)ij.x) | (spread((uint32_t)ij.y) << 1);
+}
+
+// Make the list of image tiles in Morton order, so that tiles dispatched
+// close in time are close in the image and share BVH nodes and textures.
+static vector<vec2i> make_tiles(vec2i size, int tile_size) {
+  auto ntiles = (size + tile_size - 1) / tile_size;
+  auto tiles  = vector<vec2i>{};
+  tiles.reserve((size_t)ntiles.x * (size_t)ntiles.y);
+  for (auto ij : range(ntiles)) tiles.push_back(ij);
+  std::sort(tiles.begin(), tiles.end(), [](vec2i a, vec2i b) {
+    return morton_code(a) < morton_code(b);
+  });
+  return tiles;
 }
 
-// Simple parallel for used since our target platforms do not yet support
-// parallel algorithms. `Func` takes the two integer indices.
+// Parallel for over the pixels of an image grouped in square tiles.
+// `Func` takes the pixel index. A tile size of zero schedules scanlines.
 template <typename Func>
-inline void parallel_for_batch(vec2i num, Func&& func) {
-  auto              futures  = vector<std::future<void>>{};
-  auto              nthreads = std::thread::hardware_concurrency();
-  std::atomic<int>  next_idx(0);
-  std::atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, &has_error, num]() {
-          try {
-            while (true) {
-              auto j = next_idx.fetch_add(1);
-              if (j >= num[1]) break;
-              if (has_error) break;
-              for (auto i = 0; i < num[0]; i++) func(vec2i{i, j});
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+static void parallel_for_tiles(vec2i size, int tile_size, Func&& func) {
+  if (tile_size <= 0)
+    return parallel_for_batch(size, std::forward<Func>(func));
+  auto tiles = make_tiles(size, tile_size);
+  parallel_for(tiles.size(), [&](size_t idx) {
+    auto start = tiles[idx] * tile_size;
+    auto end   = min(start + tile_size, size);
+    for (auto j = start.y; j < end.y; j++) {
+      for (auto i = start.x; i < end.x; i++) {
+        func(vec2i{i, j});
+      }
+    }
+  });
 }
 
 }  // namespace yocto
@@ -116,9 +108,18 @@ trace_bvh make_trace_bvh(const scene_data& scene, const trace_params& params) {
   if (params.embreebvh && embree_supported()) {
     return {
         {}, make_scene_ebvh(scene, params.highqualitybvh, params.noparallel)};
+  }
+  auto bparams           = bvh_params{};
+  bparams.highquality    = params.highqualitybvh;
+  bparams.noparallel     = params.noparallel;
+  bparams.wide           = params.widebvh;
+  bparams.spatial_budget = params.spatialbvh;
+  bparams.compressed     = params.compressedbvh;
+  bparams.precomputed    = params.precomputedbvh;
+  if (!params.bvhcache.empty()) {
+    return {make_cached_scene_bvh(scene, params.bvhcache, bparams), {}};
   } else {
-    return {
-        make_scene_bvh(scene, params.highqualitybvh, params.noparallel), {}};
+    return {make_scene_bvh(scene, bparams), {}};
   }
 }
 
@@ -131,6 +132,20 @@ static scene_intersection intersect_scene(const trace_bvh& bvh,
     return intersect_scene_bvh(bvh.bvh, scene, ray, find_any);
   }
 }
+static vector<scene_intersection> intersect_scene(const trace_bvh& bvh,
+    const scene_data& scene, const vector<ray3f>& rays,
+    bool find_any = false) {
+  if (bvh.ebvh.ebvh) {
+    auto intersections = vector<scene_intersection>(rays.size());
+    for (auto idx : range(rays.size())) {
+      intersections[idx] = intersect_scene_ebvh(
+          bvh.ebvh, scene, rays[idx], find_any);
+    }
+    return intersections;
+  } else {
+    return intersect_scene_bvh(bvh.bvh, scene, rays, find_any);
+  }
+}
 static scene_intersection intersect_instance(const trace_bvh& bvh,
     const scene_data& scene, int instance, const ray3f& ray,
     bool find_any = false) {
@@ -343,42 +358,374 @@ static ray3f sample_camera(const camera_data& camera, vec2i ij,
   }
 }
 
-// Sample lights wrt solid angle
-static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
-    vec3f position, float rl, float rel, vec2f ruv) {
-  auto  light_id = sample_uniform((int)lights.lights.size(), rl);
+// Environment textures are sampled in two steps. First, a block of texels is
+// chosen with an alias table, and then a texel is chosen in the block by its
+// weight. Blocks are chosen so that the tables have at most 2M entries.
+static int get_environment_block(vec2i size) {
+  auto block = 1;
+  while ((size_t)size.x * (size_t)size.y > (size_t)block * block * (1 << 21))
+    block *= 2;
+  return block;
+}
+
+// Environment texel weight, proportional to its emission and solid angle
+static float eval_environment_weight(
+    const texture_data& texture, vec2i ij, vec2i size) {
+  return max(xyz(lookup_texture(texture, ij))) *
+         sin((ij.y + 0.5f) * pif / size.y);
+}
+
+// Sample an environment light wrt solid angle
+static vec3f sample_environment(const scene_data& scene,
+    const trace_light& light, vec2f rel, vec2f ruv) {
+  auto& environment = scene.environments[light.environment];
+  if (environment.emission_tex != invalidid) {
+    auto& texture = scene.textures[environment.emission_tex];
+    auto  size    = max(texture.pixelsf.size(), texture.pixelsb.size());
+    auto  block   = get_environment_block(size);
+    auto  grid    = (size + block - 1) / block;
+    auto  cell    = sample_alias(light.elements_alias, rel);
+    auto  start   = vec2i{cell % grid.x, cell / grid.x} * block;
+    auto  end     = min(start + block, size);
+    // pick a texel by its weight, reusing the random number inside it. The
+    // block weight is stored, so texels are scanned once, in the same order
+    // used to sum the weight, and only until the texel is found. If rounding
+    // leaves the target past the end, the last texel is picked.
+    auto ij  = start;
+    auto rij = ruv;
+    if (block > 1) {
+      auto target = ruv.x * light.elements_weights[cell];
+      auto found  = false;
+      for (auto j = start.y; j < end.y && !found; j++) {
+        auto th = (j + 0.5f) * pif / size.y;
+        for (auto i = start.x; i < end.x && !found; i++) {
+          auto weight = max(xyz(lookup_texture(texture, {i, j}))) * sin(th);
+          if (weight <= 0) continue;
+          ij    = {i, j};
+          rij.x = min(target / weight, 1 - flt_eps);
+          found = target < weight;
+          target -= weight;
+        }
+      }
+    }
+    auto uv = vec2f{(ij.x + rij.x) / size.x, (ij.y + rij.y) / size.y};
+    return transform_direction(environment.frame,
+        {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
+            sin(uv.x * 2 * pif) * sin(uv.y * pif)});
+  } else {
+    return sample_sphere(ruv);
+  }
+}
+
+// Sample an environment light pdf
+static float sample_environment_pdf(
+    const scene_data& scene, const trace_light& light, vec3f direction) {
+  auto& environment = scene.environments[light.environment];
+  if (environment.emission_tex != invalidid) {
+    auto& emission_tex = scene.textures[environment.emission_tex];
+    auto  wl = transform_direction(inverse(environment.frame), direction);
+    auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
+        acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
+    if (texcoord.x < 0) texcoord.x += 1;
+    auto size = max(emission_tex.pixelsf.size(), emission_tex.pixelsb.size());
+    auto ij   = clamp((vec2i)(texcoord * (vec2f)size), zero2i, size - 1);
+    // the probability of a block times the one of the texel in the block
+    // is the probability of the texel
+    auto prob = eval_environment_weight(emission_tex, ij, size) /
+                light.elements_cdf.back();
+    // texels are sampled uniformly in uv
+    auto angle = (2 * pif / size.x) * (pif / size.y) *
+                 sqrt(max(1 - wl.y * wl.y, 0.0f));
+    return angle > 0 ? prob / angle : 0;
+  } else {
+    return 1 / (4 * pif);
+  }
+}
+
+// Importance of a light tree node seen from a point. This bounds the power
+// received from the node, using its distance and the smallest angle between
+// the node normals and the directions to the node.
+static float eval_light_importance(
+    const trace_light_node& node, vec3f position) {
+  // distance, clamped inside the node to avoid singularities
+  auto center  = yocto::center(node.bbox);
+  auto radius2 = distance_squared(node.bbox.min, node.bbox.max) / 4;
+  auto dist2   = distance_squared(position, center);
+
+  // angle between the node axis and the direction to the point
+  auto cos_w = abs(dot(node.axis, normalize(position - center)));
+  auto sin_w = sqrt(max(1 - cos_w * cos_w, 0.0f));
+  auto cos_o = node.cosine;
+  auto sin_o = sqrt(max(1 - cos_o * cos_o, 0.0f));
+
+  // angle subtended by the node bounds
+  auto cos_b = dist2 > radius2 ? sqrt(1 - radius2 / dist2) : -1.0f;
+  auto sin_b = sqrt(max(1 - cos_b * cos_b, 0.0f));
+
+  // subtract the normal cone and bounds angles, clamping at zero
+  auto cos_x = cos_w > cos_o ? 1.0f : cos_w * cos_o + sin_w * sin_o;
+  auto sin_x = cos_w > cos_o ? 0.0f : sqrt(max(1 - cos_x * cos_x, 0.0f));
+  auto cos_p = cos_x > cos_b ? 1.0f : cos_x * cos_b + sin_x * sin_b;
+  if (cos_p <= 0) return 0;
+  return node.power * cos_p / max(dist2, radius2);
+}
+
+// Sample an element in the light tree, descending it by node importance.
+static pair<int, int> sample_light_tree(
+    const trace_lights& lights, vec3f position, float rl) {
+  auto node_id = 0;
+  while (lights.nodes[node_id].light == invalidid) {
+    auto& node        = lights.nodes[node_id];
+    auto  importance0 = eval_light_importance(
+        lights.nodes[node.start + 0], position);
+    auto importance1 = eval_light_importance(
+        lights.nodes[node.start + 1], position);
+    if (importance0 + importance1 <= 0) return {invalidid, invalidid};
+    auto prob0 = importance0 / (importance0 + importance1);
+    if (rl < prob0) {
+      node_id = node.start + 0;
+      rl      = min(rl / prob0, 1 - flt_eps);
+    } else {
+      node_id = node.start + 1;
+      rl      = min((rl - prob0) / (1 - prob0), 1 - flt_eps);
+    }
+  }
+  auto& leaf = lights.nodes[node_id];
+  return {leaf.light, leaf.element};
+}
+
+// World-space vertices of a light element, as a quad. Triangles repeat their
+// last vertex.
+static array<vec3f, 4> eval_light_quad(
+    const scene_data& scene, const instance_data& instance, int element) {
+  auto& shape = scene.shapes[instance.shape];
+  auto  q     = vec4i{0, 0, 0, 0};
+  if (!shape.triangles.empty()) {
+    auto& t = shape.triangles[element];
+    q       = {t.x, t.y, t.z, t.z};
+  } else {
+    q = shape.quads[element];
+  }
+  return {transform_point(instance.frame, shape.positions[q.x]),
+      transform_point(instance.frame, shape.positions[q.y]),
+      transform_point(instance.frame, shape.positions[q.z]),
+      transform_point(instance.frame, shape.positions[q.w])};
+}
+
+// Sample the light tree pdf, summing over all the elements crossed by the
+// direction. Descending the tree, we skip nodes not crossed by the direction
+// and multiply the probabilities of choosing each node.
+static float sample_light_tree_pdf(const scene_data& scene,
+    const trace_lights& lights, vec3f position, vec3f direction) {
+  auto ray        = ray3f{position, direction};
+  auto ray_dinv   = 1 / direction;
+  auto node_stack = array<pair<int, float>, 128>{};
+  auto node_cur   = 0;
+  node_stack[node_cur++] = {0, 1.0f};
+  auto pdf               = 0.0f;
+  while (node_cur != 0) {
+    auto [node_id, prob] = node_stack[--node_cur];
+    auto& node           = lights.nodes[node_id];
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+    if (node.light == invalidid) {
+      auto importance0 = eval_light_importance(
+          lights.nodes[node.start + 0], position);
+      auto importance1 = eval_light_importance(
+          lights.nodes[node.start + 1], position);
+      if (importance0 + importance1 <= 0) continue;
+      auto prob0 = importance0 / (importance0 + importance1);
+      if (importance0 > 0) node_stack[node_cur++] = {node.start, prob * prob0};
+      if (importance1 > 0)
+        node_stack[node_cur++] = {node.start + 1, prob * (1 - prob0)};
+    } else {
+      auto& instance = scene.instances[lights.lights[node.light].instance];
+      auto [p0, p1, p2, p3] = eval_light_quad(scene, instance, node.element);
+      auto intersection     = intersect_quad(ray, p0, p1, p2, p3);
+      if (!intersection.hit) continue;
+      // prob element * area element = area light element
+      auto lnormal = quad_normal(p0, p1, p2, p3);
+      auto area    = quad_area(p0, p1, p2, p3);
+      pdf += prob * intersection.distance * intersection.distance /
+             (abs(dot(lnormal, direction)) * area);
+    }
+  }
+  return pdf;
+}
+
+// Sample the light tree pdf of a known element and point on it. Descending
+// the tree, we skip nodes that do not contain the point.
+static float sample_light_tree_pdf(const trace_lights& lights,
+    vec3f position, int light, int element, vec3f lposition) {
+  auto epsilon    = 1e-4f * (max(abs(lposition)) + 1);
+  auto node_stack = array<pair<int, float>, 128>{};
+  auto node_cur   = 0;
+  node_stack[node_cur++] = {0, 1.0f};
+  while (node_cur != 0) {
+    auto [node_id, prob] = node_stack[--node_cur];
+    auto& node           = lights.nodes[node_id];
+    if (!overlap_bbox(lposition, epsilon, node.bbox)) continue;
+    if (node.light == invalidid) {
+      auto importance0 = eval_light_importance(
+          lights.nodes[node.start + 0], position);
+      auto importance1 = eval_light_importance(
+          lights.nodes[node.start + 1], position);
+      if (importance0 + importance1 <= 0) continue;
+      auto prob0 = importance0 / (importance0 + importance1);
+      if (importance0 > 0) node_stack[node_cur++] = {node.start, prob * prob0};
+      if (importance1 > 0)
+        node_stack[node_cur++] = {node.start + 1, prob * (1 - prob0)};
+    } else if (node.light == light && node.element == element) {
+      return prob;
+    }
+  }
+  return 0;
+}
+
+// Number of environment lights, that are stored after instance lights.
+static int count_environment_lights(const trace_lights& lights) {
+  auto count = 0;
+  for (auto idx = (int)lights.lights.size() - 1; idx >= 0; idx--) {
+    if (lights.lights[idx].environment == invalidid) break;
+    count += 1;
+  }
+  return count;
+}
+
+// Sample lights wrt solid angle, returning the direction and the distance
+// to the sampled point, that is flt_max for environments.
+static pair<vec3f, float> sample_lights_distance(const scene_data& scene,
+    const trace_lights& lights, vec3f position, vec2f rl, vec2f rel,
+    vec2f ruv) {
+  // light tree for instances and power sampling for environments
+  if (!lights.nodes.empty()) {
+    auto nlights       = (int)lights.lights.size();
+    auto nenvironments = count_environment_lights(lights);
+    auto tree_prob     = 1.0f;
+    for (auto idx = nlights - nenvironments; idx < nlights; idx++)
+      tree_prob -= lights.lights[idx].pdf;
+    if (rl.x < tree_prob) {
+      auto [light_id, element] = sample_light_tree(
+          lights, position, rl.x / tree_prob);
+      if (light_id == invalidid) return {{0, 0, 0}, 0};
+      auto& instance  = scene.instances[lights.lights[light_id].instance];
+      auto& shape     = scene.shapes[instance.shape];
+      auto  uv        = (!shape.triangles.empty()) ? sample_triangle(ruv) : ruv;
+      auto  lposition = eval_position(scene, instance, element, uv);
+      return {normalize(lposition - position), distance(lposition, position)};
+    } else {
+      auto light_id = nlights - 1;
+      for (auto idx = nlights - nenvironments; idx < nlights - 1; idx++) {
+        rl.x -= lights.lights[idx].pdf;
+        if (rl.x < tree_prob) {
+          light_id = idx;
+          break;
+        }
+      }
+      return {sample_environment(scene, lights.lights[light_id], rel, ruv),
+          flt_max};
+    }
+  }
+
+  auto  light_id = sample_alias(lights.lights_alias, rl);
   auto& light    = lights.lights[light_id];
   if (light.instance != invalidid) {
     auto& instance  = scene.instances[light.instance];
     auto& shape     = scene.shapes[instance.shape];
-    auto  element   = sample_discrete(light.elements_cdf, rel);
+    auto  element   = sample_alias(light.elements_alias, rel);
     auto  uv        = (!shape.triangles.empty()) ? sample_triangle(ruv) : ruv;
     auto  lposition = eval_position(scene, instance, element, uv);
-    return normalize(lposition - position);
+    return {normalize(lposition - position), distance(lposition, position)};
   } else if (light.environment != invalidid) {
-    auto& environment = scene.environments[light.environment];
-    if (environment.emission_tex != invalidid) {
-      auto& texture = scene.textures[environment.emission_tex];
-      auto  idx     = sample_discrete(light.elements_cdf, rel);
-      auto  size    = max(texture.pixelsf.size(), texture.pixelsb.size());
-      auto  uv      = vec2f{
-          ((idx % size.x) + 0.5f) / size.x, ((idx / size.x) + 0.5f) / size.y};
-      return transform_direction(environment.frame,
-          {cos(uv.x * 2 * pif) * sin(uv.y * pif), cos(uv.y * pif),
-              sin(uv.x * 2 * pif) * sin(uv.y * pif)});
-    } else {
-      return sample_sphere(ruv);
+    return {sample_environment(scene, light, rel, ruv), flt_max};
+  } else {
+    return {{0, 0, 0}, 0};
+  }
+}
+
+// Sample lights wrt solid angle
+static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
+    vec3f position, vec2f rl, vec2f rel, vec2f ruv) {
+  return sample_lights_distance(scene, lights, position, rl, rel, ruv).first;
+}
+
+// Check whether an intersection is the light point sampled at a distance,
+// so that the sampled point is visible.
+static bool is_light_visible(
+    const scene_intersection& intersection, float distance) {
+  if (distance == flt_max) return !intersection.hit;
+  return intersection.hit &&
+         abs(intersection.distance - distance) <= 1e-3f * distance;
+}
+
+// Sample lights pdf for the point hit by a ray in a direction, considering
+// only the first hit. This is the pdf of sampling that point, converted to
+// solid angle, and needs no further ray tracing. Use it with light samples
+// that are visible, since occluded points on lights are not accounted for.
+static float sample_lights_pdf(const scene_data& scene,
+    const trace_lights& lights, vec3f position, vec3f direction,
+    const scene_intersection& intersection) {
+  // environments
+  auto nlights       = (int)lights.lights.size();
+  auto nenvironments = count_environment_lights(lights);
+  if (!intersection.hit) {
+    auto pdf = 0.0f;
+    for (auto idx = nlights - nenvironments; idx < nlights; idx++) {
+      auto& light = lights.lights[idx];
+      pdf += light.pdf * sample_environment_pdf(scene, light, direction);
     }
+    return pdf;
+  }
+
+  // instances
+  auto light_id = lights.instances[intersection.instance];
+  if (light_id == invalidid) return 0;
+  auto& light    = lights.lights[light_id];
+  auto& instance = scene.instances[intersection.instance];
+  auto  lnormal  = eval_element_normal(scene, instance, intersection.element);
+  auto  cosine   = abs(dot(lnormal, direction));
+  auto  distance = intersection.distance;
+  if (!lights.nodes.empty()) {
+    auto tree_prob = 1.0f;
+    for (auto idx = nlights - nenvironments; idx < nlights; idx++)
+      tree_prob -= lights.lights[idx].pdf;
+    auto lposition = eval_position(
+        scene, instance, intersection.element, intersection.uv);
+    auto prob = sample_light_tree_pdf(
+        lights, position, light_id, intersection.element, lposition);
+    auto [p0, p1, p2, p3] = eval_light_quad(
+        scene, instance, intersection.element);
+    // prob element / area element
+    return tree_prob * prob * distance * distance /
+           (cosine * quad_area(p0, p1, p2, p3));
   } else {
-    return {0, 0, 0};
+    // prob triangle * area triangle = area triangle mesh
+    return light.pdf * distance * distance /
+           (cosine * light.elements_cdf.back());
   }
 }
 
 // Sample lights pdf
 static float sample_lights_pdf(const scene_data& scene, const trace_bvh& bvh,
     const trace_lights& lights, vec3f position, vec3f direction) {
+  // light tree for instances and power sampling for environments
+  if (!lights.nodes.empty()) {
+    auto nlights       = (int)lights.lights.size();
+    auto nenvironments = count_environment_lights(lights);
+    auto tree_prob     = 1.0f;
+    auto pdf           = 0.0f;
+    for (auto idx = nlights - nenvironments; idx < nlights; idx++) {
+      auto& light = lights.lights[idx];
+      tree_prob -= light.pdf;
+      pdf += light.pdf * sample_environment_pdf(scene, light, direction);
+    }
+    pdf += tree_prob *
+           sample_light_tree_pdf(scene, lights, position, direction);
+    return pdf;
+  }
+
   auto pdf = 0.0f;
   for (auto& light : lights.lights) {
+    if (light.pdf == 0) continue;
     if (light.instance != invalidid) {
       auto& instance = scene.instances[light.instance];
       // check all intersection
@@ -400,30 +747,11 @@ static float sample_lights_pdf(const scene_data& scene, const trace_bvh& bvh,
         // continue
         next_position = lposition + direction * 1e-3f;
       }
-      pdf += lpdf;
+      pdf += light.pdf * lpdf;
     } else if (light.environment != invalidid) {
-      auto& environment = scene.environments[light.environment];
-      if (environment.emission_tex != invalidid) {
-        auto& emission_tex = scene.textures[environment.emission_tex];
-        auto  wl = transform_direction(inverse(environment.frame), direction);
-        auto  texcoord = vec2f{atan2(wl.z, wl.x) / (2 * pif),
-            acos(clamp(wl.y, -1.0f, 1.0f)) / pif};
-        if (texcoord.x < 0) texcoord.x += 1;
-        auto size = max(
-            emission_tex.pixelsf.size(), emission_tex.pixelsb.size());
-        auto ij   = clamp((vec2i)(texcoord * (vec2f)size), zero2i, size - 1);
-        auto prob = sample_discrete_pdf(
-                        light.elements_cdf, ij.y * size.x + ij.x) /
-                    light.elements_cdf.back();
-        auto angle = (2 * pif / size.x) * (pif / size.y) *
-                     sin(pif * (ij.y + 0.5f) / size.y);
-        pdf += prob / angle;
-      } else {
-        pdf += 1 / (4 * pif);
-      }
+      pdf += light.pdf * sample_environment_pdf(scene, light, direction);
     }
   }
-  pdf *= sample_uniform_pdf((int)lights.lights.size());
   return pdf;
 }
 
@@ -512,7 +840,7 @@ static trace_result trace_path(const scene_data& scene, const trace_bvh& bvh,
               material, normal, outgoing, rand1f(rng), rand2f(rng));
         } else {
           incoming = sample_lights(
-              scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+              scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
         }
         if (incoming == vec3f{0, 0, 0}) break;
         weight *=
@@ -554,7 +882,7 @@ static trace_result trace_path(const scene_data& scene, const trace_bvh& bvh,
         incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
       } else {
         incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+            scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
       }
       if (incoming == vec3f{0, 0, 0}) break;
       weight *=
@@ -654,23 +982,26 @@ static trace_result trace_pathdirect(const scene_data& scene,
 
       // direct
       if (!is_delta(material)) {
-        auto incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
-        auto pdf = sample_lights_pdf(scene, bvh, lights, position, incoming);
+        auto [incoming, distance] = sample_lights_distance(
+            scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
         auto bsdfcos = eval_bsdfcos(material, normal, outgoing, incoming);
-        if (bsdfcos != vec3f{0, 0, 0} && pdf > 0) {
+        if (incoming != vec3f{0, 0, 0} && bsdfcos != vec3f{0, 0, 0}) {
           auto intersection = intersect_scene(bvh, scene, {position, incoming});
-          auto emission =
-              !intersection.hit
-                  ? eval_environment(scene, incoming)
-                  : eval_emission(eval_material(scene,
-                                      scene.instances[intersection.instance],
-                                      intersection.element, intersection.uv),
-                        eval_shading_normal(scene,
-                            scene.instances[intersection.instance],
-                            intersection.element, intersection.uv, -incoming),
-                        -incoming);
-          radiance += weight * bsdfcos * emission / pdf;
+          auto pdf          = sample_lights_pdf(
+              scene, lights, position, incoming, intersection);
+          if (is_light_visible(intersection, distance) && pdf > 0) {
+            auto emission =
+                !intersection.hit
+                    ? eval_environment(scene, incoming)
+                    : eval_emission(eval_material(scene,
+                                        scene.instances[intersection.instance],
+                                        intersection.element, intersection.uv),
+                          eval_shading_normal(scene,
+                              scene.instances[intersection.instance],
+                              intersection.element, intersection.uv, -incoming),
+                          -incoming);
+            radiance += weight * bsdfcos * emission / pdf;
+          }
         }
         next_emission = false;
       } else {
@@ -685,7 +1016,7 @@ static trace_result trace_pathdirect(const scene_data& scene,
               material, normal, outgoing, rand1f(rng), rand2f(rng));
         } else {
           incoming = sample_lights(
-              scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+              scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
         }
         if (incoming == vec3f{0, 0, 0}) break;
         weight *=
@@ -725,7 +1056,7 @@ static trace_result trace_pathdirect(const scene_data& scene,
         incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
       } else {
         incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+            scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
       }
       if (incoming == vec3f{0, 0, 0}) break;
       weight *=
@@ -837,38 +1168,45 @@ static trace_result trace_pathmis(const scene_data& scene, const trace_bvh& bvh,
       if (!is_delta(material)) {
         // direct with MIS --- light
         for (auto sample_light : {true, false}) {
-          incoming = sample_light ? sample_lights(scene, lights, position,
-                                        rand1f(rng), rand1f(rng), rand2f(rng))
-                                  : sample_bsdfcos(material, normal, outgoing,
-                                        rand1f(rng), rand2f(rng));
-          if (incoming == vec3f{0, 0, 0}) break;
-          auto bsdfcos   = eval_bsdfcos(material, normal, outgoing, incoming);
+          auto distance = flt_max;
+          if (sample_light) {
+            std::tie(incoming, distance) = sample_lights_distance(scene,
+                lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
+            if (incoming == vec3f{0, 0, 0}) continue;
+          } else {
+            incoming = sample_bsdfcos(
+                material, normal, outgoing, rand1f(rng), rand2f(rng));
+            if (incoming == vec3f{0, 0, 0}) break;
+          }
+          auto bsdfcos = eval_bsdfcos(material, normal, outgoing, incoming);
+          if (bsdfcos == vec3f{0, 0, 0}) continue;
+          // the light pdf uses the hit, so light samples must be visible
+          auto intersection = intersect_scene(bvh, scene, {position, incoming});
+          if (!sample_light) next_intersection = intersection;
+          if (sample_light && !is_light_visible(intersection, distance))
+            continue;
           auto light_pdf = sample_lights_pdf(
-              scene, bvh, lights, position, incoming);
+              scene, lights, position, incoming, intersection);
           auto bsdf_pdf = sample_bsdfcos_pdf(
               material, normal, outgoing, incoming);
+          if ((sample_light ? light_pdf : bsdf_pdf) == 0) continue;
           auto mis_weight = sample_light
                                 ? mis_heuristic(light_pdf, bsdf_pdf) / light_pdf
                                 : mis_heuristic(bsdf_pdf, light_pdf) / bsdf_pdf;
-          if (bsdfcos != vec3f{0, 0, 0} && mis_weight != 0) {
-            auto intersection = intersect_scene(
-                bvh, scene, {position, incoming});
-            if (!sample_light) next_intersection = intersection;
-            auto emission = vec3f{0, 0, 0};
-            if (!intersection.hit) {
-              emission = eval_environment(scene, incoming);
-            } else {
-              auto material = eval_material(scene,
-                  scene.instances[intersection.instance], intersection.element,
-                  intersection.uv);
-              emission      = eval_emission(material,
-                       eval_shading_normal(scene,
-                           scene.instances[intersection.instance],
-                           intersection.element, intersection.uv, -incoming),
-                       -incoming);
-            }
-            radiance += weight * bsdfcos * emission * mis_weight;
+          auto emission = vec3f{0, 0, 0};
+          if (!intersection.hit) {
+            emission = eval_environment(scene, incoming);
+          } else {
+            auto material = eval_material(scene,
+                scene.instances[intersection.instance], intersection.element,
+                intersection.uv);
+            emission      = eval_emission(material,
+                     eval_shading_normal(scene,
+                         scene.instances[intersection.instance],
+                         intersection.element, intersection.uv, -incoming),
+                     -incoming);
           }
+          radiance += weight * bsdfcos * emission * mis_weight;
         }
 
         // indirect
@@ -908,7 +1246,7 @@ static trace_result trace_pathmis(const scene_data& scene, const trace_bvh& bvh,
         next_emission = true;
       } else {
         incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+            scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
         next_emission = true;
       }
       weight *=
@@ -983,7 +1321,7 @@ static trace_result trace_pathtest(const scene_data& scene,
             material, normal, outgoing, rand1f(rng), rand2f(rng));
       } else {
         incoming = sample_lights(
-            scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+            scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
       }
       if (incoming == vec3f{0, 0, 0}) break;
       weight *=
@@ -1064,23 +1402,26 @@ static trace_result trace_lightsampling(const scene_data& scene,
 
     // direct
     if (!is_delta(material)) {
-      auto incoming = sample_lights(
-          scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
-      auto pdf     = sample_lights_pdf(scene, bvh, lights, position, incoming);
+      auto [incoming, distance] = sample_lights_distance(
+          scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
       auto bsdfcos = eval_bsdfcos(material, normal, outgoing, incoming);
-      if (bsdfcos != vec3f{0, 0, 0} && pdf > 0) {
+      if (incoming != vec3f{0, 0, 0} && bsdfcos != vec3f{0, 0, 0}) {
         auto intersection = intersect_scene(bvh, scene, {position, incoming});
-        auto emission =
-            !intersection.hit
-                ? eval_environment(scene, incoming)
-                : eval_emission(eval_material(scene,
-                                    scene.instances[intersection.instance],
-                                    intersection.element, intersection.uv),
-                      eval_shading_normal(scene,
-                          scene.instances[intersection.instance],
-                          intersection.element, intersection.uv, -incoming),
-                      -incoming);
-        radiance += weight * bsdfcos * emission / pdf;
+        auto pdf          = sample_lights_pdf(
+            scene, lights, position, incoming, intersection);
+        if (is_light_visible(intersection, distance) && pdf > 0) {
+          auto emission =
+              !intersection.hit
+                  ? eval_environment(scene, incoming)
+                  : eval_emission(eval_material(scene,
+                                      scene.instances[intersection.instance],
+                                      intersection.element, intersection.uv),
+                        eval_shading_normal(scene,
+                            scene.instances[intersection.instance],
+                            intersection.element, intersection.uv, -incoming),
+                        -incoming);
+          radiance += weight * bsdfcos * emission / pdf;
+        }
       }
       next_emission = false;
     } else {
@@ -1455,6 +1796,7 @@ static sampler_func get_trace_sampler_func(const trace_params& params) {
     case trace_sampler_type::eyelight: return trace_eyelight;
     case trace_sampler_type::furnace: return trace_furnace;
     case trace_sampler_type::falsecolor: return trace_falsecolor;
+    case trace_sampler_type::wavefront: return trace_pathdirect;
     default: {
       throw std::runtime_error("sampler unknown");
       return nullptr;
@@ -1472,6 +1814,7 @@ bool is_sampler_lit(const trace_params& params) {
     case trace_sampler_type::eyelight: return false;
     case trace_sampler_type::furnace: return true;
     case trace_sampler_type::falsecolor: return false;
+    case trace_sampler_type::wavefront: return true;
     default: {
       throw std::runtime_error("sampler unknown");
       return false;
@@ -1479,20 +1822,19 @@ bool is_sampler_lit(const trace_params& params) {
   }
 }
 
-// Trace a block of samples
-void trace_sample(trace_state& state, const scene_data& scene,
-    const trace_bvh& bvh, const trace_lights& lights, vec2i ij, int sample,
+// Accumulate a sample in the state
+static void accumulate_sample(trace_state& state, const scene_data& scene,
+    vec2i ij, int sample, const trace_result& result, const ray3f& ray,
     const trace_params& params) {
-  auto& camera  = scene.cameras[params.camera];
-  auto  sampler = get_trace_sampler_func(params);
-  auto  ray     = sample_camera(camera, ij, state.render.size(),
-           rand2f(state.rngs[ij]), rand2f(state.rngs[ij]), params.tentfilter);
-  auto [radiance, hit, albedo, normal] = sampler(
-      scene, bvh, lights, ray, state.rngs[ij], params);
+  auto [radiance, hit, albedo, normal] = result;
   if (!isfinite(radiance)) radiance = {0, 0, 0};
   if (max(radiance) > params.clamp)
     radiance = radiance * (params.clamp / max(radiance));
   auto weight = 1.0f / (sample + 1);
+  if (!state.moments.empty()) {
+    auto value        = (hit || !params.envhidden) ? luminance(radiance) : 0;
+    state.moments[ij] = lerp(state.moments[ij], value * value, weight);
+  }
   if (hit) {
     state.render[ij] = lerp(
         state.render[ij], {radiance.x, radiance.y, radiance.z, 1}, weight);
@@ -1512,16 +1854,483 @@ void trace_sample(trace_state& state, const scene_data& scene,
   }
 }
 
+// Trace a block of samples
+void trace_sample(trace_state& state, const scene_data& scene,
+    const trace_bvh& bvh, const trace_lights& lights, vec2i ij, int sample,
+    const trace_params& params) {
+  auto& camera  = scene.cameras[params.camera];
+  auto  sampler = get_trace_sampler_func(params);
+  auto  ray     = sample_camera(camera, ij, state.render.size(),
+           rand2f(state.rngs[ij]), rand2f(state.rngs[ij]), params.tentfilter);
+  auto  result  = sampler(scene, bvh, lights, ray, state.rngs[ij], params);
+  accumulate_sample(state, scene, ij, sample, result, ray, params);
+}
+
+// Tile size for adaptive sampling, that needs square tiles.
+static int get_adaptive_tilesize(const trace_params& params) {
+  return params.tilesize > 0 ? params.tilesize : 16;
+}
+
+// Whether to sample adaptively, which the wavefront sampler does not support.
+static bool is_trace_adaptive(const trace_params& params) {
+  return params.adaptive > 0 &&
+         params.sampler != trace_sampler_type::wavefront;
+}
+
+// Relative standard error of the pixel luminance after a number of samples.
+// The mean is clamped to avoid sampling dark pixels forever.
+static float eval_pixel_error(const trace_state& state, vec2i ij, int samples) {
+  if (samples < 2) return 1;
+  auto mean     = luminance(xyz(state.render[ij]));
+  auto variance = max(state.moments[ij] - mean * mean, 0.0f);
+  return sqrt(variance / (samples - 1)) / max(mean, 0.01f);
+}
+
+// Check whether a tile has converged
+static bool is_tile_converged(
+    const trace_state& state, float error, const trace_params& params) {
+  return state.samples >= params.adaptivemin && error < params.adaptive;
+}
+
+// Adaptive sampling of a batch of samples. Only tiles above the target error
+// are sampled, and their error is updated as the root mean square error of
+// their pixels.
+// Sampled tiles share the same number of samples, so they are accumulated
+// as in non-adaptive rendering.
+static void trace_adaptive(trace_state& state, const scene_data& scene,
+    const trace_bvh& bvh, const trace_lights& lights,
+    const trace_params& params, const std::atomic<bool>* stop = nullptr) {
+  auto tile_size  = get_adaptive_tilesize(params);
+  auto tiles      = make_tiles(state.render.size(), tile_size);
+  auto samples    = state.samples + params.batch;
+  auto trace_tile = [&](size_t idx) {
+    auto& error = state.errors[tiles[idx]];
+    if (is_tile_converged(state, error, params)) return;
+    auto start      = tiles[idx] * tile_size;
+    auto end        = min(start + tile_size, state.render.size());
+    auto tile_error = 0.0f;
+    for (auto j = start.y; j < end.y; j++) {
+      for (auto i = start.x; i < end.x; i++) {
+        for (auto sample : range(state.samples, samples)) {
+          if (stop && *stop) return;
+          trace_sample(state, scene, bvh, lights, {i, j}, sample, params);
+        }
+        tile_error += sqr(eval_pixel_error(state, {i, j}, samples));
+      }
+    }
+    auto pixels = (end.x - start.x) * (end.y - start.y);
+    error       = sqrt(tile_error / pixels);
+  };
+  if (params.noparallel) {
+    for (auto idx : range(tiles.size())) trace_tile(idx);
+  } else {
+    parallel_for(tiles.size(), trace_tile);
+  }
+}
+
+// Path state for wavefront path tracing. Paths are advanced one bounce at a
+// time by each stage, and carry the light connection ray, traced in the
+// shadow stage, separately from the continuation ray.
+struct trace_wavefront_path {
+  vec2i              ij            = {0, 0};
+  ray3f              camera_ray    = {};
+  ray3f              ray           = {};
+  scene_intersection intersection  = {};
+  vec3f              radiance      = {0, 0, 0};
+  vec3f              weight        = {1, 1, 1};
+  int                bounce        = 0;
+  int                opbounce      = 0;
+  float              max_roughness = 0;
+  bool               next_emission = true;
+  bool               active        = true;
+  bool               hit           = false;
+  vec3f              hit_albedo    = {0, 0, 0};
+  vec3f              hit_normal    = {0, 0, 0};
+  bool               in_medium     = false;
+  material_point     medium        = {};
+  bool               shadow          = false;
+  ray3f              shadow_ray      = {};
+  vec3f              shadow_weight   = {0, 0, 0};
+  float              shadow_distance = 0;
+};
+
+// Number of paths in flight for wavefront path tracing, and number of rays
+// in each chunk of the intersect stages.
+const auto trace_wavefront_size  = 1 << 16;
+const auto trace_wavefront_chunk = 64;
+
+// Sort paths by key with a stable radix sort, keeping the queue order for
+// equal keys.
+template <typename Key>
+static void sort_paths(
+    vector<int>& queue, const trace_params& params, Key&& key) {
+  auto keys = vector<pair<uint64_t, int>>(queue.size());
+  for (auto idx : range(queue.size())) keys[idx] = {key(queue[idx]), queue[idx]};
+  sort_ray_keys(keys, params.noparallel);
+  for (auto idx : range(queue.size())) queue[idx] = keys[idx].second;
+}
+
+// Sort paths for ray coherence.
+static void sort_paths_by_ray(vector<int>& queue,
+    const vector<trace_wavefront_path>& paths, bool shadow,
+    const trace_params& params) {
+  auto bounds = invalidb3f;
+  for (auto idx : queue) {
+    bounds = merge(bounds, shadow ? paths[idx].shadow_ray.o : paths[idx].ray.o);
+  }
+  sort_paths(queue, params, [&](int idx) {
+    return ray_sort_key(shadow ? paths[idx].shadow_ray : paths[idx].ray, bounds);
+  });
+}
+
+// Sort paths by material type, then by material, so that shading the same
+// kind of material runs together. Misses are sorted first. Keys are dense,
+// so that the radix sort needs few passes.
+static void sort_paths_by_material(vector<int>& queue,
+    const vector<trace_wavefront_path>& paths, const scene_data& scene,
+    const trace_params& params) {
+  auto num_materials = (uint64_t)scene.materials.size();
+  sort_paths(queue, params, [&](int idx) {
+    auto& intersection = paths[idx].intersection;
+    if (!intersection.hit) return (uint64_t)0;
+    auto  material_id = scene.instances[intersection.instance].material;
+    auto& material    = scene.materials[material_id];
+    return ((uint64_t)material.type + 1) * num_materials +
+           (uint64_t)material_id;
+  });
+}
+
+// Run a wavefront stage on the paths in the queue.
+template <typename Func>
+static void run_wavefront_stage(
+    const vector<int>& queue, const trace_params& params, Func&& func) {
+  if (params.noparallel) {
+    for (auto idx : queue) func(idx);
+  } else {
+    parallel_for(queue.size(), [&](size_t idx) { func(queue[idx]); });
+  }
+}
+
+// Shade stage for wavefront path tracing. This follows trace_pathdirect
+// exactly, but defers tracing of the light connection to the shadow stage.
+static void shade_wavefront_path(trace_wavefront_path& path,
+    const scene_data& scene, const trace_bvh& bvh, const trace_lights& lights,
+    rng_state& rng, const trace_params& params) {
+  auto& ray          = path.ray;
+  auto& weight       = path.weight;
+  auto  intersection = path.intersection;
+
+  // environment
+  if (!intersection.hit) {
+    if ((path.bounce > 0 || !params.envhidden) && path.next_emission)
+      path.radiance += weight * eval_environment(scene, ray.d);
+    path.active = false;
+    return;
+  }
+
+  // handle transmission if inside a volume
+  auto in_volume = false;
+  if (path.in_medium) {
+    auto& vsdf     = path.medium;
+    auto  distance = sample_transmittance(
+        vsdf.density, intersection.distance, rand1f(rng), rand1f(rng));
+    weight *= eval_transmittance(vsdf.density, distance) /
+              sample_transmittance_pdf(
+                  vsdf.density, distance, intersection.distance);
+    in_volume             = distance < intersection.distance;
+    intersection.distance = distance;
+  }
+
+  // switch between surface and volume
+  if (!in_volume) {
+    // prepare shading point
+    auto outgoing = -ray.d;
+    auto position = eval_shading_position(scene, intersection, outgoing);
+    auto normal   = eval_shading_normal(scene, intersection, outgoing);
+    auto material = eval_material(scene, intersection);
+
+    // correct roughness
+    if (params.nocaustics) {
+      path.max_roughness = max(material.roughness, path.max_roughness);
+      material.roughness = path.max_roughness;
+    }
+
+    // handle opacity
+    if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
+      if (path.opbounce++ > 128) {
+        path.active = false;
+        return;
+      }
+      ray = {position + ray.d * 1e-2f, ray.d};
+      return;
+    }
+
+    // set hit variables
+    if (path.bounce == 0) {
+      path.hit        = true;
+      path.hit_albedo = material.color;
+      path.hit_normal = normal;
+    }
+
+    // accumulate emission
+    if (path.next_emission)
+      path.radiance += weight * eval_emission(material, normal, outgoing);
+
+    // direct, traced in the shadow stage
+    if (!is_delta(material)) {
+      auto [incoming, distance] = sample_lights_distance(
+          scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
+      auto bsdfcos = eval_bsdfcos(material, normal, outgoing, incoming);
+      if (incoming != vec3f{0, 0, 0} && bsdfcos != vec3f{0, 0, 0}) {
+        path.shadow          = true;
+        path.shadow_ray      = {position, incoming};
+        path.shadow_weight   = weight * bsdfcos;
+        path.shadow_distance = distance;
+      }
+      path.next_emission = false;
+    } else {
+      path.next_emission = true;
+    }
+
+    // next direction
+    auto incoming = vec3f{0, 0, 0};
+    if (!is_delta(material)) {
+      if (rand1f(rng) < 0.5f) {
+        incoming = sample_bsdfcos(
+            material, normal, outgoing, rand1f(rng), rand2f(rng));
+      } else {
+        incoming = sample_lights(
+            scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
+      }
+      if (incoming == vec3f{0, 0, 0}) {
+        path.active = false;
+        return;
+      }
+      weight *=
+          eval_bsdfcos(material, normal, outgoing, incoming) /
+          (0.5f * sample_bsdfcos_pdf(material, normal, outgoing, incoming) +
+              0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+    } else {
+      incoming = sample_delta(material, normal, outgoing, rand1f(rng));
+      if (incoming == vec3f{0, 0, 0}) {
+        path.active = false;
+        return;
+      }
+      weight *= eval_delta(material, normal, outgoing, incoming) /
+                sample_delta_pdf(material, normal, outgoing, incoming);
+    }
+
+    // update volume stack
+    if (is_volumetric(scene, intersection) &&
+        dot(normal, outgoing) * dot(normal, incoming) < 0) {
+      if (!path.in_medium) {
+        path.in_medium = true;
+        path.medium    = eval_material(scene, intersection);
+      } else {
+        path.in_medium = false;
+      }
+    }
+
+    // setup next iteration
+    ray = {position, incoming};
+  } else {
+    // prepare shading point
+    auto  outgoing = -ray.d;
+    auto  position = ray.o + ray.d * intersection.distance;
+    auto& vsdf     = path.medium;
+
+    // next direction
+    auto incoming = vec3f{0, 0, 0};
+    if (rand1f(rng) < 0.5f) {
+      incoming = sample_scattering(vsdf, outgoing, rand1f(rng), rand2f(rng));
+    } else {
+      incoming = sample_lights(
+          scene, lights, position, rand2f(rng), rand2f(rng), rand2f(rng));
+    }
+    if (incoming == vec3f{0, 0, 0}) {
+      path.active = false;
+      return;
+    }
+    weight *=
+        eval_scattering(vsdf, outgoing, incoming) /
+        (0.5f * sample_scattering_pdf(vsdf, outgoing, incoming) +
+            0.5f * sample_lights_pdf(scene, bvh, lights, position, incoming));
+
+    // setup next iteration
+    ray = {position, incoming};
+  }
+
+  // check weight
+  if (weight == vec3f{0, 0, 0} || !isfinite(weight)) {
+    path.active = false;
+    return;
+  }
+
+  // russian roulette
+  if (path.bounce > 3) {
+    auto rr_prob = min((float)0.99, max(weight));
+    if (rand1f(rng) >= rr_prob) {
+      path.active = false;
+      return;
+    }
+    weight *= 1 / rr_prob;
+  }
+
+  // next bounce
+  path.bounce += 1;
+  if (path.bounce >= params.bounces) path.active = false;
+}
+
+// Intersect stage for wavefront path tracing. Sorted rays are traced in
+// packets, grouping consecutive rays in the queue.
+static void intersect_wavefront_paths(const vector<int>& queue,
+    vector<trace_wavefront_path>& paths, const scene_data& scene,
+    const trace_bvh& bvh, bool shadow, const trace_params& params) {
+  auto nchunks = ((int)queue.size() + trace_wavefront_chunk - 1) /
+                 trace_wavefront_chunk;
+  auto chunks  = vector<int>(nchunks);
+  for (auto chunk : range(nchunks)) chunks[chunk] = chunk;
+  run_wavefront_stage(chunks, params, [&](int chunk) {
+    auto start = chunk * trace_wavefront_chunk;
+    auto end   = min(start + trace_wavefront_chunk, (int)queue.size());
+    auto rays  = vector<ray3f>(end - start);
+    for (auto idx : range(start, end)) {
+      auto& path        = paths[queue[idx]];
+      rays[idx - start] = shadow ? path.shadow_ray : path.ray;
+    }
+    auto intersections = intersect_scene(bvh, scene, rays);
+    for (auto idx : range(start, end)) {
+      paths[queue[idx]].intersection = intersections[idx - start];
+    }
+  });
+}
+
+// Shadow stage for wavefront path tracing. Adds the emission of the sampled
+// light point, if the intersection of the shadow ray shows it is visible.
+static void shadow_wavefront_path(trace_wavefront_path& path,
+    const scene_data& scene, const trace_lights& lights) {
+  auto& incoming     = path.shadow_ray.d;
+  auto& intersection = path.intersection;
+  path.shadow        = false;
+  if (!is_light_visible(intersection, path.shadow_distance)) return;
+  auto pdf = sample_lights_pdf(
+      scene, lights, path.shadow_ray.o, incoming, intersection);
+  if (pdf == 0) return;
+  auto emission =
+      !intersection.hit
+          ? eval_environment(scene, incoming)
+          : eval_emission(eval_material(scene,
+                              scene.instances[intersection.instance],
+                              intersection.element, intersection.uv),
+                eval_shading_normal(scene,
+                    scene.instances[intersection.instance],
+                    intersection.element, intersection.uv, -incoming),
+                -incoming);
+  path.radiance += path.shadow_weight * emission / pdf;
+}
+
+// Wavefront path tracing of one sample for a range of pixels. Paths are
+// processed in stages, and queues are sorted between stages for coherence.
+// The estimator and random sequence match trace_pathdirect, so results are
+// the same as the pathdirect sampler.
+static void trace_wavefront(trace_state& state, const scene_data& scene,
+    const trace_bvh& bvh, const trace_lights& lights, int sample, int start,
+    int end, vector<trace_wavefront_path>& paths, const trace_params& params,
+    const std::atomic<bool>* stop = nullptr) {
+  auto& camera = scene.cameras[params.camera];
+  auto  width  = state.render.size().x;
+
+  // generate
+  paths.resize(end - start);
+  auto queue = vector<int>(end - start);
+  for (auto idx : range(end - start)) queue[idx] = (int)idx;
+  run_wavefront_stage(queue, params, [&](int idx) {
+    auto& path      = paths[idx];
+    auto  ij        = vec2i{(start + idx) % width, (start + idx) / width};
+    auto& rng       = state.rngs[ij];
+    path            = trace_wavefront_path{};
+    path.ij         = ij;
+    path.camera_ray = sample_camera(camera, ij, state.render.size(),
+        rand2f(rng), rand2f(rng), params.tentfilter);
+    path.ray        = path.camera_ray;
+    if (params.bounces <= 0) path.active = false;
+  });
+  if (params.bounces <= 0) queue.clear();
+
+  // bounce
+  auto shadow_queue = vector<int>{};
+  while (!queue.empty()) {
+    if (stop && *stop) return;
+
+    // intersect
+    sort_paths_by_ray(queue, paths, false, params);
+    intersect_wavefront_paths(queue, paths, scene, bvh, false, params);
+
+    // shade
+    sort_paths_by_material(queue, paths, scene, params);
+    run_wavefront_stage(queue, params, [&](int idx) {
+      auto& path = paths[idx];
+      shade_wavefront_path(
+          path, scene, bvh, lights, state.rngs[path.ij], params);
+    });
+
+    // shadow
+    shadow_queue.clear();
+    for (auto idx : queue) {
+      if (paths[idx].shadow) shadow_queue.push_back(idx);
+    }
+    sort_paths_by_ray(shadow_queue, paths, true, params);
+    intersect_wavefront_paths(shadow_queue, paths, scene, bvh, true, params);
+    run_wavefront_stage(shadow_queue, params, [&](int idx) {
+      shadow_wavefront_path(paths[idx], scene, lights);
+    });
+
+    // compact
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                    [&](int idx) { return !paths[idx].active; }),
+        queue.end());
+  }
+
+  // accumulate
+  for (auto& path : paths) {
+    accumulate_sample(state, scene, path.ij, sample,
+        {path.radiance, path.hit, path.hit_albedo, path.hit_normal},
+        path.camera_ray, params);
+  }
+}
+
+// Wavefront path tracing of a batch of samples for the whole image.
+static void trace_wavefront(trace_state& state, const scene_data& scene,
+    const trace_bvh& bvh, const trace_lights& lights,
+    const trace_params& params, const std::atomic<bool>* stop = nullptr) {
+  auto npixels = state.render.size().x * state.render.size().y;
+  auto paths   = vector<trace_wavefront_path>{};
+  for (auto sample : range(state.samples, state.samples + params.batch)) {
+    for (auto start = 0; start < npixels; start += trace_wavefront_size) {
+      if (stop && *stop) return;
+      auto end = min(start + trace_wavefront_size, npixels);
+      trace_wavefront(state, scene, bvh, lights, sample, start, end, paths,
+          params, stop);
+    }
+  }
+}
+
 // Init a sequence of random number generators.
+// Image size of a render
+static vec2i get_trace_resolution(
+    const scene_data& scene, const trace_params& params) {
+  auto& camera = scene.cameras[params.camera];
+  return (camera.aspect >= 1)
+             ? vec2i{params.resolution,
+                   (int)round(params.resolution / camera.aspect)}
+             : vec2i{(int)round(params.resolution * camera.aspect),
+                   params.resolution};
+}
+
 trace_state make_trace_state(
     const scene_data& scene, const trace_params& params) {
-  auto& camera     = scene.cameras[params.camera];
-  auto  state      = trace_state{};
-  auto  resolution = (camera.aspect >= 1)
-                         ? vec2i{params.resolution,
-                              (int)round(params.resolution / camera.aspect)}
-                         : vec2i{(int)round(params.resolution * camera.aspect),
-                              params.resolution};
+  auto state       = trace_state{};
+  auto resolution  = get_trace_resolution(scene, params);
   state.samples    = 0;
   state.render     = image<vec4f>{resolution};
   state.albedo     = image<vec3f>{resolution};
@@ -1535,6 +2344,12 @@ trace_state make_trace_state(
   if (params.denoise) {
     state.denoised = image<vec4f>{resolution};
   }
+  if (is_trace_adaptive(params)) {
+    auto tile_size = get_adaptive_tilesize(params);
+    state.moments  = image<float>{resolution};
+    state.errors   = image<float>{(resolution + tile_size - 1) / tile_size};
+    for (auto& error : state.errors) error = flt_max;
+  }
   return state;
 }
 
@@ -1543,10 +2358,200 @@ static trace_light& add_light(trace_lights& lights) {
   return lights.lights.emplace_back();
 }
 
+// Merge the bounds of two light tree nodes. Normal cones are merged after
+// flipping the second axis toward the first one, since emission is two-sided.
+static trace_light_node merge_light_nodes(
+    const trace_light_node& node1, const trace_light_node& node2) {
+  if (node1.power == 0) return node2;
+  if (node2.power == 0) return node1;
+  auto node   = trace_light_node{};
+  node.bbox   = merge(node1.bbox, node2.bbox);
+  node.power  = node1.power + node2.power;
+  auto axis1  = node1.axis;
+  auto axis2  = dot(node1.axis, node2.axis) >= 0 ? node2.axis : -node2.axis;
+  auto theta1 = acos(clamp(node1.cosine, -1.0f, 1.0f));
+  auto theta2 = acos(clamp(node2.cosine, -1.0f, 1.0f));
+  auto thetad = angle(axis1, axis2);
+  if (min(thetad + theta2, pif) <= theta1) {
+    node.axis   = axis1;
+    node.cosine = node1.cosine;
+  } else if (min(thetad + theta1, pif) <= theta2) {
+    node.axis   = axis2;
+    node.cosine = node2.cosine;
+  } else {
+    auto theta = (theta1 + thetad + theta2) / 2;
+    auto axisr = cross(axis1, axis2);
+    if (theta >= pif || axisr == vec3f{0, 0, 0}) {
+      node.axis   = axis1;
+      node.cosine = -1;
+    } else {
+      node.axis = transform_direction(
+          rotation_frame(axisr, theta - theta1), axis1);
+      node.cosine = cos(theta);
+    }
+  }
+  return node;
+}
+
+// Cost of a light tree node, as the product of its power, the solid angle
+// of emission of its normal cone and its surface area. The last term is
+// scaled to penalize thin nodes along the split axis.
+static float eval_light_cost(const trace_light_node& node, float scale) {
+  if (node.power == 0) return 0;
+  auto theta_o = acos(clamp(node.cosine, -1.0f, 1.0f));
+  auto theta_w = min(theta_o + pif / 2, pif);
+  auto sin_o   = sin(theta_o);
+  auto omega   = 2 * pif * (1 - node.cosine) +
+               pif / 2 *
+                   (2 * theta_w * sin_o - cos(theta_o - 2 * theta_w) -
+                       2 * theta_o * sin_o + node.cosine);
+  auto size = node.bbox.max - node.bbox.min;
+  auto area = 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+  return node.power * omega * area * scale;
+}
+
+// Split the light tree elements in [start, end) with a binned heuristic over
+// the node cost, falling back to a median split. Deep nodes are always split
+// at the median to bound the tree depth.
+static int split_light_nodes(vector<trace_light_node>& elements, int start,
+    int end, const trace_light_node& node, int depth) {
+  // centroid bounds
+  auto cbbox = invalidb3f;
+  for (auto idx : range(start, end))
+    cbbox = merge(cbbox, center(elements[idx].bbox));
+  auto csize = cbbox.max - cbbox.min;
+  auto nsize = node.bbox.max - node.bbox.min;
+  if (csize == vec3f{0, 0, 0}) return (start + end) / 2;
+
+  // binned split
+  const auto nbins     = 12;
+  auto       best_cost = flt_max;
+  auto       best_axis = -1;
+  auto       best_bin  = 0;
+  auto       bin_of    = [&](const trace_light_node& element, int axis) {
+    auto offset = (center(element.bbox)[axis] - cbbox.min[axis]) / csize[axis];
+    return clamp((int)(offset * nbins), 0, nbins - 1);
+  };
+  if (depth < 32) {
+    for (auto axis : range(3)) {
+      if (csize[axis] == 0) continue;
+      auto bins   = array<trace_light_node, nbins>{};
+      auto counts = array<int, nbins>{};
+      for (auto idx : range(start, end)) {
+        auto bin  = bin_of(elements[idx], axis);
+        bins[bin] = merge_light_nodes(bins[bin], elements[idx]);
+        counts[bin] += 1;
+      }
+      auto scale  = max(nsize) / max(nsize[axis], flt_eps);
+      auto rights = array<trace_light_node, nbins>{};
+      for (auto bin = nbins - 1; bin > 0; bin--) {
+        rights[bin] = merge_light_nodes(
+            bin < nbins - 1 ? rights[bin + 1] : trace_light_node{}, bins[bin]);
+      }
+      auto left   = trace_light_node{};
+      auto lcount = 0;
+      for (auto bin = 1; bin < nbins; bin++) {
+        left = merge_light_nodes(left, bins[bin - 1]);
+        lcount += counts[bin - 1];
+        if (lcount == 0 || lcount == end - start) continue;
+        auto cost = eval_light_cost(left, scale) +
+                    eval_light_cost(rights[bin], scale);
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin  = bin;
+        }
+      }
+    }
+  }
+  if (best_axis >= 0) {
+    auto middle = std::partition(elements.data() + start,
+        elements.data() + end, [&](const trace_light_node& element) {
+          return bin_of(element, best_axis) < best_bin;
+        });
+    return (int)(middle - elements.data());
+  }
+
+  // median split
+  auto axis   = csize.x >= csize.y && csize.x >= csize.z ? 0
+                : csize.y >= csize.z                     ? 1
+                                                         : 2;
+  auto middle = (start + end) / 2;
+  std::nth_element(elements.data() + start, elements.data() + middle,
+      elements.data() + end,
+      [axis](const trace_light_node& a, const trace_light_node& b) {
+        return center(a.bbox)[axis] < center(b.bbox)[axis];
+      });
+  return middle;
+}
+
+// Build a light tree over the elements of instance lights, bounding their
+// world-space positions, normals and power.
+static void make_light_tree(const scene_data& scene, trace_lights& lights) {
+  // light elements
+  auto elements = vector<trace_light_node>{};
+  for (auto light_id : range((int)lights.lights.size())) {
+    auto& light = lights.lights[light_id];
+    if (light.instance == invalidid) continue;
+    auto& instance = scene.instances[light.instance];
+    auto& shape    = scene.shapes[instance.shape];
+    auto  emission = mean(scene.materials[instance.material].emission);
+    auto  nelements = max(shape.triangles.size(), shape.quads.size());
+    for (auto element : range((int)nelements)) {
+      auto q  = vec4i{0, 0, 0, 0};
+      if (!shape.triangles.empty()) {
+        auto& t = shape.triangles[element];
+        q       = {t.x, t.y, t.z, t.z};
+      } else {
+        q = shape.quads[element];
+      }
+      auto p0 = transform_point(instance.frame, shape.positions[q.x]);
+      auto p1 = transform_point(instance.frame, shape.positions[q.y]);
+      auto p2 = transform_point(instance.frame, shape.positions[q.z]);
+      auto p3 = transform_point(instance.frame, shape.positions[q.w]);
+      auto area = quad_area(p0, p1, p2, p3);
+      if (area == 0 || emission <= 0) continue;
+      auto& node   = elements.emplace_back();
+      node.bbox    = merge(merge(merge(merge(invalidb3f, p0), p1), p2), p3);
+      node.axis    = quad_normal(p0, p1, p2, p3);
+      node.cosine  = 1;
+      node.power   = emission * area * pif;
+      node.light   = light_id;
+      node.element = element;
+    }
+  }
+  if (elements.empty()) return;
+
+  // build nodes top-down, storing children next to each other
+  lights.nodes.reserve(elements.size() * 2 - 1);
+  lights.nodes.emplace_back();
+  auto queue = vector<vec4i>{{0, 0, (int)elements.size(), 0}};
+  while (!queue.empty()) {
+    auto [node_id, start, end, depth] = queue.back();
+    queue.pop_back();
+    if (end - start == 1) {
+      lights.nodes[node_id] = elements[start];
+      continue;
+    }
+    auto node = trace_light_node{};
+    for (auto idx : range(start, end))
+      node = merge_light_nodes(node, elements[idx]);
+    auto middle = split_light_nodes(elements, start, end, node, depth);
+    node.start  = (int)lights.nodes.size();
+    lights.nodes[node_id] = node;
+    lights.nodes.emplace_back();
+    lights.nodes.emplace_back();
+    queue.push_back({node.start + 0, start, middle, depth + 1});
+    queue.push_back({node.start + 1, middle, end, depth + 1});
+  }
+}
+
 // Init trace lights
 trace_lights make_trace_lights(
     const scene_data& scene, const trace_params& params) {
-  auto lights = trace_lights{};
+  auto lights      = trace_lights{};
+  auto powers      = vector<float>{};
+  lights.instances = vector<int>(scene.instances.size(), invalidid);
 
   for (auto handle : range(scene.instances.size())) {
     auto& instance = scene.instances[handle];
@@ -1554,48 +2559,104 @@ trace_lights make_trace_lights(
     if (material.emission == vec3f{0, 0, 0}) continue;
     auto& shape = scene.shapes[instance.shape];
     if (shape.triangles.empty() && shape.quads.empty()) continue;
-    auto& light       = add_light(lights);
-    light.instance    = (int)handle;
-    light.environment = invalidid;
+    lights.instances[handle] = (int)lights.lights.size();
+    auto& light              = add_light(lights);
+    light.instance           = (int)handle;
+    light.environment        = invalidid;
+    // element areas are computed in world space, since the pdf uses them
+    auto areas = vector<float>{};
     if (!shape.triangles.empty()) {
-      light.elements_cdf = vector<float>(shape.triangles.size());
-      for (auto idx : range(light.elements_cdf.size())) {
-        auto& t                 = shape.triangles[idx];
-        light.elements_cdf[idx] = triangle_area(
-            shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
-        if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
+      areas = vector<float>(shape.triangles.size());
+      for (auto idx : range(areas.size())) {
+        auto& t    = shape.triangles[idx];
+        areas[idx] = triangle_area(
+            transform_point(instance.frame, shape.positions[t.x]),
+            transform_point(instance.frame, shape.positions[t.y]),
+            transform_point(instance.frame, shape.positions[t.z]));
       }
     }
     if (!shape.quads.empty()) {
-      light.elements_cdf = vector<float>(shape.quads.size());
-      for (auto idx : range(light.elements_cdf.size())) {
-        auto& t                 = shape.quads[idx];
-        light.elements_cdf[idx] = quad_area(shape.positions[t.x],
-            shape.positions[t.y], shape.positions[t.z], shape.positions[t.w]);
-        if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
+      areas = vector<float>(shape.quads.size());
+      for (auto idx : range(areas.size())) {
+        auto& q    = shape.quads[idx];
+        areas[idx] = quad_area(
+            transform_point(instance.frame, shape.positions[q.x]),
+            transform_point(instance.frame, shape.positions[q.y]),
+            transform_point(instance.frame, shape.positions[q.z]),
+            transform_point(instance.frame, shape.positions[q.w]));
       }
     }
+    light.elements_cdf = vector<float>(areas.size());
+    for (auto idx : range(areas.size())) {
+      light.elements_cdf[idx] = areas[idx];
+      if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
+    }
+    light.elements_alias = sample_alias_table(areas);
+    // emission is two-sided
+    powers.push_back(2 * pif * mean(material.emission) *
+                     light.elements_cdf.back());
   }
+
+  // environments are weighted by the power they send through the scene
+  auto bounds = compute_bounds(scene);
+  auto radius = bounds.min.x <= bounds.max.x
+                    ? length(bounds.max - bounds.min) / 2
+                    : 1.0f;
   for (auto handle : range(scene.environments.size())) {
     auto& environment = scene.environments[handle];
     if (environment.emission == vec3f{0, 0, 0}) continue;
     auto& light       = add_light(lights);
     light.instance    = invalidid;
     light.environment = (int)handle;
+    auto integral     = 4 * pif;
     if (environment.emission_tex != invalidid) {
-      auto& texture      = scene.textures[environment.emission_tex];
-      auto  size         = max(texture.pixelsf.size(), texture.pixelsb.size());
-      light.elements_cdf = vector<float>(size.x * size.y);
-      for (auto idx : range(light.elements_cdf.size())) {
-        auto ij                 = vec2i{(int)idx % size.x, (int)idx / size.x};
-        auto th                 = (ij.y + 0.5f) * pif / size.y;
-        auto value              = lookup_texture(texture, ij);
-        light.elements_cdf[idx] = max(value) * sin(th);
-        if (idx != 0) light.elements_cdf[idx] += light.elements_cdf[idx - 1];
+      auto& texture = scene.textures[environment.emission_tex];
+      auto  size    = max(texture.pixelsf.size(), texture.pixelsb.size());
+      // blocks of texels are weighted in parallel, by rows
+      auto block     = get_environment_block(size);
+      auto grid      = (size + block - 1) / block;
+      auto weights   = vector<float>((size_t)grid.x * (size_t)grid.y, 0);
+      auto integrals = vector<double>(grid.y, 0);
+      parallel_for(grid.y, [&](int row) {
+        for (auto j : range(row * block, min((row + 1) * block, size.y))) {
+          auto th = (j + 0.5f) * pif / size.y;
+          for (auto i : range(size.x)) {
+            auto value = xyz(lookup_texture(texture, {i, j}));
+            weights[row * grid.x + i / block] += max(value) * sin(th);
+            integrals[row] += mean(value) * sin(th);
+          }
+        }
+      });
+      integral = 0;
+      for (auto value : integrals) integral += (float)value;
+      integral *= (2 * pif / size.x) * (pif / size.y);
+      // the cdf is summed in double, since its total is used in the pdf
+      light.elements_cdf = vector<float>(weights.size());
+      auto sum           = 0.0;
+      for (auto idx : range(weights.size())) {
+        sum += weights[idx];
+        light.elements_cdf[idx] = (float)sum;
       }
+      light.elements_alias   = sample_alias_table(weights);
+      light.elements_weights = std::move(weights);
     }
+    // flux through the scene cross section
+    powers.push_back(
+        pif * radius * radius * mean(environment.emission) * integral / 4);
   }
 
+  // select lights by power
+  auto total = 0.0;
+  for (auto power : powers) total += power;
+  for (auto idx : range(lights.lights.size())) {
+    lights.lights[idx].pdf = total > 0 ? (float)(powers[idx] / total)
+                                       : 1.0f / lights.lights.size();
+  }
+  lights.lights_alias = sample_alias_table(powers);
+
+  // light tree
+  if (params.lighttree) make_light_tree(scene, lights);
+
   // handle progress
   return lights;
 }
@@ -1619,12 +2680,13 @@ image<vec4f> trace_image(const scene_data& scene, trace_sampler_type type,
 
 // Progressively computes an image.
 image<vec4f> trace_image(const scene_data& scene, const trace_params& params) {
-  auto bvh    = make_trace_bvh(scene, params);
-  auto lights = make_trace_lights(scene, params);
-  auto state  = make_trace_state(scene, params);
-  for (auto sample = 0; sample < params.samples; sample++) {
-    trace_samples(state, scene, bvh, lights, params);
-  }
+  auto start   = std::chrono::steady_clock::now();
+  auto bvh     = make_trace_bvh(scene, params);
+  auto lights  = make_trace_lights(scene, params);
+  auto state   = make_trace_state(scene, params);
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  trace_budgeted(state, scene, bvh, lights, params, elapsed.count());
   return get_image(state);
 }
 
@@ -1632,15 +2694,19 @@ image<vec4f> trace_image(const scene_data& scene, const trace_params& params) {
 void trace_samples(trace_state& state, const scene_data& scene,
     const trace_bvh& bvh, const trace_lights& lights,
     const trace_params& params) {
-  if (state.samples >= params.samples) return;
-  if (params.noparallel) {
+  if (is_trace_converged(state, params)) return;
+  if (params.sampler == trace_sampler_type::wavefront) {
+    trace_wavefront(state, scene, bvh, lights, params);
+  } else if (!state.errors.empty()) {
+    trace_adaptive(state, scene, bvh, lights, params);
+  } else if (params.noparallel) {
     for (auto ij : range(state.render.size())) {
       for (auto sample : range(state.samples, state.samples + params.batch)) {
         trace_sample(state, scene, bvh, lights, ij, sample, params);
       }
     }
   } else {
-    parallel_for_batch(state.render.size(), [&](vec2i ij) {
+    parallel_for_tiles(state.render.size(), params.tilesize, [&](vec2i ij) {
       for (auto sample : range(state.samples, state.samples + params.batch)) {
         trace_sample(state, scene, bvh, lights, ij, sample, params);
       }
@@ -1652,6 +2718,69 @@ void trace_samples(trace_state& state, const scene_data& scene,
   }
 }
 
+// Check whether all samples are done, or all tiles have converged for
+// adaptive sampling.
+bool is_trace_converged(const trace_state& state, const trace_params& params) {
+  if (state.samples >= params.samples) return true;
+  for (auto error : state.errors) {
+    if (!is_tile_converged(state, error, params)) return false;
+  }
+  return !state.errors.empty();
+}
+
+// Progressively computes an image in batches until converged, or until the
+// time budget is spent.
+void trace_budgeted(trace_state& state, const scene_data& scene,
+    const trace_bvh& bvh, const trace_lights& lights,
+    const trace_params& params, double elapsed,
+    const function<void(const trace_state&, int)>& progress) {
+  // seconds spent, including the ones before
+  auto start   = std::chrono::steady_clock::now();
+  auto seconds = [&]() {
+    return elapsed + std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  };
+
+  // with a time budget, batches start from one sample and are resized
+  // after each one, while denoising is done only once at the end
+  auto bparams = params;
+  if (params.timebudget > 0) {
+    bparams.batch   = 1;
+    bparams.denoise = false;
+  }
+  auto denoise = params.denoise && !state.denoised.empty();
+
+  // render
+  auto denoise_time = 0.0;
+  for (auto batch = 0; !is_trace_converged(state, bparams); batch++) {
+    auto batch_start = seconds();
+    trace_samples(state, scene, bvh, lights, bparams);
+    auto sample_time = (seconds() - batch_start) / bparams.batch;
+    if (progress) progress(state, batch);
+    if (params.timebudget <= 0) continue;
+
+    // measure the denoiser once, since it runs before the deadline
+    if (denoise && denoise_time == 0) {
+      auto denoise_start = seconds();
+      denoise_image(state.denoised, state.render, state.albedo, state.normal);
+      denoise_time = seconds() - denoise_start;
+    }
+
+    // keep 5% of the budget for saving, and fill half of the remaining time,
+    // so that batches shrink as the deadline approaches
+    auto remaining = params.timebudget * 0.95 - seconds() - denoise_time;
+    if (remaining < sample_time) break;
+    bparams.batch = clamp((int)(remaining / 2 / sample_time), 1,
+        params.samples - state.samples);
+  }
+
+  // denoise
+  if (params.timebudget > 0 && denoise) {
+    denoise_image(state.denoised, state.render, state.albedo, state.normal);
+  }
+}
+
 // Trace context
 trace_context make_trace_context(const trace_params& params) {
   return {{}, false, false};
@@ -1661,17 +2790,23 @@ trace_context make_trace_context(const trace_params& params) {
 void trace_start(trace_context& context, trace_state& state,
     const scene_data& scene, const trace_bvh& bvh, const trace_lights& lights,
     const trace_params& params) {
-  if (state.samples >= params.samples) return;
+  if (is_trace_converged(state, params)) return;
   context.stop   = false;
   context.done   = false;
   context.worker = std::async(std::launch::async, [&]() {
     if (context.stop) return;
-    parallel_for_batch(state.render.size(), [&](vec2i ij) {
-      for (auto sample : range(state.samples, state.samples + params.batch)) {
-        if (context.stop) return;
-        trace_sample(state, scene, bvh, lights, ij, sample, params);
-      }
-    });
+    if (params.sampler == trace_sampler_type::wavefront) {
+      trace_wavefront(state, scene, bvh, lights, params, &context.stop);
+    } else if (!state.errors.empty()) {
+      trace_adaptive(state, scene, bvh, lights, params, &context.stop);
+    } else {
+      parallel_for_tiles(state.render.size(), params.tilesize, [&](vec2i ij) {
+        for (auto sample : range(state.samples, state.samples + params.batch)) {
+          if (context.stop) return;
+          trace_sample(state, scene, bvh, lights, ij, sample, params);
+        }
+      });
+    }
     state.samples += params.batch;
     if (context.stop) return;
     if (params.denoise && !state.denoised.empty()) {
@@ -1851,3 +2986,195 @@ void denoise_image(image<vec4f>& denoised, const image<vec4f>& render,
 }
 
 }  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// TRACE STATE CHECKPOINTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Header of trace state files, storing the sizes of the state data to check
+// the memory layout, and the hash of the scene and params used to render.
+struct trace_state_header {
+  array<char, 8> magic    = {'Y', 'T', 'S', 'T', 'A', 'T', 'E', '1'};
+  uint64_t       version  = 2;
+  uint64_t       rng_size = sizeof(rng_state);
+  uint64_t       hash     = 0;
+  int64_t        samples  = 0;
+};
+
+// Hash of a buffer, using FNV-1a on 64-bit words for speed, with a shift
+// that mixes high bits back into low bits.
+static uint64_t hash_state_data(uint64_t hash, const void* data, size_t size) {
+  auto bytes = (const unsigned char*)data;
+  auto words = size / sizeof(uint64_t);
+  for (auto idx = (size_t)0; idx < words; idx++) {
+    auto word = (uint64_t)0;
+    std::memcpy(&word, bytes + idx * sizeof(uint64_t), sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ull;
+    hash ^= hash >> 32;
+  }
+  for (auto idx = words * sizeof(uint64_t); idx < size; idx++) {
+    hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+template <typename T>
+static uint64_t hash_state_data(uint64_t hash, const vector<T>& values) {
+  auto size = (uint64_t)values.size();
+  hash      = hash_state_data(hash, &size, sizeof(size));
+  return hash_state_data(hash, values.data(), values.size() * sizeof(T));
+}
+template <typename T>
+static uint64_t hash_state_data(uint64_t hash, const image<T>& values) {
+  auto size = values.size();
+  hash      = hash_state_data(hash, &size, sizeof(size));
+  return hash_state_data(
+      hash, values.data(), (size_t)size.x * (size_t)size.y * sizeof(T));
+}
+
+// Hash of the scene and of the params that change the rendered samples.
+// The number of samples and the bvh options are not included, so that
+// renders can be extended with more samples.
+static uint64_t hash_trace_state(
+    const scene_data& scene, const trace_params& params) {
+  auto hash = 0xcbf29ce484222325ull;
+  for (auto& camera : scene.cameras) {
+    auto values = array<float, 6>{(float)camera.orthographic, camera.lens,
+        camera.film, camera.aspect, camera.focus, camera.aperture};
+    hash = hash_state_data(hash, &camera.frame, sizeof(camera.frame));
+    hash = hash_state_data(hash, values.data(), sizeof(values));
+  }
+  // instances, environments and materials have no padding
+  hash = hash_state_data(hash, scene.instances);
+  hash = hash_state_data(hash, scene.environments);
+  hash = hash_state_data(hash, scene.materials);
+  for (auto& shape : scene.shapes) {
+    hash = hash_state_data(hash, shape.points);
+    hash = hash_state_data(hash, shape.lines);
+    hash = hash_state_data(hash, shape.triangles);
+    hash = hash_state_data(hash, shape.quads);
+    hash = hash_state_data(hash, shape.positions);
+    hash = hash_state_data(hash, shape.normals);
+    hash = hash_state_data(hash, shape.texcoords);
+    hash = hash_state_data(hash, shape.colors);
+    hash = hash_state_data(hash, shape.radius);
+    hash = hash_state_data(hash, shape.tangents);
+  }
+  for (auto& texture : scene.textures) {
+    auto values = array<int, 2>{(int)texture.nearest, (int)texture.clamp};
+    hash        = hash_state_data(hash, texture.pixelsf);
+    hash        = hash_state_data(hash, texture.pixelsb);
+    hash        = hash_state_data(hash, values.data(), sizeof(values));
+  }
+  auto options = array<float, 14>{(float)params.camera,
+      (float)params.resolution, (float)params.sampler,
+      (float)params.falsecolor, params.adaptive, (float)params.adaptivemin,
+      (float)params.bounces, params.clamp, (float)params.nocaustics,
+      (float)params.envhidden, (float)params.tentfilter,
+      (float)params.lighttree, (float)params.batch,
+      (float)get_adaptive_tilesize(params)};
+  hash = hash_state_data(hash, &params.seed, sizeof(params.seed));
+  return hash_state_data(hash, options.data(), sizeof(options));
+}
+
+// Write and read state images, as their size followed by their data
+template <typename T>
+static void write_state_image(FILE* fs, const image<T>& values) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  auto size = values.size();
+  auto data = (size_t)size.x * (size_t)size.y * sizeof(T);
+  if (fwrite(&size, sizeof(size), 1, fs) != 1)
+    throw std::runtime_error{"cannot write state"};
+  if (data && fwrite(values.data(), 1, data, fs) != data)
+    throw std::runtime_error{"cannot write state"};
+}
+template <typename T>
+static void read_state_image(FILE* fs, image<T>& values) {
+  auto size = vec2i{0, 0};
+  if (fread(&size, sizeof(size), 1, fs) != 1)
+    throw std::runtime_error{"cannot read state"};
+  if (size.x < 0 || size.y < 0 || (int64_t)size.x * size.y > (1 << 30))
+    throw std::runtime_error{"corrupted state"};
+  values    = image<T>{size};
+  auto data = (size_t)size.x * (size_t)size.y * sizeof(T);
+  if (data && fread(values.data(), 1, data, fs) != data)
+    throw std::runtime_error{"cannot read state"};
+}
+
+// Load a trace state
+trace_state load_trace_state(const string& filename, const scene_data& scene,
+    const trace_params& params) {
+  auto fs = fopen(filename.c_str(), "rb");
+  if (!fs) throw std::runtime_error{filename + ": file not found"};
+  try {
+    auto header = trace_state_header{};
+    auto check  = trace_state_header{};
+    if (fread(&header, sizeof(header), 1, fs) != 1)
+      throw std::runtime_error{"cannot read state"};
+    if (header.magic != check.magic || header.version != check.version ||
+        header.rng_size != check.rng_size)
+      throw std::runtime_error{"unsupported state"};
+    if (header.hash != hash_trace_state(scene, params))
+      throw std::runtime_error{"mismatched scene or params"};
+    if (header.samples < 0 || header.samples > int_max)
+      throw std::runtime_error{"corrupted state"};
+    auto state    = trace_state{};
+    state.samples = (int)header.samples;
+    read_state_image(fs, state.render);
+    read_state_image(fs, state.albedo);
+    read_state_image(fs, state.normal);
+    read_state_image(fs, state.hits);
+    read_state_image(fs, state.rngs);
+    read_state_image(fs, state.moments);
+    read_state_image(fs, state.errors);
+    fclose(fs);
+    fs = nullptr;
+    // check sizes against the ones of a new state
+    auto resolution = get_trace_resolution(scene, params);
+    auto tile_size  = get_adaptive_tilesize(params);
+    auto adaptive   = is_trace_adaptive(params);
+    if (state.render.size() != resolution ||
+        state.albedo.size() != resolution ||
+        state.normal.size() != resolution ||
+        state.hits.size() != resolution || state.rngs.size() != resolution ||
+        state.moments.size() != (adaptive ? resolution : vec2i{0, 0}) ||
+        state.errors.size() != (adaptive ? (resolution + tile_size - 1) /
+                                               tile_size
+                                         : vec2i{0, 0}))
+      throw std::runtime_error{"corrupted state"};
+    if (params.denoise) state.denoised = image<vec4f>{resolution};
+    return state;
+  } catch (const std::exception& error) {
+    if (fs) fclose(fs);
+    throw std::runtime_error{filename + ": " + error.what()};
+  }
+}
+
+// Save a trace state
+void save_trace_state(const string& filename, const trace_state& state,
+    const scene_data& scene, const trace_params& params) {
+  auto fs = fopen(filename.c_str(), "wb");
+  if (!fs) throw std::runtime_error{filename + ": cannot create file"};
+  try {
+    auto header    = trace_state_header{};
+    header.hash    = hash_trace_state(scene, params);
+    header.samples = state.samples;
+    if (fwrite(&header, sizeof(header), 1, fs) != 1)
+      throw std::runtime_error{"cannot write state"};
+    write_state_image(fs, state.render);
+    write_state_image(fs, state.albedo);
+    write_state_image(fs, state.normal);
+    write_state_image(fs, state.hits);
+    write_state_image(fs, state.rngs);
+    write_state_image(fs, state.moments);
+    write_state_image(fs, state.errors);
+    auto closed = fclose(fs) == 0;
+    fs          = nullptr;
+    if (!closed) throw std::runtime_error{"cannot write state"};
+  } catch (const std::exception& error) {
+    if (fs) fclose(fs);
+    throw std::runtime_error{filename + ": " + error.what()};
+  }
+}
+
+}  // namespace yocto
@@ -38,6 +38,7 @@
 // -----------------------------------------------------------------------------
 
 #include <atomic>
+#include <functional>
 #include <future>
 #include <memory>
 #include <string>
@@ -57,6 +58,7 @@
 namespace yocto {
 
 // using directives
+using std::function;
 using std::pair;
 using std::string;
 using std::vector;
@@ -79,6 +81,7 @@ enum struct trace_sampler_type {
   eyelight,       // eyelight rendering
   furnace,        // furnace test
   falsecolor,     // false color rendering
+  wavefront,      // wavefront path tracing with direct
 };
 // Type of false color visualization
 enum struct trace_falsecolor_type {
@@ -99,6 +102,8 @@ struct trace_params {
   trace_sampler_type    sampler        = trace_sampler_type::path;
   trace_falsecolor_type falsecolor     = trace_falsecolor_type::color;
   int                   samples        = 512;
+  float                 adaptive       = 0;
+  int                   adaptivemin    = 16;
   int                   bounces        = 8;
   float                 clamp          = 100;
   bool                  nocaustics     = false;
@@ -107,10 +112,18 @@ struct trace_params {
   uint64_t              seed           = trace_default_seed;
   bool                  embreebvh      = false;
   bool                  highqualitybvh = false;
+  bool                  widebvh        = false;
+  float                 spatialbvh     = 0;
+  bool                  compressedbvh  = false;
+  bool                  precomputedbvh = false;
+  bool                  lighttree      = false;
+  string                bvhcache       = "";
   bool                  noparallel     = false;
   int                   pratio         = 8;
   bool                  denoise        = false;
   int                   batch          = 1;
+  float                 timebudget     = 0;
+  int                   tilesize       = 16;
 };
 
 // Progressively computes an image.
@@ -136,15 +149,42 @@ inline image<vec4f> pathtrace_image(const scene_data& scene,
 namespace yocto {
 
 // Scene lights used during rendering. These are created automatically.
+// Lights are selected with probability `pdf`, proportional to their power,
+// and their elements are sampled with an alias table, or with `elements_cdf`
+// on the GPU. For environment textures, elements are blocks of texels, whose
+// size grows with the texture to keep the tables bounded, and
+// `elements_weights` stores the weight of each block.
 struct trace_light {
-  int           instance     = invalidid;
-  int           environment  = invalidid;
-  vector<float> elements_cdf = {};
+  int                      instance         = invalidid;
+  int                      environment      = invalidid;
+  float                    pdf              = 0;
+  vector<float>            elements_cdf     = {};
+  vector<pair<float, int>> elements_alias   = {};
+  vector<float>            elements_weights = {};
 };
 
-// Scene lights
+// Light tree node, bounding the positions, normals and power of emissive
+// elements. Internal nodes have children at `start` and `start + 1`, while
+// leaves store one element of a light. Normals are bounded by a cone around
+// `axis`, up to sign since emission is two-sided.
+struct trace_light_node {
+  bbox3f bbox    = invalidb3f;
+  vec3f  axis    = {0, 0, 1};
+  float  cosine  = 1;
+  float  power   = 0;
+  int    start   = invalidid;
+  int    light   = invalidid;
+  int    element = invalidid;
+};
+
+// Scene lights. The light tree, if built, holds the elements of instance
+// lights, that are stored before environment lights. For each scene
+// instance, `instances` stores its light index, or invalidid.
 struct trace_lights {
-  vector<trace_light> lights = {};
+  vector<trace_light>      lights       = {};
+  vector<pair<float, int>> lights_alias = {};
+  vector<trace_light_node> nodes        = {};
+  vector<int>              instances    = {};
 };
 
 // Trace Bvh, a wrapper of a Yocto/Bvh and an Embree one
@@ -156,7 +196,8 @@ struct trace_bvh {
 // Check is a sampler requires lights
 bool is_sampler_lit(const trace_params& params);
 
-// Trace state
+// Trace state. For adaptive sampling, `moments` holds the mean squared
+// luminance of pixels, and `errors` the error of each image tile.
 struct trace_state {
   image<vec4f>     render   = {};
   image<vec3f>     albedo   = {};
@@ -164,6 +205,8 @@ struct trace_state {
   image<int>       hits     = {};
   image<rng_state> rngs     = {};
   image<vec4f>     denoised = {};
+  image<float>     moments  = {};
+  image<float>     errors   = {};
   int              samples  = 0;
 
   vec2i size() const { return render.size(); }
@@ -188,6 +231,19 @@ void trace_sample(trace_state& state, const scene_data& scene,
     const trace_bvh& bvh, const trace_lights& lights, int i, int j, int sample,
     const trace_params& params);
 
+// Check whether all samples are done, or all tiles have converged for
+// adaptive sampling.
+bool is_trace_converged(const trace_state& state, const trace_params& params);
+
+// Progressively computes an image in batches until converged. With a time
+// budget, batches are sized to fit the remaining time, counting `elapsed`
+// seconds spent before, e.g. for loading, and denoising is done only once at
+// the end. `progress(state, batch)` is called after each batch.
+void trace_budgeted(trace_state& state, const scene_data& scene,
+    const trace_bvh& bvh, const trace_lights& lights,
+    const trace_params& params, double elapsed = 0,
+    const function<void(const trace_state&, int)>& progress = {});
+
 // Get resulting render, denoised if requested
 image<vec4f> get_image(const trace_state& state);
 void         get_image(image<vec4f>& image, const trace_state& state);
@@ -211,6 +267,19 @@ void         denoise_image(vector<vec4f>& denoised, int width, int height,
             const vector<vec4f>& render, const vector<vec3f>& albedo,
             const vector<vec3f>& normal);
 
+// Load/save a trace state, as a checkpoint to resume rendering. The file
+// stores the state images, including random number generators, as laid out
+// in memory, so that rendering continues exactly as if not interrupted.
+// Denoised images are not stored. The file also stores a hash of the scene
+// and of the params that change the samples, and loading checks it and the
+// image sizes. Only the number of samples and the bvh options can change on
+// resume. Files are only valid on machines with the same layout.
+// Throws std::runtime_error on errors.
+trace_state load_trace_state(const string& filename, const scene_data& scene,
+    const trace_params& params);
+void        save_trace_state(const string& filename, const trace_state& state,
+           const scene_data& scene, const trace_params& params);
+
 // Async implementation
 struct trace_context {
   std::future<void> worker = {};
@@ -247,7 +316,7 @@ namespace yocto {
 // trace sampler names
 inline const auto trace_sampler_names = vector<string>{"path", "pathdirect",
     "pathmis", "pathtest", "lightsampling", "naive", "eyelight", "furnace",
-    "falsecolor"};
+    "falsecolor", "wavefront"};
 
 // false color names
 inline const auto trace_falsecolor_names = vector<string>{"position", "normal",
@@ -265,7 +334,8 @@ inline const auto trace_sampler_labels =
         {trace_sampler_type::naive, "naive"},
         {trace_sampler_type::eyelight, "eyelight"},
         {trace_sampler_type::furnace, "furnace"},
-        {trace_sampler_type::falsecolor, "falsecolor"}};
+        {trace_sampler_type::falsecolor, "falsecolor"},
+        {trace_sampler_type::wavefront, "wavefront"}};
 
 // false color labels
 inline const auto trace_falsecolor_labels =